@@ -1,16 +1,30 @@
 #ifndef HAMT_CACHE_H
 #define HAMT_CACHE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include "hamt.h"
 
+/* Maximum number of pools (one per table size): pool i serves tables of
+ * i + 2 nodes, i.e. the header and i + 1 rows */
+#define HAMT_TABLE_CACHE_MAX_POOLS 32
+
 /* Table cache for the Hash Array-Mapped Trie. Opaque. */
 struct hamt_table_cache;
 /* User-facing configuration options for the table cache. */
 struct hamt_table_cache_config {
     ptrdiff_t bucket_count;
-    ptrdiff_t *initial_bucket_sizes;  /* in # of tables */
+    ptrdiff_t *initial_bucket_sizes;  /* in # of tables; NULL: empty */
     struct hamt_allocator *backing_allocator;
+    bool concurrent;  /* thread-safe, with per-thread magazines */
+    bool adaptive;    /* size chunks by demand, up to max_chunk_bytes each */
+    /* optional: allocator of the chunk buffers, e.g. a page allocator (see
+     * page_allocator.h); NULL: backing_allocator */
+    struct hamt_allocator *chunk_allocator;
+    size_t max_chunk_bytes; /* adaptive caches; 0: 1 MiB */
+    /* optional: round chunks that the cache grows by up to multiples of this
+     * size, e.g. the huge page size of chunk_allocator; 0: no rounding */
+    size_t chunk_page_size;
 };
 /* Default cache user parameter config */
 extern struct hamt_table_cache_config hamt_table_cache_config_default;
@@ -19,4 +33,27 @@ struct hamt_table_cache *hamt_table_cache_create(struct hamt_table_cache_config
 void hamt_table_cache_delete(struct hamt_table_cache *cache);
 struct hamt_node *hamt_table_cache_alloc(struct hamt_table_cache *cache, size_t n);
 void hamt_table_cache_free(struct hamt_table_cache *cache, size_t n, void *p);
+size_t hamt_table_cache_trim(struct hamt_table_cache *cache);
+
+/* Statistics of a single pool; sizes in tables unless noted otherwise */
+struct hamt_table_pool_stats {
+    size_t table_size;  /* in # of nodes, i.e. rows plus header */
+    size_t live;        /* handed out and not returned */
+    size_t free;        /* available for reuse without touching the chunks */
+    size_t peak;        /* tables served from chunks (high-water mark) */
+    size_t chunk_count;
+    size_t chunk_bytes; /* memory reserved by the chunks */
+    size_t alloc_count; /* total allocations (WITH_TABLE_CACHE_STATS only) */
+    size_t free_count;  /* total frees (WITH_TABLE_CACHE_STATS only) */
+};
+
+struct hamt_table_cache_stats {
+    size_t pool_count;
+    size_t live_bytes;  /* memory of all live tables */
+    size_t chunk_bytes; /* memory reserved by all pools */
+    struct hamt_table_pool_stats pools[HAMT_TABLE_CACHE_MAX_POOLS];
+};
+
+void hamt_table_cache_stats(struct hamt_table_cache *cache,
+                            struct hamt_table_cache_stats *stats);
 #endif
@@ -4,9 +4,11 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef int (*hamt_key_cmp_fn)(const void *lhs, const void *rhs);
 typedef uint32_t (*hamt_key_hash_fn)(const void *key, const size_t gen);
+typedef uint64_t (*hamt_key_hash64_fn)(const void *key, const size_t gen);
 
 struct hamt;
 
@@ -40,19 +42,151 @@ struct hamt_config {
 #if defined(WITH_TABLE_CACHE)
     struct hamt_table_cache *cache;
 #endif /* WITH_TABLE_CACHE */
+    /* optional 64 bit hash: if set, it replaces key_hash_fn and every hash
+     * addresses 12 instead of 6 trie levels */
+    hamt_key_hash64_fn key_hash64_fn;
+    /* optional wide root: the root is an array of 32^root_levels slots,
+     * indexed directly by the hash bits of the top root_levels levels (at
+     * most HAMT_MAX_ROOT_LEVELS) */
+    size_t root_levels;
+    /* allocate the trie's tables from a private arena that is released as
+     * a whole with the last version of the trie (see hamt_delete()) */
+    bool arena;
 };
 
+#define HAMT_MAX_ROOT_LEVELS 3
+
 struct hamt *hamt_create(const struct hamt_config *cfg);
+struct hamt *hamt_create_from_array(const struct hamt_config *cfg, void **keys,
+                                    void **values, size_t n);
 void hamt_delete(struct hamt *trie);
+void hamt_release(const struct hamt *trie);
 const void *hamt_get(const struct hamt *trie, void *key);
+size_t hamt_get_many(const struct hamt *trie, void **keys, size_t n,
+                     const void **values);
 const void *hamt_set(struct hamt *trie, void *key, void *value);
 const struct hamt *hamt_pset(const struct hamt *trie, void *key, void *value);
+
+/* Insert-or-update in a single pass: the new value of `key` is the result of
+ * `fn(key, value, ctx)`, where `value` is the current value or NULL */
+typedef void *(*hamt_upsert_fn)(const void *key, const void *value, void *ctx);
+const void *hamt_upsert(struct hamt *trie, void *key, hamt_upsert_fn fn,
+                        void *ctx);
+const struct hamt *hamt_pupsert(const struct hamt *trie, void *key,
+                                hamt_upsert_fn fn, void *ctx);
+const void *hamt_get_or_insert(struct hamt *trie, void *key, void *value);
+
 void *hamt_remove(struct hamt *trie, void *key);
 const struct hamt *hamt_premove(const struct hamt *trie, void *key);
+const struct hamt *hamt_pset_many(const struct hamt *trie, void **keys,
+                                  void **values, size_t n);
+const struct hamt *hamt_premove_many(const struct hamt *trie, void **keys,
+                                     size_t n);
+
+/* Integer keys: create the trie with hamt_int_create(), which ignores the key
+ * functions of `cfg`; iterators return keys as (void *)(uintptr_t)key.
+ * Requires 64 bit pointers. */
+#if UINTPTR_MAX >= UINT64_MAX
+struct hamt *hamt_int_create(const struct hamt_config *cfg);
+const void *hamt_int_get(const struct hamt *trie, uint64_t key);
+const void *hamt_int_set(struct hamt *trie, uint64_t key, void *value);
+const struct hamt *hamt_int_pset(const struct hamt *trie, uint64_t key,
+                                 void *value);
+void *hamt_int_remove(struct hamt *trie, uint64_t key);
+const struct hamt *hamt_int_premove(const struct hamt *trie, uint64_t key);
+#endif
+
+struct hamt *hamt_transient(const struct hamt *trie);
+const struct hamt *hamt_persistent(struct hamt *trie);
 size_t hamt_size(const struct hamt *trie);
 
-struct hamt_iterator;
+/* Structure statistics; depth 0 refers to the root table */
+#define HAMT_STATS_MAX_DEPTH 32
+
+struct hamt_stats {
+    size_t leaves;     /* key/value rows */
+    size_t tables;     /* internal nodes */
+    size_t buckets;    /* collision buckets (tables that hold colliding keys) */
+    size_t max_depth;  /* of the deepest leaf */
+    size_t bytes;      /* trie handle and tables, incl. shared tables */
+    size_t depth[HAMT_STATS_MAX_DEPTH]; /* leaves per depth (last: deeper) */
+    size_t rows[33];   /* tables per row count */
+};
+
+void hamt_stats(const struct hamt *trie, struct hamt_stats *stats);
+
+/* Concurrent maps: hamt_cmap_create() returns NULL for a configuration that
+ * sets root_levels or arena */
+struct hamt_cmap;
+
+struct hamt_cmap *hamt_cmap_create(const struct hamt_config *cfg);
+void hamt_cmap_delete(struct hamt_cmap *cmap);
+const void *hamt_cmap_get(struct hamt_cmap *cmap, void *key);
+const void *hamt_cmap_set(struct hamt_cmap *cmap, void *key, void *value);
+void *hamt_cmap_remove(struct hamt_cmap *cmap, void *key);
+size_t hamt_cmap_size(struct hamt_cmap *cmap);
+
+/* Key sets: tries that store keys only (cf. hamt_set() for tries) */
+struct hamt_set;
 
+typedef int (*hamt_set_foreach_fn)(const void *key, void *ctx);
+
+struct hamt_set *hamt_set_create(const struct hamt_config *cfg);
+void hamt_set_delete(struct hamt_set *set);
+void hamt_set_release(const struct hamt_set *set);
+size_t hamt_set_size(const struct hamt_set *set);
+bool hamt_set_contains(const struct hamt_set *set, const void *key);
+int hamt_set_add(struct hamt_set *set, void *key);
+void *hamt_set_remove(struct hamt_set *set, const void *key);
+const struct hamt_set *hamt_set_padd(const struct hamt_set *set, void *key);
+const struct hamt_set *hamt_set_premove(const struct hamt_set *set,
+                                        const void *key);
+int hamt_set_foreach(const struct hamt_set *set, hamt_set_foreach_fn fn,
+                     void *ctx);
+
+struct hamt_atom;
+
+struct hamt_atom *hamt_atom_create(const struct hamt *trie);
+void hamt_atom_delete(struct hamt_atom *atom);
+const struct hamt *hamt_atom_read_begin(struct hamt_atom *atom);
+void hamt_atom_read_end(struct hamt_atom *atom);
+/* The current version without a read section, i.e. an uncounted reference
+ * that stays valid only as long as no other thread replaces the version:
+ * for the single writer of an atom. With multiple writers, load the version
+ * with hamt_atom_read_begin() and end the section after the exchange. */
+const struct hamt *hamt_atom_load(struct hamt_atom *atom);
+bool hamt_atom_store(struct hamt_atom *atom, const struct hamt *trie);
+bool hamt_atom_compare_exchange(struct hamt_atom *atom,
+                                const struct hamt **expected,
+                                const struct hamt *desired);
+/* Release the replaced versions that no read section can still see, without
+ * waiting for further stores; true if none of the versions replaced by the
+ * calling thread (or by threads that have exited) remain */
+bool hamt_atom_reclaim(struct hamt_atom *atom);
+
+/* Number of trie levels an iterator tracks without heap allocation */
+#define HAMT_ITERATOR_INLINE_DEPTH 16
+
+struct hamt_node;
+
+struct hamt_iterator_frame {
+    const struct hamt_node *table;
+    uint32_t size; /* number of rows in table */
+    uint32_t pos;  /* next row to visit */
+};
+
+/* Iterators may live on the stack, see hamt_it_init()/hamt_it_fini() */
+struct hamt_iterator {
+    const struct hamt *trie;
+    const struct hamt_node *cur;
+    size_t depth;                      /* number of frames in use */
+    size_t capacity;                   /* number of available frames */
+    struct hamt_iterator_frame *heap;  /* frames beyond the inline depth */
+    struct hamt_iterator_frame frames[HAMT_ITERATOR_INLINE_DEPTH];
+};
+
+void hamt_it_init(struct hamt_iterator *it, const struct hamt *trie);
+void hamt_it_fini(struct hamt_iterator *it);
 struct hamt_iterator *hamt_it_create(struct hamt *trie);
 void hamt_it_delete(struct hamt_iterator *it);
 bool hamt_it_valid(struct hamt_iterator *it);
@@ -60,4 +194,99 @@ struct hamt_iterator *hamt_it_next(struct hamt_iterator *it);
 const void *hamt_it_get_key(struct hamt_iterator *it);
 const void *hamt_it_get_value(struct hamt_iterator *it);
 
+/* Callback for hamt_foreach(); a non-zero return value stops the traversal */
+typedef int (*hamt_foreach_fn)(const void *key, const void *value, void *ctx);
+
+int hamt_foreach(const struct hamt *trie, hamt_foreach_fn fn, void *ctx);
+
+/*
+ * Parallel reduction: every thread accumulates the pairs it visits into its
+ * own accumulator of `acc_size` bytes, accumulators are combined at the end.
+ */
+struct hamt_reducer {
+    size_t acc_size;
+    void (*accumulate)(void *acc, const void *key, const void *value,
+                       void *ctx);
+    void (*combine)(void *acc, const void *other, void *ctx);
+};
+
+int hamt_par_foreach(const struct hamt *trie, size_t n_threads,
+                     hamt_foreach_fn fn, void *ctx);
+void hamt_par_reduce(const struct hamt *trie, size_t n_threads,
+                     const struct hamt_reducer *reducer, void *result,
+                     void *ctx);
+
+/*
+ * Callback for hamt_diff(): called for every key whose value differs
+ * between `a` and `b`; the value of a key that is missing in one of the
+ * versions is NULL. A non-zero return value stops the comparison.
+ */
+typedef int (*hamt_diff_fn)(const void *key, const void *value_a,
+                            const void *value_b, void *ctx);
+/* Conflict resolution for keys present in both versions (with different
+ * values) in hamt_merge() and hamt_intersect() */
+typedef void *(*hamt_merge_fn)(const void *key, const void *value_a,
+                               const void *value_b, void *ctx);
+
+int hamt_diff(const struct hamt *a, const struct hamt *b, hamt_diff_fn fn,
+              void *ctx);
+const struct hamt *hamt_merge(const struct hamt *a, const struct hamt *b,
+                              hamt_merge_fn fn, void *ctx);
+const struct hamt *hamt_intersect(const struct hamt *a, const struct hamt *b,
+                                  hamt_merge_fn fn, void *ctx);
+/* Change feed from `from` to `to`; callbacks may be NULL */
+int hamt_changes(const struct hamt *from, const struct hamt *to,
+                 hamt_foreach_fn on_add, hamt_foreach_fn on_remove,
+                 hamt_diff_fn on_update, void *ctx);
+bool hamt_equal(const struct hamt *a, const struct hamt *b);
+
+/*
+ * Serialization: the codec returns the bytes (and sets their number in
+ * `len`) that represent a key or value in the image. Images have a single
+ * root table, i.e. hamt_serialize() returns -1 for a trie with root_levels.
+ */
+typedef const void *(*hamt_encode_fn)(const void *obj, size_t *len,
+                                      void *ctx);
+
+struct hamt_codec {
+    hamt_encode_fn encode_key;
+    hamt_encode_fn encode_value;
+    void *ctx;
+};
+
+int hamt_serialize(const struct hamt *trie, FILE *f,
+                   const struct hamt_codec *codec);
+
+/* Read-only trie served directly from a mapped image */
+struct hamt_mapped;
+
+struct hamt_mapped *hamt_open_mapped(const char *path,
+                                     const struct hamt_config *cfg);
+void hamt_mapped_close(struct hamt_mapped *m);
+size_t hamt_mapped_size(const struct hamt_mapped *m);
+const void *hamt_mapped_get(const struct hamt_mapped *m, const void *key);
+int hamt_mapped_foreach(const struct hamt_mapped *m, hamt_foreach_fn fn,
+                        void *ctx);
+
+/*
+ * Incremental snapshots of persistent versions, streamed in chunks of
+ * `chunk_size` bytes to `write` (which returns 0 on success). Tables that
+ * have been written by the previous snapshot are not written again. Steps
+ * release earlier versions: stepping on another thread than the one that
+ * modifies the trie needs WITH_ATOMIC_REFCOUNTS and a concurrent table
+ * cache. Like hamt_serialize(), begin() returns -1 for a wide root.
+ */
+typedef int (*hamt_write_fn)(const void *buf, size_t len, void *ctx);
+
+struct hamt_snapshot_writer;
+
+struct hamt_snapshot_writer *
+hamt_snapshot_writer_create(struct hamt_allocator *ator,
+                            const struct hamt_codec *codec, hamt_write_fn write,
+                            void *ctx, size_t chunk_size);
+void hamt_snapshot_writer_delete(struct hamt_snapshot_writer *w);
+int hamt_snapshot_writer_begin(struct hamt_snapshot_writer *w,
+                               const struct hamt *trie);
+int hamt_snapshot_writer_step(struct hamt_snapshot_writer *w);
+
 #endif /* HAMT_H */
@@ -0,0 +1,124 @@
+/*
+ * Compile-time specialized tries.
+ *
+ * This header generates typed query and modification functions for one key
+ * and value type, with the key hash and key equality inlined into the core
+ * search, insert and remove functions:
+ *
+ *   #define HAMT_NAME strmap
+ *   #define HAMT_KEY_TYPE const char
+ *   #define HAMT_VALUE_TYPE struct entry
+ *   #define HAMT_HASH(key, gen) wyhash64(key, strlen(key), gen)
+ *   #define HAMT_EQ(lhs, rhs) (strcmp(lhs, rhs) == 0)
+ *   #include "hamt_define.h"
+ *
+ * defines strmap_create(), strmap_get(), strmap_set(), strmap_pset(),
+ * strmap_remove() and strmap_premove(). Keys and values are passed as
+ * pointers to HAMT_KEY_TYPE and HAMT_VALUE_TYPE; HAMT_HASH() must return a
+ * 64 bit hash of `key` that differs between generations `gen`.
+ *
+ * The generated functions operate on ordinary `struct hamt` tries: all other
+ * functions of the library (iterators, hamt_delete(), hamt_diff(), ...) work
+ * on them as well. The header may be included repeatedly with different
+ * parameters and requires the `src` directory on the include path; the
+ * translation unit must be compiled with the same configuration flags
+ * (WITH_TABLE_CACHE, WITH_LEAF_HASHES, WITH_CHAMP_LAYOUT, ...) as the
+ * library.
+ */
+
+#include "hamt.h"
+#include "hamt_impl.h"
+
+#if !defined(HAMT_NAME) || !defined(HAMT_KEY_TYPE) ||                      \
+    !defined(HAMT_VALUE_TYPE) || !defined(HAMT_HASH) || !defined(HAMT_EQ)
+#error "hamt_define.h: missing HAMT_NAME, HAMT_*_TYPE, HAMT_HASH or HAMT_EQ"
+#endif
+
+#define HAMT_DEFINE_CAT_(prefix, name) prefix##_##name
+#define HAMT_DEFINE_CAT(prefix, name) HAMT_DEFINE_CAT_(prefix, name)
+#define HAMT_DEFINE_FN(name) HAMT_DEFINE_CAT(HAMT_NAME, name)
+
+/* Key functions for the generic code paths; see HAMT_NAME_create() */
+static uint64_t HAMT_DEFINE_FN(key_hash)(const void *key, const size_t gen)
+{
+    return HAMT_HASH((HAMT_KEY_TYPE *)key, gen);
+}
+
+static int HAMT_DEFINE_FN(key_cmp)(const void *lhs, const void *rhs)
+{
+    return !HAMT_EQ((HAMT_KEY_TYPE *)lhs, (HAMT_KEY_TYPE *)rhs);
+}
+
+#define CORE_FN(name) HAMT_DEFINE_FN(core_##name)
+#define CORE_HASH(hash, key, gen) HAMT_HASH((HAMT_KEY_TYPE *)(key), gen)
+#define CORE_KEY_EQ(cmp_eq, lhs, rhs)                                      \
+    HAMT_EQ((HAMT_KEY_TYPE *)(lhs), (HAMT_KEY_TYPE *)(rhs))
+#include "hamt_core.h"
+
+/* Create a trie; ignores the key functions of `cfg` */
+static inline struct hamt *HAMT_DEFINE_FN(create)(const struct hamt_config *cfg)
+{
+    struct hamt_config typed_cfg = *cfg;
+    typed_cfg.key_cmp_fn = HAMT_DEFINE_FN(key_cmp);
+    typed_cfg.key_hash_fn = NULL;
+    typed_cfg.key_hash64_fn = HAMT_DEFINE_FN(key_hash);
+    return hamt_create(&typed_cfg);
+}
+
+static inline const HAMT_VALUE_TYPE *
+HAMT_DEFINE_FN(get)(const struct hamt *trie, HAMT_KEY_TYPE *key)
+{
+    struct hash_state *hash =
+        HAMT_DEFINE_FN(core_hash_start)(&(struct hash_state){0}, trie, key);
+    struct hamt_node *leaf = HAMT_DEFINE_FN(core_lookup)(
+        root_slot(trie, trie->root, hash), hash, trie->key_cmp, key);
+    return leaf ? (const HAMT_VALUE_TYPE *)untagged(VALUE(leaf)) : NULL;
+}
+
+static inline const HAMT_VALUE_TYPE *HAMT_DEFINE_FN(set)(
+    struct hamt *trie, HAMT_KEY_TYPE *key, HAMT_VALUE_TYPE *value)
+{
+    const struct hamt_node *n = HAMT_DEFINE_FN(core_set)(
+        trie, trie->root, (void *)key, (void *)value);
+    return (const HAMT_VALUE_TYPE *)untagged(VALUE(n));
+}
+
+static inline const struct hamt *HAMT_DEFINE_FN(pset)(
+    const struct hamt *trie, HAMT_KEY_TYPE *key, HAMT_VALUE_TYPE *value)
+{
+    struct hamt *cp = hamt_copy_shallow(trie);
+    HAMT_DEFINE_FN(set)(cp, key, value);
+    return cp;
+}
+
+static inline HAMT_VALUE_TYPE *HAMT_DEFINE_FN(remove)(struct hamt *trie,
+                                                      HAMT_KEY_TYPE *key)
+{
+    struct hash_state *hash =
+        HAMT_DEFINE_FN(core_hash_start)(&(struct hash_state){0}, trie, key);
+    struct hamt_node *slot = root_slot(trie, trie->root, hash);
+    struct remove_result rr = HAMT_DEFINE_FN(core_rem)(
+        trie, slot, slot, hash, trie->key_cmp, key);
+    if (rr.status == REMOVE_SUCCESS || rr.status == REMOVE_GATHERED) {
+        trie->size -= 1;
+        return (HAMT_VALUE_TYPE *)untagged(rr.value);
+    }
+    return NULL;
+}
+
+static inline const struct hamt *HAMT_DEFINE_FN(premove)(
+    const struct hamt *trie, HAMT_KEY_TYPE *key)
+{
+    struct hamt *cp = hamt_copy_shallow(trie);
+    HAMT_DEFINE_FN(remove)(cp, key);
+    return cp;
+}
+
+#undef HAMT_DEFINE_FN
+#undef HAMT_DEFINE_CAT
+#undef HAMT_DEFINE_CAT_
+#undef HAMT_NAME
+#undef HAMT_KEY_TYPE
+#undef HAMT_VALUE_TYPE
+#undef HAMT_HASH
+#undef HAMT_EQ
@@ -0,0 +1,25 @@
+#ifndef HAMT_PAGE_ALLOCATOR_H
+#define HAMT_PAGE_ALLOCATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "hamt.h"
+
+/*
+ * Page allocator. Maps every allocation directly from the OS, optionally
+ * with huge pages and on a preferred NUMA node. Sizes are rounded up to
+ * whole (huge) pages, i.e. this is a backing allocator for large buffers
+ * such as the chunks of a table cache (see `chunk_allocator` in cache.h)
+ * rather than a general-purpose one.
+ */
+struct hamt_page_allocator_config {
+    size_t huge_page_size; /* 0: base pages, else e.g. 2 MiB or 1 GiB */
+    bool transparent;      /* transparent huge pages instead of hugetlbfs */
+    bool numa_bind;        /* prefer `numa_node` for all pages (Linux) */
+    int numa_node;
+};
+
+struct hamt_allocator *
+hamt_page_allocator_create(const struct hamt_page_allocator_config *cfg);
+void hamt_page_allocator_delete(struct hamt_allocator *ator);
+#endif
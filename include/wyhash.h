@@ -0,0 +1,9 @@
+#ifndef WYHASH_H
+#define WYHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+uint64_t wyhash64(const void *key, size_t len, uint64_t seed);
+
+#endif
@@ -1,6 +1,9 @@
 #include "cache.h"
 #include "internal_types.h"
 
+#include <pthread.h>
+#include <stdlib.h> /* for qsort */
+
 /* debugging and assertions */
 #include <assert.h>
 #if !defined(NDEBUG)
@@ -9,11 +12,21 @@
 #define TABLE_CACHE_DEBUG_FREELIST_INITIALIZER 0x42
 #endif
 
+/* Tables have up to 32 rows plus one header row */
+#define TABLE_CACHE_MAX_POOLS HAMT_TABLE_CACHE_MAX_POOLS
+/* Number of tables a per-thread magazine holds (concurrent caches only) */
+#define TABLE_CACHE_MAGAZINE_SIZE 64
+/* Size of the first chunk of an empty pool, in tables */
+#define TABLE_CACHE_MIN_CHUNK 64
+/* Default chunk size limit of adaptive caches */
+#define TABLE_CACHE_MAX_CHUNK_BYTES (1 << 20)
+
 ptrdiff_t hamt_table_cache_config_default_bucket_count = 32;
 ptrdiff_t hamt_table_cache_default_bucket_sizes[32] = {
-    10000, 338900, 220200, 155800, 86700, 39500, 15000, 4900, 4900, 5200, 5000,
-    4900,  4700,   4600,   4600,   4600,  4200,  4600,  4700, 4300, 4600, 4800,
-    4500,  5100,   5100,   5300,   5500,  5900,  7000,  8000, 9900, 6900};
+    10000, 338900, 220200, 155800, 86700, 39500, 15000, 4900,
+    4900,  5200,   5000,   4900,   4700,  4600,  4600,  4600,
+    4200,  4600,   4700,   4300,   4600,  4800,  4500,  5100,
+    5100,  5300,   5500,   5900,   7000,  8000,  9900,  6900};
 
 #if defined(WITH_TABLE_CACHE_STATS)
 struct table_allocator_stats {
@@ -39,19 +52,58 @@ struct table_allocator {
     size_t chunk_count;                  /* number of chunks in the pool */
     ptrdiff_t table_size;                /* number of rows in table */
     struct table_allocator_freelist *fl; /* head of the free list */
+    ptrdiff_t fl_size;                   /* number of tables on the list */
+    ptrdiff_t max_chunk;                 /* max. chunk size (0: none) */
+    size_t chunk_page;                   /* chunk granularity in bytes */
+    struct hamt_allocator *chunk_ator;   /* allocator of the chunk buffers */
 #if defined(WITH_TABLE_CACHE_STATS)
     struct table_allocator_stats stats; /* statistics */
 #endif
 };
 
+/*
+ * Concurrent caches put a magazine layer in front of the pools: every
+ * thread keeps two magazines (stacks of free tables) per size class and
+ * serves allocations and frees from those without synchronization. Only
+ * when both are exhausted (or full) does a thread exchange a magazine with
+ * the shared, locked depot of its size class; the pools themselves are
+ * only touched (under the depot lock) to refill magazines.
+ */
+struct table_magazine {
+    struct table_magazine *next; /* next magazine in the depot */
+    ptrdiff_t rounds;            /* number of tables in the magazine */
+    void *tables[TABLE_CACHE_MAGAZINE_SIZE];
+};
+
+struct table_depot {
+    pthread_mutex_t lock;         /* protects the depot and its pool */
+    struct table_magazine *full;  /* list of non-empty magazines */
+    struct table_magazine *empty; /* list of empty magazines */
+};
+
+struct table_cache_local {
+    struct table_cache_local *next; /* next thread-local cache */
+    struct hamt_table_cache *cache;
+    struct table_magazine *loaded[TABLE_CACHE_MAX_POOLS];
+    struct table_magazine *previous[TABLE_CACHE_MAX_POOLS];
+};
+
 struct hamt_table_cache {
-    struct table_allocator pools[32];
+    struct table_allocator pools[TABLE_CACHE_MAX_POOLS];
+    ptrdiff_t pool_count;
     struct hamt_allocator *backing_allocator;
+    bool concurrent;
+    /* concurrent caches only */
+    pthread_key_t local_key;          /* thread-local magazines */
+    pthread_mutex_t lock;             /* protects the list of locals */
+    struct table_cache_local *locals; /* all thread-local magazines */
+    struct table_depot depots[TABLE_CACHE_MAX_POOLS];
 };
 
 int table_allocator_create(struct table_allocator *pool,
                            ptrdiff_t initial_cache_size, ptrdiff_t table_size,
-                           struct hamt_allocator *backing_allocator)
+                           struct hamt_allocator *backing_allocator,
+                           struct hamt_allocator *chunk_allocator)
 {
     /* pool config */
     *pool = (struct table_allocator){.chunk = NULL,
@@ -59,23 +111,32 @@ int table_allocator_create(struct table_allocator *pool,
                                      .buf_ix = 0,
                                      .chunk_count = 1,
                                      .table_size = table_size,
-                                     .fl = NULL};
+                                     .fl = NULL,
+                                     .fl_size = 0,
+                                     .max_chunk = 0,
+                                     .chunk_page = 0,
+                                     .chunk_ator = chunk_allocator};
+#if defined(WITH_TABLE_CACHE_STATS)
+    /* set up stats storage */
+    pool->stats =
+        (struct table_allocator_stats){.alloc_count = 0, .free_count = 0};
+#endif
+    if (initial_cache_size == 0) {
+        /* allocate the first chunk on demand */
+        pool->chunk_count = 0;
+        return 0;
+    }
     /* set up initial chunk */
     pool->chunk = backing_allocator->malloc(
         sizeof(struct table_allocator_chunk), backing_allocator->ctx);
     if (!pool->chunk)
         goto err_no_cleanup;
     pool->chunk->size = initial_cache_size * table_size;
-    pool->chunk->buf = (struct hamt_node *)backing_allocator->malloc(
-        pool->chunk->size * sizeof(struct hamt_node), backing_allocator->ctx);
+    pool->chunk->buf = (struct hamt_node *)chunk_allocator->malloc(
+        pool->chunk->size * sizeof(struct hamt_node), chunk_allocator->ctx);
     if (!pool->chunk->buf)
         goto err_free_chunk;
     pool->chunk->next = NULL;
-#if defined(WITH_TABLE_CACHE_STATS)
-    /* set up stats storage */
-    pool->stats =
-        (struct table_allocator_stats){.alloc_count = 0, .free_count = 0};
-#endif
     return 0;
 err_free_chunk:
     backing_allocator->free(pool->chunk, sizeof(struct table_allocator_chunk),
@@ -92,9 +153,9 @@ void table_allocator_delete(struct table_allocator *pool,
     struct table_allocator_chunk *current_chunk = pool->chunk, *next_chunk;
     /* free all buffers in all chunks */
     while (current_chunk) {
-        backing_allocator->free(current_chunk->buf,
-                                current_chunk->size * sizeof(struct hamt_node),
-                                backing_allocator->ctx);
+        pool->chunk_ator->free(current_chunk->buf,
+                               current_chunk->size * sizeof(struct hamt_node),
+                               pool->chunk_ator->ctx);
         next_chunk = current_chunk->next;
         backing_allocator->free(current_chunk,
                                 sizeof(struct table_allocator_chunk),
@@ -103,6 +164,32 @@ void table_allocator_delete(struct table_allocator *pool,
     }
 }
 
+/*
+ * Number of tables in the next chunk of `pool`. Classic pools double the
+ * chunk size every time; adaptive pools add as many tables as are in use
+ * (the free list is empty when a chunk is added), up to max_chunk.
+ */
+static ptrdiff_t table_allocator_chunk_size(const struct table_allocator *pool)
+{
+    ptrdiff_t n;
+    if (!pool->max_chunk) {
+        n = pool->chunk ? 2 * pool->chunk->size / pool->table_size
+                        : TABLE_CACHE_MIN_CHUNK;
+    } else {
+        n = pool->size;
+        if (n < TABLE_CACHE_MIN_CHUNK)
+            n = TABLE_CACHE_MIN_CHUNK;
+        if (n > pool->max_chunk)
+            n = pool->max_chunk;
+    }
+    if (!pool->chunk_page)
+        return n;
+    /* fill whole (huge) pages; max_chunk covers whole pages as well */
+    size_t table_bytes = pool->table_size * sizeof(struct hamt_node);
+    size_t pages = (n * table_bytes + pool->chunk_page - 1) / pool->chunk_page;
+    return pages * pool->chunk_page / table_bytes;
+}
+
 /**
  * Return a pointer to a hamt_node array of size table_size.
  */
@@ -117,6 +204,7 @@ table_allocator_alloc(struct table_allocator *pool,
     if (pool->fl) {
         struct table_allocator_freelist *f = pool->fl;
         pool->fl = pool->fl->next;
+        pool->fl_size--;
 # if !defined(NDEBUG)
         /* debug: clear the pointer info with known value */
         memset(f, TABLE_CACHE_DEBUG_FREELIST_INITIALIZER, sizeof(struct hamt_node*));
@@ -124,18 +212,20 @@ table_allocator_alloc(struct table_allocator *pool,
         return (struct hamt_node *)f;
     }
     /* freelist is empty, serve from chunk */
-    if (pool->buf_ix == pool->chunk->size) {
+    if (!pool->chunk || pool->buf_ix == pool->chunk->size) {
         /* if chunk has no capacity left, create new one */
         struct table_allocator_chunk *chunk = backing_allocator->malloc(
             sizeof(struct table_allocator_chunk), backing_allocator->ctx);
         if (!chunk)
             goto err_no_cleanup;
-        /* double size of new chunk compared to previous */
-        chunk->size = pool->chunk->size * 2;
-        chunk->buf = (struct hamt_node *)backing_allocator->malloc(
-            chunk->size * sizeof(struct hamt_node), backing_allocator->ctx);
-        if (!chunk->buf)
-            goto err_free_chunk;
+        chunk->size = table_allocator_chunk_size(pool) * pool->table_size;
+        chunk->buf = (struct hamt_node *)pool->chunk_ator->malloc(
+            chunk->size * sizeof(struct hamt_node), pool->chunk_ator->ctx);
+        if (!chunk->buf) {
+            backing_allocator->free(chunk, sizeof *chunk,
+                                    backing_allocator->ctx);
+            goto err_no_cleanup;
+        }
 #if !defined(NDEBUG)
         /* debug: initialize the chunk to known values */
         memset(chunk->buf, TABLE_CACHE_DEBUG_CHUNK_INITIALIZER,
@@ -151,10 +241,6 @@ table_allocator_alloc(struct table_allocator *pool,
     pool->buf_ix += pool->table_size;
     pool->size++;
     return p;
-err_free_chunk:
-    backing_allocator->free(pool->chunk, sizeof(struct table_allocator_chunk),
-                            backing_allocator->ctx);
-    pool->chunk = NULL;
 err_no_cleanup:
     return NULL;
 }
@@ -174,6 +260,202 @@ void table_allocator_free(struct table_allocator *pool, void *p)
         (struct table_allocator_freelist *)p;
     head->next = pool->fl;
     pool->fl = head;
+    pool->fl_size++;
+}
+
+static struct table_magazine *
+depot_get_empty(struct hamt_table_cache *cache, struct table_depot *depot)
+{
+    struct table_magazine *m = depot->empty;
+    if (m) {
+        depot->empty = m->next;
+        return m;
+    }
+    m = cache->backing_allocator->malloc(sizeof *m,
+                                         cache->backing_allocator->ctx);
+    if (m)
+        m->rounds = 0;
+    return m;
+}
+
+static void depot_put(struct table_depot *depot, struct table_magazine *m)
+{
+    if (m->rounds > 0) {
+        m->next = depot->full;
+        depot->full = m;
+    } else {
+        m->next = depot->empty;
+        depot->empty = m;
+    }
+}
+
+static void depot_delete(struct hamt_table_cache *cache,
+                         struct table_depot *depot)
+{
+    struct table_magazine *lists[2] = {depot->full, depot->empty};
+    for (size_t i = 0; i < 2; ++i) {
+        struct table_magazine *m = lists[i], *next;
+        while (m) {
+            next = m->next;
+            cache->backing_allocator->free(m, sizeof *m,
+                                           cache->backing_allocator->ctx);
+            m = next;
+        }
+    }
+    pthread_mutex_destroy(&depot->lock);
+}
+
+/* Return the thread's magazines to the depots */
+static void cache_local_flush(struct table_cache_local *local)
+{
+    struct hamt_table_cache *cache = local->cache;
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+        struct table_depot *depot = &cache->depots[i];
+        pthread_mutex_lock(&depot->lock);
+        if (local->loaded[i])
+            depot_put(depot, local->loaded[i]);
+        if (local->previous[i])
+            depot_put(depot, local->previous[i]);
+        pthread_mutex_unlock(&depot->lock);
+        local->loaded[i] = local->previous[i] = NULL;
+    }
+}
+
+/* Thread exit: unregister the thread-local cache and return its magazines */
+static void cache_local_destroy(void *p)
+{
+    struct table_cache_local *local = p;
+    struct hamt_table_cache *cache = local->cache;
+    pthread_mutex_lock(&cache->lock);
+    struct table_cache_local **l = &cache->locals;
+    while (*l != local)
+        l = &(*l)->next;
+    *l = local->next;
+    pthread_mutex_unlock(&cache->lock);
+    cache_local_flush(local);
+    cache->backing_allocator->free(local, sizeof *local,
+                                   cache->backing_allocator->ctx);
+}
+
+static struct table_cache_local *cache_local(struct hamt_table_cache *cache)
+{
+    struct table_cache_local *local = pthread_getspecific(cache->local_key);
+    if (local)
+        return local;
+    local = cache->backing_allocator->malloc(sizeof *local,
+                                             cache->backing_allocator->ctx);
+    if (!local)
+        return NULL;
+    *local = (struct table_cache_local){.cache = cache};
+    if (pthread_setspecific(cache->local_key, local) != 0) {
+        cache->backing_allocator->free(local, sizeof *local,
+                                       cache->backing_allocator->ctx);
+        return NULL;
+    }
+    pthread_mutex_lock(&cache->lock);
+    local->next = cache->locals;
+    cache->locals = local;
+    pthread_mutex_unlock(&cache->lock);
+    return local;
+}
+
+/*
+ * Both magazines of the thread are empty: swap the empty previous magazine
+ * for a full one from the depot or, if there is none, refill the loaded
+ * magazine from the pool.
+ */
+static struct table_magazine *magazine_reload(struct hamt_table_cache *cache,
+                                              struct table_cache_local *local,
+                                              ptrdiff_t i)
+{
+    struct table_depot *depot = &cache->depots[i];
+    pthread_mutex_lock(&depot->lock);
+    if (depot->full) {
+        struct table_magazine *full = depot->full;
+        depot->full = full->next;
+        if (local->previous[i])
+            depot_put(depot, local->previous[i]);
+        local->previous[i] = local->loaded[i];
+        local->loaded[i] = full;
+    } else {
+        if (!local->loaded[i])
+            local->loaded[i] = depot_get_empty(cache, depot);
+        struct table_magazine *m = local->loaded[i];
+        while (m && m->rounds < TABLE_CACHE_MAGAZINE_SIZE) {
+            struct hamt_node *p = table_allocator_alloc(
+                &cache->pools[i], cache->backing_allocator);
+            if (!p)
+                break;
+            m->tables[m->rounds++] = p;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    struct table_magazine *m = local->loaded[i];
+    return (m && m->rounds > 0) ? m : NULL;
+}
+
+/*
+ * Both magazines of the thread are full: hand the full previous magazine
+ * to the depot and load an empty one.
+ */
+static struct table_magazine *magazine_unload(struct hamt_table_cache *cache,
+                                              struct table_cache_local *local,
+                                              ptrdiff_t i)
+{
+    struct table_depot *depot = &cache->depots[i];
+    pthread_mutex_lock(&depot->lock);
+    struct table_magazine *empty = depot_get_empty(cache, depot);
+    if (empty) {
+        if (local->previous[i])
+            depot_put(depot, local->previous[i]);
+        local->previous[i] = local->loaded[i];
+        local->loaded[i] = empty;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return empty;
+}
+
+static struct hamt_node *magazine_alloc(struct hamt_table_cache *cache,
+                                        ptrdiff_t i)
+{
+    struct table_cache_local *local = cache_local(cache);
+    if (!local)
+        return NULL;
+    struct table_magazine *m = local->loaded[i];
+    if (!m || m->rounds == 0) {
+        struct table_magazine *prev = local->previous[i];
+        if (prev && prev->rounds > 0) {
+            local->previous[i] = m;
+            local->loaded[i] = m = prev;
+        } else if (!(m = magazine_reload(cache, local, i))) {
+            return NULL;
+        }
+    }
+    return m->tables[--m->rounds];
+}
+
+static void magazine_free(struct hamt_table_cache *cache, ptrdiff_t i,
+                          void *p)
+{
+    struct table_cache_local *local = cache_local(cache);
+    struct table_magazine *m = local ? local->loaded[i] : NULL;
+    if (local && (!m || m->rounds == TABLE_CACHE_MAGAZINE_SIZE)) {
+        struct table_magazine *prev = local->previous[i];
+        if (prev && prev->rounds == 0) {
+            local->previous[i] = m;
+            local->loaded[i] = m = prev;
+        } else {
+            m = magazine_unload(cache, local, i);
+        }
+    }
+    if (!m) {
+        /* out of memory for magazines, return the table to the pool */
+        pthread_mutex_lock(&cache->depots[i].lock);
+        table_allocator_free(&cache->pools[i], p);
+        pthread_mutex_unlock(&cache->depots[i].lock);
+        return;
+    }
+    m->tables[m->rounds++] = p;
 }
 
 struct hamt_table_cache *
@@ -182,11 +464,39 @@ hamt_table_cache_create(struct hamt_table_cache_config *cfg)
     struct hamt_table_cache *cache = cfg->backing_allocator->malloc(
         sizeof *cache, cfg->backing_allocator->ctx);
     if (cache) {
+        assert(cfg->bucket_count <= TABLE_CACHE_MAX_POOLS &&
+               "Request for too many buckets");
         cache->backing_allocator = cfg->backing_allocator;
+        cache->pool_count = cfg->bucket_count;
+        cache->concurrent = cfg->concurrent;
         for (ptrdiff_t i = 0; i < cfg->bucket_count; ++i) {
-            table_allocator_create(&cache->pools[i],
-                                   cfg->initial_bucket_sizes[i], i + 1,
-                                   cfg->backing_allocator);
+            table_allocator_create(
+                &cache->pools[i],
+                cfg->initial_bucket_sizes ? cfg->initial_bucket_sizes[i] : 0,
+                i + 2, cfg->backing_allocator,
+                cfg->chunk_allocator ? cfg->chunk_allocator
+                                     : cfg->backing_allocator);
+            size_t page = cfg->chunk_page_size;
+            cache->pools[i].chunk_page = page;
+            if (cfg->adaptive) {
+                size_t bytes = cfg->max_chunk_bytes
+                                   ? cfg->max_chunk_bytes
+                                   : TABLE_CACHE_MAX_CHUNK_BYTES;
+                if (page)
+                    bytes = (bytes + page - 1) / page * page;
+                ptrdiff_t max = bytes / ((i + 2) * sizeof(struct hamt_node));
+                cache->pools[i].max_chunk = max > 0 ? max : 1;
+            }
+        }
+        if (cache->concurrent) {
+            cache->locals = NULL;
+            pthread_key_create(&cache->local_key, cache_local_destroy);
+            pthread_mutex_init(&cache->lock, NULL);
+            for (ptrdiff_t i = 0; i < cfg->bucket_count; ++i) {
+                cache->depots[i] = (struct table_depot){.full = NULL,
+                                                        .empty = NULL};
+                pthread_mutex_init(&cache->depots[i].lock, NULL);
+            }
         }
     }
     return cache;
@@ -194,24 +504,232 @@ hamt_table_cache_create(struct hamt_table_cache_config *cfg)
 
 void hamt_table_cache_delete(struct hamt_table_cache *cache)
 {
-    for (size_t i = 0; i < 32; ++i) {
+    if (cache->concurrent) {
+        /* threads that still hold magazines need not have exited */
+        pthread_key_delete(cache->local_key);
+        while (cache->locals) {
+            struct table_cache_local *local = cache->locals;
+            cache->locals = local->next;
+            cache_local_flush(local);
+            cache->backing_allocator->free(local, sizeof *local,
+                                           cache->backing_allocator->ctx);
+        }
+        pthread_mutex_destroy(&cache->lock);
+        for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+            depot_delete(cache, &cache->depots[i]);
+        }
+    }
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
         table_allocator_delete(&cache->pools[i], cache->backing_allocator);
     }
     cache->backing_allocator = NULL;
 }
 
+/* Delete `cache` along with the cache handle itself (arena tries, see
+ * hamt.c); hamt_table_cache_delete() leaves the handle to the caller */
+void table_cache_destroy(struct hamt_table_cache *cache)
+{
+    struct hamt_allocator *ator = cache->backing_allocator;
+    hamt_table_cache_delete(cache);
+    ator->free(cache, sizeof *cache, ator->ctx);
+}
+
 struct hamt_node *hamt_table_cache_alloc(struct hamt_table_cache *cache,
                                          size_t n)
 {
-    assert(n > 0 && "Request for zero-size allocation");
-    assert(n < 33 && "Request for >32 rows allocation");
-    return table_allocator_alloc(&cache->pools[n - 1],
+    assert(n > 1 && "Request for a table without rows");
+    assert((ptrdiff_t)n - 1 <= cache->pool_count &&
+           "Request for more rows than the cache provides");
+    if (cache->concurrent)
+        return magazine_alloc(cache, n - 2);
+    return table_allocator_alloc(&cache->pools[n - 2],
                                  cache->backing_allocator);
 }
 
 void hamt_table_cache_free(struct hamt_table_cache *cache, size_t n, void *p)
 {
-    assert(n > 0 && "Request for zero-size free");
-    assert(n < 33 && "Request for >32 rows free");
-    table_allocator_free(&cache->pools[n-1], p);
+    assert(n > 1 && "Request to free a table without rows");
+    assert((ptrdiff_t)n - 1 <= cache->pool_count &&
+           "Request for more rows than the cache provides");
+    if (cache->concurrent) {
+        magazine_free(cache, n - 2, p);
+        return;
+    }
+    table_allocator_free(&cache->pools[n - 2], p);
+}
+
+struct chunk_info {
+    struct table_allocator_chunk *chunk;
+    ptrdiff_t carved; /* tables served from the chunk */
+    ptrdiff_t free;   /* of which are on the free list */
+    struct table_allocator_freelist *head, *tail;
+};
+
+static int chunk_info_cmp_addr(const void *lhs, const void *rhs)
+{
+    const struct hamt_node *l = ((const struct chunk_info *)lhs)->chunk->buf;
+    const struct hamt_node *r = ((const struct chunk_info *)rhs)->chunk->buf;
+    return (l > r) - (l < r);
+}
+
+/* Chunks with the fewest free tables first */
+static int chunk_info_cmp_free(const void *lhs, const void *rhs)
+{
+    ptrdiff_t l = ((const struct chunk_info *)lhs)->free;
+    ptrdiff_t r = ((const struct chunk_info *)rhs)->free;
+    return (l > r) - (l < r);
+}
+
+static struct chunk_info *chunk_info_find(struct chunk_info *info, size_t n,
+                                          const void *p)
+{
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((const void *)info[mid].chunk->buf <= p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &info[lo];
+}
+
+/*
+ * Release the chunks of `pool` that only hold free tables and rebuild the
+ * free list such that allocations are served from the fullest chunks first,
+ * which lets the sparse ones drain. Returns the number of bytes released or
+ * -1 if the temporary chunk table could not be allocated.
+ */
+static ptrdiff_t table_allocator_trim(struct table_allocator *pool,
+                                      struct hamt_allocator *backing_allocator)
+{
+    size_t n = pool->chunk_count;
+    if (n == 0)
+        return 0;
+    struct chunk_info *info = backing_allocator->malloc(
+        n * sizeof *info, backing_allocator->ctx);
+    if (!info)
+        return -1;
+    /* carve the rest of the current chunk such that all chunks are used up
+     * and may be reordered */
+    for (; pool->buf_ix < pool->chunk->size; pool->buf_ix += pool->table_size) {
+        table_allocator_free(pool, &pool->chunk->buf[pool->buf_ix]);
+        pool->size++;
+#if defined(WITH_TABLE_CACHE_STATS)
+        pool->stats.free_count--;
+#endif
+    }
+    size_t i = 0;
+    for (struct table_allocator_chunk *c = pool->chunk; c; c = c->next, ++i) {
+        info[i] = (struct chunk_info){.chunk = c,
+                                      .carved = c->size / pool->table_size};
+    }
+    qsort(info, n, sizeof *info, chunk_info_cmp_addr);
+    for (struct table_allocator_freelist *f = pool->fl, *next; f; f = next) {
+        next = f->next;
+        struct chunk_info *ci = chunk_info_find(info, n, f);
+        f->next = ci->head;
+        ci->head = f;
+        if (!ci->tail)
+            ci->tail = f;
+        ci->free++;
+    }
+    qsort(info, n, sizeof *info, chunk_info_cmp_free);
+    ptrdiff_t released = 0;
+    struct table_allocator_chunk **link = &pool->chunk;
+    struct table_allocator_freelist **fl = &pool->fl;
+    pool->fl_size = 0;
+    for (i = 0; i < n; ++i) {
+        struct table_allocator_chunk *c = info[i].chunk;
+        if (info[i].free == info[i].carved) {
+            pool->size -= info[i].carved;
+            released += c->size * sizeof(struct hamt_node) + sizeof *c;
+            pool->chunk_ator->free(c->buf, c->size * sizeof(struct hamt_node),
+                                   pool->chunk_ator->ctx);
+            backing_allocator->free(c, sizeof *c, backing_allocator->ctx);
+            pool->chunk_count--;
+            continue;
+        }
+        *link = c;
+        link = &c->next;
+        if (info[i].head) {
+            *fl = info[i].head;
+            fl = &info[i].tail->next;
+            pool->fl_size += info[i].free;
+        }
+    }
+    *link = NULL;
+    *fl = NULL;
+    pool->buf_ix = pool->chunk ? pool->chunk->size : 0;
+    backing_allocator->free(info, n * sizeof *info, backing_allocator->ctx);
+    return released;
+}
+
+/*
+ * Return the memory of fully free chunks to the backing allocator. The
+ * tables in the depots of a concurrent cache go back to their pools first;
+ * tables in the per-thread magazines stay where they are.
+ */
+size_t hamt_table_cache_trim(struct hamt_table_cache *cache)
+{
+    size_t released = 0;
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+        struct table_allocator *pool = &cache->pools[i];
+        if (cache->concurrent) {
+            struct table_depot *depot = &cache->depots[i];
+            pthread_mutex_lock(&depot->lock);
+            while (depot->full) {
+                struct table_magazine *m = depot->full;
+                depot->full = m->next;
+                while (m->rounds > 0)
+                    table_allocator_free(pool, m->tables[--m->rounds]);
+                m->next = depot->empty;
+                depot->empty = m;
+            }
+        }
+        ptrdiff_t r = table_allocator_trim(pool, cache->backing_allocator);
+        if (r > 0)
+            released += r;
+        if (cache->concurrent)
+            pthread_mutex_unlock(&cache->depots[i].lock);
+    }
+    return released;
+}
+
+/*
+ * Take a snapshot of the pool statistics. Tables held in the per-thread
+ * magazines of a concurrent cache count as live; tables in its depots count
+ * as free.
+ */
+void hamt_table_cache_stats(struct hamt_table_cache *cache,
+                            struct hamt_table_cache_stats *stats)
+{
+    *stats = (struct hamt_table_cache_stats){.pool_count = cache->pool_count};
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+        struct table_allocator *pool = &cache->pools[i];
+        struct hamt_table_pool_stats *ps = &stats->pools[i];
+        if (cache->concurrent)
+            pthread_mutex_lock(&cache->depots[i].lock);
+        ps->table_size = pool->table_size;
+        ps->peak = pool->size;
+        ps->free = pool->fl_size;
+        if (cache->concurrent) {
+            for (struct table_magazine *m = cache->depots[i].full; m;
+                 m = m->next)
+                ps->free += m->rounds;
+        }
+        ps->live = ps->peak - ps->free;
+        ps->chunk_count = pool->chunk_count;
+        for (struct table_allocator_chunk *c = pool->chunk; c; c = c->next)
+            ps->chunk_bytes += c->size * sizeof(struct hamt_node);
+#if defined(WITH_TABLE_CACHE_STATS)
+        ps->alloc_count = pool->stats.alloc_count;
+        ps->free_count = pool->stats.free_count;
+#endif
+        if (cache->concurrent)
+            pthread_mutex_unlock(&cache->depots[i].lock);
+        stats->live_bytes +=
+            ps->live * ps->table_size * sizeof(struct hamt_node);
+        stats->chunk_bytes += ps->chunk_bytes;
+    }
 }
@@ -0,0 +1,191 @@
+#include "epoch.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+#define EPOCH_ACTIVE 1u
+/* Attempt to advance the global epoch every so many retired objects */
+#define EPOCH_ADVANCE_INTERVAL 64
+
+static void record_reclaim(struct epoch_record *r, size_t bucket)
+{
+    struct epoch_entry *e = r->limbo[bucket], *next;
+    r->limbo[bucket] = NULL;
+    while (e) {
+        next = e->next;
+        r->domain->reclaim(e, r->domain->ctx);
+        e = next;
+    }
+}
+
+/* Reclaim the objects of `r` retired two or more epochs before `epoch`;
+ * true if `r` holds no retired objects afterwards */
+static bool record_reclaim_safe(struct epoch_record *r, unsigned epoch)
+{
+    bool empty = true;
+    for (size_t i = 0; i < 3; ++i) {
+        if (r->limbo[i] && epoch - r->limbo_epoch[i] >= 2)
+            record_reclaim(r, i);
+        empty = empty && !r->limbo[i];
+    }
+    return empty;
+}
+
+/* Thread exit: leave the record (and its limbo lists) for reuse */
+static void record_release(void *p)
+{
+    struct epoch_record *r = p;
+    atomic_store_explicit(&r->in_use, false, memory_order_release);
+}
+
+static struct epoch_record *record_acquire(struct epoch_domain *d)
+{
+    struct epoch_record *r = pthread_getspecific(d->key);
+    if (r)
+        return r;
+    /* reuse the record of an exited thread */
+    for (r = atomic_load(&d->records); r; r = r->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&r->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&r->in_use, &expected, true))
+            break;
+    }
+    if (!r) {
+        r = d->ator->malloc(sizeof *r, d->ator->ctx);
+        if (!r)
+            return NULL;
+        r->domain = d;
+        atomic_init(&r->state, 0);
+        atomic_init(&r->in_use, true);
+        r->epoch = atomic_load(&d->epoch);
+        r->nesting = 0;
+        r->retired = 0;
+        for (size_t i = 0; i < 3; ++i) {
+            r->limbo[i] = NULL;
+            r->limbo_epoch[i] = 0;
+        }
+        r->next = atomic_load(&d->records);
+        while (!atomic_compare_exchange_weak(&d->records, &r->next, r))
+            ;
+    }
+    if (pthread_setspecific(d->key, r) != 0) {
+        atomic_store(&r->in_use, false);
+        return NULL;
+    }
+    return r;
+}
+
+/* Advance the global epoch if all active threads are in the current one */
+static void epoch_try_advance(struct epoch_domain *d)
+{
+    unsigned e = atomic_load(&d->epoch);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (struct epoch_record *r = atomic_load(&d->records); r; r = r->next) {
+        unsigned s = atomic_load_explicit(&r->state, memory_order_acquire);
+        if ((s & EPOCH_ACTIVE) && s != (e << 1 | EPOCH_ACTIVE))
+            return;
+    }
+    atomic_compare_exchange_strong(&d->epoch, &e, e + 1);
+}
+
+int epoch_domain_init(struct epoch_domain *d, struct hamt_allocator *ator,
+                      epoch_reclaim_fn reclaim, void *ctx)
+{
+    if (pthread_key_create(&d->key, record_release) != 0)
+        return -1;
+    atomic_init(&d->epoch, 0);
+    atomic_init(&d->records, NULL);
+    d->reclaim = reclaim;
+    d->ctx = ctx;
+    d->ator = ator;
+    return 0;
+}
+
+/* Reclaim all retired objects; no thread may be in a critical section */
+void epoch_domain_destroy(struct epoch_domain *d)
+{
+    pthread_key_delete(d->key);
+    struct epoch_record *r = atomic_load(&d->records), *next;
+    while (r) {
+        next = r->next;
+        for (size_t i = 0; i < 3; ++i)
+            record_reclaim(r, i);
+        d->ator->free(r, sizeof *r, d->ator->ctx);
+        r = next;
+    }
+    atomic_store(&d->records, NULL);
+}
+
+struct epoch_record *epoch_enter(struct epoch_domain *d)
+{
+    struct epoch_record *r = record_acquire(d);
+    if (!r || r->nesting++ > 0)
+        return r;
+    /* the acquire/release pairs on the epoch and the record states order
+     * the reclamation after all accesses of the critical sections it waited
+     * for; the fence orders the announcement before the section's loads */
+    unsigned e = atomic_load_explicit(&d->epoch, memory_order_acquire);
+    atomic_store(&r->state, e << 1 | EPOCH_ACTIVE);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (e != r->epoch) {
+        /* objects retired two or more epochs ago are unreachable */
+        record_reclaim_safe(r, e);
+        r->epoch = e;
+    }
+    return r;
+}
+
+void epoch_exit(struct epoch_record *r)
+{
+    assert(r->nesting > 0 && "epoch_exit() without epoch_enter()");
+    if (--r->nesting == 0)
+        atomic_store_explicit(&r->state, 0, memory_order_release);
+}
+
+/* Leave the critical section of the calling thread */
+void epoch_exit_current(struct epoch_domain *d)
+{
+    epoch_exit(pthread_getspecific(d->key));
+}
+
+void epoch_retire(struct epoch_record *r, struct epoch_entry *e)
+{
+    assert(r->nesting > 0 && "epoch_retire() outside of critical section");
+    /* Tag with the global epoch: threads that may still see the object are
+     * in the global epoch or the one before. A bucket still holding objects
+     * of an older epoch with the same index can be reclaimed right away. */
+    unsigned epoch = atomic_load(&r->domain->epoch);
+    size_t bucket = epoch % 3;
+    if (r->limbo[bucket] && r->limbo_epoch[bucket] != epoch)
+        record_reclaim(r, bucket);
+    r->limbo_epoch[bucket] = epoch;
+    e->next = r->limbo[bucket];
+    r->limbo[bucket] = e;
+    if (++r->retired % EPOCH_ADVANCE_INTERVAL == 0)
+        epoch_try_advance(r->domain);
+}
+
+bool epoch_synchronize(struct epoch_domain *d)
+{
+    struct epoch_record *own = record_acquire(d);
+    if (!own)
+        return false;
+    /* objects become safe after two advances */
+    epoch_try_advance(d);
+    epoch_try_advance(d);
+    unsigned e = atomic_load_explicit(&d->epoch, memory_order_acquire);
+    bool empty = true;
+    for (struct epoch_record *r = atomic_load(&d->records); r; r = r->next) {
+        bool expected = false;
+        if (r == own) {
+            empty = record_reclaim_safe(r, e) && empty;
+        } else if (!atomic_load_explicit(&r->in_use, memory_order_relaxed) &&
+                   atomic_compare_exchange_strong(&r->in_use, &expected,
+                                                  true)) {
+            /* left behind by an exited thread */
+            empty = record_reclaim_safe(r, e) && empty;
+            atomic_store_explicit(&r->in_use, false, memory_order_release);
+        }
+    }
+    return empty;
+}
@@ -0,0 +1,61 @@
+#ifndef HAMT_EPOCH_H
+#define HAMT_EPOCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hamt.h"
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Threads access shared objects only between epoch_enter() and
+ * epoch_exit(). Objects that have been unlinked are handed to
+ * epoch_retire() and reclaimed once the global epoch advanced twice, i.e.
+ * once every thread has left the critical sections that might still refer
+ * to them.
+ */
+
+/* Intrusive link of a retired object */
+struct epoch_entry {
+    struct epoch_entry *next;
+};
+
+typedef void (*epoch_reclaim_fn)(struct epoch_entry *entry, void *ctx);
+
+/* Per-thread state; records are never unregistered, only reused */
+struct epoch_record {
+    struct epoch_record *next;   /* next registered record (immutable) */
+    struct epoch_domain *domain;
+    atomic_uint state;           /* local epoch << 1 | EPOCH_ACTIVE */
+    atomic_bool in_use;          /* owned by a live thread */
+    unsigned epoch;              /* local epoch of the last critical section */
+    unsigned nesting;            /* critical section nesting depth */
+    size_t retired;              /* number of retired objects */
+    struct epoch_entry *limbo[3]; /* retired objects per epoch (mod 3) */
+    unsigned limbo_epoch[3];      /* epoch the objects were retired in */
+};
+
+struct epoch_domain {
+    atomic_uint epoch;                      /* global epoch */
+    _Atomic(struct epoch_record *) records; /* all registered records */
+    pthread_key_t key;                      /* record of the current thread */
+    epoch_reclaim_fn reclaim;
+    void *ctx;
+    struct hamt_allocator *ator;
+};
+
+int epoch_domain_init(struct epoch_domain *d, struct hamt_allocator *ator,
+                      epoch_reclaim_fn reclaim, void *ctx);
+void epoch_domain_destroy(struct epoch_domain *d);
+struct epoch_record *epoch_enter(struct epoch_domain *d);
+void epoch_exit(struct epoch_record *r);
+void epoch_exit_current(struct epoch_domain *d);
+void epoch_retire(struct epoch_record *r, struct epoch_entry *e);
+/* Reclaim without further retirements: try to advance the global epoch and
+ * reclaim what became safe in the records of the calling thread and of
+ * exited threads; true if these records hold no retired objects any more */
+bool epoch_synchronize(struct epoch_domain *d);
+#endif
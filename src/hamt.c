@@ -1,23 +1,20 @@
 #include "hamt.h"
-#include "internal_types.h"
+#include "hamt_impl.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#if defined (WITH_TABLE_CACHE)
 #include "cache.h"
-#endif
-
-/* Pointer tagging */
-#define HAMT_TAG_MASK 0x3 /* last two bits */
-#define HAMT_TAG_VALUE 0x1
-#define tagged(__p) (struct hamt_node *)((uintptr_t)__p | HAMT_TAG_VALUE)
-#define untagged(__p) (struct hamt_node *)((uintptr_t)__p & ~HAMT_TAG_MASK)
-#define is_value(__p) (((uintptr_t)__p & HAMT_TAG_MASK) == HAMT_TAG_VALUE)
 
 /* Memory management */
 #define ALLOC(ator, size) (ator)->malloc(size, (ator)->ctx)
@@ -50,110 +47,212 @@ void stdlib_free(void *ptr, const ptrdiff_t size, void *ctx)
 struct hamt_allocator hamt_allocator_default = {stdlib_malloc, stdlib_realloc,
                                                 stdlib_free, NULL};
 
-struct hamt {
-    struct hamt_node *root;
-    size_t size;
-    hamt_key_hash_fn key_hash;
-    hamt_key_cmp_fn key_cmp;
-    struct hamt_allocator *ator;
-#if defined(WITH_TABLE_CACHE)
-    struct hamt_table_cache *cache;
+/*
+ * With WITH_ATOMIC_REFCOUNTS, reference counts are updated atomically such
+ * that versions that share tables may be created and released by different
+ * threads.
+ */
+static inline uint32_t table_refcount(const struct hamt_node *table)
+{
+#if defined(WITH_ATOMIC_REFCOUNTS)
+    return __atomic_load_n(&REFCOUNT(table), __ATOMIC_ACQUIRE);
+#else
+    return REFCOUNT(table);
 #endif
-};
-
-/* hashing w/ state management */
-struct hash_state {
-    const void *key;
-    hamt_key_hash_fn hash_fn;
-    uint32_t hash;
-    size_t depth;
-    size_t shift;
-};
-
-/* Search results */
-typedef enum {
-    SEARCH_SUCCESS,
-    SEARCH_FAIL_NOTFOUND,
-    SEARCH_FAIL_KEYMISMATCH
-} search_status;
-
-struct search_result {
-    search_status status;
-    struct hamt_node *anchor;
-    struct hamt_node *value;
-    struct hash_state *hash;
-};
-
-/* Removal results */
-typedef enum { REMOVE_SUCCESS, REMOVE_GATHERED, REMOVE_NOTFOUND } remove_status;
+}
 
-struct remove_result {
-    remove_status status;
-    void *value;
-};
+static inline void refcount_retain(uint32_t *refcount)
+{
+#if defined(WITH_ATOMIC_REFCOUNTS)
+    __atomic_fetch_add(refcount, 1, __ATOMIC_RELAXED);
+#else
+    *refcount += 1;
+#endif
+}
 
-struct path_result {
-    union {
-        struct search_result sr;
-        struct remove_result rr;
-    };
-    struct hamt_node *root;
-};
+/* Drop a reference, return the number of remaining references */
+static inline uint32_t refcount_unref(uint32_t *refcount)
+{
+#if defined(WITH_ATOMIC_REFCOUNTS)
+    return __atomic_sub_fetch(refcount, 1, __ATOMIC_ACQ_REL);
+#else
+    return --*refcount;
+#endif
+}
 
-static inline struct hash_state *hash_next(struct hash_state *h)
+static inline void table_retain(struct hamt_node *table)
 {
-    h->depth += 1;
-    h->shift += 5;
-    if (h->shift > 25) {
-        h->hash = h->hash_fn(h->key, h->depth);
-        h->shift = 0;
-    }
-    return h;
+    refcount_retain(&REFCOUNT(table));
 }
 
-static inline uint32_t hash_get_index(const struct hash_state *h)
+static inline uint32_t table_unref(struct hamt_node *table)
 {
-    return (h->hash >> h->shift) & 0x1f;
+    return refcount_unref(&REFCOUNT(table));
 }
 
-static int get_popcount(uint32_t n) { return __builtin_popcount(n); }
+/*
+ * Arenas.
+ *
+ * The tables of an arena trie come from a private, adaptive table cache
+ * (see cache.c) on the allocator of the trie. Tables that are freed while
+ * the trie is modified go back to the arena's free lists; everything else
+ * stays in the arena until the last version that uses it is deleted, which
+ * then returns the chunks to the allocator without visiting any table.
+ */
+struct hamt_arena {
+    struct hamt_table_cache *tables;
+    uint32_t refcount; /* versions using the arena */
+};
 
-static int get_pos(uint32_t sparse_index, uint32_t bitmap)
+static struct hamt_arena *arena_create(struct hamt_allocator *ator)
 {
-    return get_popcount(bitmap & ((1 << sparse_index) - 1));
+    struct hamt_arena *arena = ALLOC(ator, sizeof *arena);
+    if (!arena)
+        return NULL;
+    struct hamt_table_cache_config cfg = {
+        .bucket_count = HAMT_TABLE_CACHE_MAX_POOLS,
+        .initial_bucket_sizes = NULL,
+        .backing_allocator = ator,
+        .adaptive = true};
+    if (!(arena->tables = hamt_table_cache_create(&cfg))) {
+        FREE(ator, arena, sizeof *arena);
+        return NULL;
+    }
+    arena->refcount = 1;
+    return arena;
 }
 
-static inline bool has_index(const struct hamt_node *anchor, size_t index)
+static void arena_release(struct hamt_arena *arena, struct hamt_allocator *ator)
 {
-    assert(anchor && "anchor must not be NULL");
-    assert(index < 32 && "index must not be larger than 31");
-    return INDEX(anchor) & (1 << index);
+    if (refcount_unref(&arena->refcount) > 0)
+        return;
+    table_cache_destroy(arena->tables);
+    FREE(ator, arena, sizeof *arena);
 }
 
+/*
+ * Tables are allocated with an additional header row in front of the
+ * actual table rows. The header holds the reference count of the table:
+ * the number of anchors (across all versions of a trie) that point to
+ * the table.
+ */
 struct hamt_node *table_allocate(const struct hamt *h, size_t size)
 {
     if (size == 0)
         return NULL;
+    size = table_capacity(size);
+    struct hamt_node *header;
+    if (h->arena)
+        header = hamt_table_cache_alloc(h->arena->tables, size + 1);
+    else
 #if defined(WITH_TABLE_CACHE)
-    return hamt_table_cache_alloc(h->cache, size);
+        header = hamt_table_cache_alloc(h->cache, size + 1);
 #else
-    return ALLOC(h->ator, size * sizeof(struct hamt_node));
+        header = ALLOC(h->ator, (size + 1) * sizeof(struct hamt_node));
 #endif
+    if (!header)
+        return NULL;
+    header->as.header.refcount = 1;
+    return header + 1;
 }
 
-void table_free(struct hamt *h, struct hamt_node *ptr, size_t n_rows)
+void table_free(const struct hamt *h, struct hamt_node *ptr, size_t n_rows)
 {
-    if (ptr && n_rows)
+    assert((!ptr || REFCOUNT(ptr) <= 1) &&
+           "Invariant: shared tables must not be freed");
+    if (!ptr || !n_rows)
+        return;
+    if (h->arena)
+        hamt_table_cache_free(h->arena->tables, table_capacity(n_rows) + 1,
+                              HEADER(ptr));
+    else
 #if defined(WITH_TABLE_CACHE)
-        hamt_table_cache_free(h->cache, n_rows, ptr);
+        hamt_table_cache_free(h->cache, table_capacity(n_rows) + 1,
+                              HEADER(ptr));
 #else
-        FREE(h->ator, ptr, n_rows * sizeof(struct hamt_node));
+        FREE(h->ator, HEADER(ptr),
+             (table_capacity(n_rows) + 1) * sizeof(struct hamt_node));
 #endif
 }
 
+/*
+ * Drop a reference to the table `anchor` points to; free the table and
+ * release its subtables once the last reference is gone.
+ *
+ * Like all walkers of whole tries, this follows a subtable in the last row
+ * of a table in a loop instead of a recursive call: an overflow bucket is
+ * always in the last row, so chains of buckets (e.g. under hash flooding)
+ * do not grow the stack.
+ */
+static void table_release(const struct hamt *h, struct hamt_node *anchor)
+{
+    struct hamt_node tail;
+    for (;;) {
+        struct hamt_node *table = TABLE(anchor);
+        if (!table)
+            return;
+        assert(table_refcount(table) > 0 &&
+               "Invariant: release of a dead table");
+        if (table_unref(table) > 0)
+            return;
+        size_t n_rows = get_popcount(INDEX(anchor));
+        for (size_t i = 0; i + 1 < n_rows; ++i) {
+            if (!is_value(table[i].as.kv.value)) {
+                table_release(h, &table[i]);
+            }
+        }
+        bool more = n_rows > 0 && !is_value(table[n_rows - 1].as.kv.value);
+        if (more)
+            tail = table[n_rows - 1];
+        table_free(h, table, n_rows);
+        if (!more)
+            return;
+        anchor = &tail;
+    }
+}
+
+/*
+ * Drop a table whose rows have just been copied into a new table: an
+ * exclusively owned table is simply freed, while a shared table stays alive
+ * and the copy needs its own references to the subtables.
+ */
+static void table_drop_copied(const struct hamt *h, struct hamt_node *table,
+                              size_t n_rows)
+{
+    if (!table)
+        return;
+    if (table_refcount(table) == 1) {
+        table_free(h, table, n_rows);
+        return;
+    }
+    for (size_t i = 0; i < n_rows; ++i) {
+        if (!is_value(table[i].as.kv.value)) {
+            table_retain(table[i].as.table.ptr);
+        }
+    }
+    if (table_unref(table) > 0)
+        return;
+    /* the other references were dropped concurrently */
+    for (size_t i = 0; i < n_rows; ++i) {
+        if (!is_value(table[i].as.kv.value)) {
+            table_release(h, &table[i]);
+        }
+    }
+    table_free(h, table, n_rows);
+}
+
 struct hamt_node *table_extend(struct hamt *h, struct hamt_node *anchor,
                                size_t n_rows, uint32_t index, uint32_t pos)
 {
+    struct hamt_node *table = TABLE(anchor);
+    if (n_rows > 0 && table_capacity(n_rows + 1) == table_capacity(n_rows) &&
+        table_refcount(table) == 1) {
+        /* the table has a spare row */
+        memmove(&table[pos + 1], &table[pos],
+                (n_rows - pos) * sizeof(struct hamt_node));
+        INDEX(anchor) |= UINT32_C(1) << index;
+        return anchor;
+    }
     struct hamt_node *new_table = table_allocate(h, n_rows + 1);
     if (!new_table)
         return NULL;
@@ -168,9 +267,10 @@ struct hamt_node *table_extend(struct hamt *h, struct hamt_node *anchor,
                (n_rows - pos) * sizeof(struct hamt_node));
     }
     assert(!is_value(VALUE(anchor)) && "URGS");
-    table_free(h, TABLE(anchor), n_rows);
+    /* the table may still be shared, see search() */
+    table_drop_copied(h, TABLE(anchor), n_rows);
     TABLE(anchor) = new_table;
-    INDEX(anchor) |= (1 << index);
+    INDEX(anchor) |= UINT32_C(1) << index;
     return anchor;
 }
 
@@ -184,11 +284,19 @@ struct hamt_node *table_shrink(struct hamt *h, struct hamt_node *anchor,
 
     struct hamt_node *new_table = NULL;
     uint32_t new_index = 0;
+    if (n_rows > 1 && table_capacity(n_rows - 1) == table_capacity(n_rows)) {
+        /* keep the spare row */
+        struct hamt_node *table = TABLE(anchor);
+        memmove(&table[pos], &table[pos + 1],
+                (n_rows - pos - 1) * sizeof(struct hamt_node));
+        INDEX(anchor) &= ~(UINT32_C(1) << index);
+        return anchor;
+    }
     if (n_rows > 1) {
         new_table = table_allocate(h, n_rows - 1);
         if (!new_table)
             return NULL; /* mem allocation error */
-        new_index = INDEX(anchor) & ~(1 << index);
+        new_index = INDEX(anchor) & ~(UINT32_C(1) << index);
         memcpy(&new_table[0], &TABLE(anchor)[0],
                pos * sizeof(struct hamt_node));
         memcpy(&new_table[pos], &TABLE(anchor)[pos + 1],
@@ -213,12 +321,40 @@ struct hamt_node *table_gather(struct hamt *h, struct hamt_node *anchor,
     assert((n_rows == 2 || n_rows == 1) &&
            "Table must have size 1 or 2 to gather");
     struct hamt_node *table = TABLE(anchor);
-    KEY(anchor) = table[pos].as.kv.key;
-    VALUE(anchor) = table[pos].as.kv.value; /* already tagged */
+    *anchor = table[pos]; /* value is already tagged */
     table_free(h, table, n_rows);
     return anchor;
 }
 
+/*
+ * Add a leaf to the bucket `anchor` points to; the bucket must be exclusively
+ * owned and must not have an overflow bucket. Returns the new leaf.
+ */
+struct hamt_node *bucket_insert(struct hamt *h, struct hamt_node *anchor,
+                                const struct hash_state *hash, void *key,
+                                void *value)
+{
+    size_t n_rows = get_popcount(INDEX(anchor));
+    if (n_rows < HAMT_BUCKET_SIZE) {
+        if (!table_extend(h, anchor, n_rows, n_rows, n_rows))
+            return NULL;
+        leaf_init(&TABLE(anchor)[n_rows], hash, key, value);
+        return &TABLE(anchor)[n_rows];
+    }
+    /* full: move the last leaf into a new overflow bucket */
+    struct hamt_node *overflow = table_allocate(h, 2);
+    if (!overflow)
+        return NULL;
+    struct hamt_node *last = &TABLE(anchor)[n_rows - 1];
+    overflow[0] = *last;
+    leaf_init(&overflow[1], hash, key, value);
+    anchor_init(last, overflow, bucket_index(2), 0);
+#if defined(WITH_CHAMP_LAYOUT)
+    NODEMAP(anchor) |= UINT32_C(1) << (n_rows - 1);
+#endif
+    return &overflow[1];
+}
+
 struct hamt_node *table_dup(const struct hamt *h, struct hamt_node *anchor)
 {
     int n_rows = get_popcount(INDEX(anchor));
@@ -230,14 +366,45 @@ struct hamt_node *table_dup(const struct hamt *h, struct hamt_node *anchor)
     return new_table;
 }
 
+/*
+ * Make sure the table `anchor` points to is exclusively owned by `anchor`.
+ * Tables that are shared with other versions of the trie get copied (path
+ * copying); the copy takes a reference to every subtable it points to.
+ *
+ * Note that this is only sufficient for in-place modification if the table
+ * holding `anchor` is exclusively owned as well, i.e. callers must unshare
+ * tables top-down, starting from the root.
+ */
+struct hamt_node *table_unshare(const struct hamt *h, struct hamt_node *anchor)
+{
+    struct hamt_node *table = TABLE(anchor);
+    if (!table || table_refcount(table) == 1)
+        return anchor;
+    struct hamt_node *copy = table_dup(h, anchor);
+    if (!copy)
+        return NULL;
+    table_drop_copied(h, table, get_popcount(INDEX(anchor)));
+    TABLE(anchor) = copy;
+    return anchor;
+}
+
 struct hamt *hamt_create(const struct hamt_config *cfg)
 {
+    if (cfg->root_levels > HAMT_MAX_ROOT_LEVELS)
+        return NULL;
     struct hamt *h = ALLOC(cfg->ator, sizeof(struct hamt));
     h->ator = cfg->ator;
-    h->root = ALLOC(cfg->ator, sizeof(struct hamt_node));
-    memset(h->root, 0, sizeof(struct hamt_node));
+    h->root_levels = cfg->root_levels;
+    h->arena = NULL;
+    if (cfg->arena && !(h->arena = arena_create(cfg->ator))) {
+        FREE(cfg->ator, h, sizeof(struct hamt));
+        return NULL;
+    }
+    h->root = ALLOC(cfg->ator, root_slots(h) * sizeof(struct hamt_node));
+    memset(h->root, 0, root_slots(h) * sizeof(struct hamt_node));
     h->size = 0;
     h->key_hash = cfg->key_hash_fn;
+    h->key_hash64 = cfg->key_hash64_fn;
     h->key_cmp = cfg->key_cmp_fn;
 #if defined(WITH_TABLE_CACHE)
     h->cache = cfg->cache;
@@ -245,13 +412,26 @@ struct hamt *hamt_create(const struct hamt_config *cfg)
     return h;
 }
 
+/* Create a new version of `h` that shares all tables with `h`; the root
+ * itself is copied, which takes O(root_slots()) */
 struct hamt *hamt_copy_shallow(const struct hamt *h)
 {
     struct hamt *copy = ALLOC(h->ator, sizeof(struct hamt));
+    size_t n_slots = root_slots(h);
     copy->ator = h->ator;
-    copy->root = h->root;
+    copy->root_levels = h->root_levels;
+    copy->arena = h->arena;
+    if (copy->arena)
+        refcount_retain(&copy->arena->refcount);
+    copy->root = ALLOC(h->ator, n_slots * sizeof(struct hamt_node));
+    memcpy(copy->root, h->root, n_slots * sizeof(struct hamt_node));
+    for (size_t i = 0; i < n_slots; ++i) {
+        if (copy->root[i].as.table.ptr)
+            table_retain(copy->root[i].as.table.ptr);
+    }
     copy->size = h->size;
     copy->key_hash = h->key_hash;
+    copy->key_hash64 = h->key_hash64;
     copy->key_cmp = h->key_cmp;
 #if defined(WITH_TABLE_CACHE)
     copy->cache = h->cache;
@@ -259,508 +439,2846 @@ struct hamt *hamt_copy_shallow(const struct hamt *h)
     return copy;
 }
 
-static const struct hamt_node *insert_kv(struct hamt *h,
-                                         struct hamt_node *anchor,
-                                         struct hash_state *hash, void *key,
-                                         void *value)
+/** Bulk loading
+ *
+ * Building a trie with repeated calls to `hamt_set()` re-allocates a table
+ * every time a row is added to it. The bulk loader instead hashes all keys
+ * up front and sorts them such that all keys that end up in the same table
+ * are adjacent. This allows to build the trie top-down in a single pass,
+ * allocating every table exactly once and at its final size.
+ *
+ * The sort order is the order of the 5-bit hash indices that address the
+ * trie levels (i.e. the level 0 index is the most significant digit). Since
+ * the hash is regenerated every six levels (see `hash_next()`), the sort key
+ * covers six levels and keys that collide on all six are re-hashed and
+ * re-sorted when the loader reaches that depth.
+ */
+
+struct bulk_item {
+    void *key;
+    void *value;
+    uint64_t hash;
+    bool duplicate;
+};
+
+/* Sort key for the six levels starting at bit `shift` of the hash */
+static inline uint32_t bulk_sort_key(uint64_t hash, size_t shift)
 {
-    /* calculate position in new table */
-    uint32_t ix = hash_get_index(hash);
-    uint32_t new_index = INDEX(anchor) | (1 << ix);
-    int pos = get_pos(ix, new_index);
-    /* extend table */
-    size_t n_rows = get_popcount(INDEX(anchor));
-    anchor = table_extend(h, anchor, n_rows, ix, pos);
-    if (!anchor)
-        return NULL;
-    struct hamt_node *new_table = TABLE(anchor);
-    /* set new k/v pair */
-    new_table[pos].as.kv.key = key;
-    new_table[pos].as.kv.value = tagged(value);
-    /* return a pointer to the inserted k/v pair */
-    return &new_table[pos];
-}
-
-static const struct hamt_node *insert_table(struct hamt *h,
-                                            struct hamt_node *anchor,
-                                            struct hash_state *hash, void *key,
-                                            void *value)
-{
-    /* FIXME: check for alloc failure and bail out correctly (deleting the
-     *        incomplete subtree */
-
-    /* Collect everything we know about the existing value */
-    struct hash_state *x_hash = &(struct hash_state){
-        .key = KEY(anchor),
-        .hash_fn = hash->hash_fn,
-        .hash = hash->hash_fn(KEY(anchor), hash->depth / 5),
-        .depth = hash->depth,
-        .shift = hash->shift};
-    void *x_value = VALUE(anchor); /* tagged (!) value ptr */
-    /* increase depth until the hashes diverge, building a list
-     * of tables along the way */
-    struct hash_state *next_hash = hash_next(hash);
-    struct hash_state *x_next_hash = hash_next(x_hash);
-    uint32_t next_index = hash_get_index(next_hash);
-    uint32_t x_next_index = hash_get_index(x_next_hash);
-    while (x_next_index == next_index) {
-        TABLE(anchor) = table_allocate(h, 1);
-        INDEX(anchor) = (1 << next_index);
-        next_hash = hash_next(next_hash);
-        x_next_hash = hash_next(x_next_hash);
-        next_index = hash_get_index(next_hash);
-        x_next_index = hash_get_index(x_next_hash);
-        anchor = TABLE(anchor);
-    }
-    /* the hashes are different, let's allocate a table with two
-     * entries to store the existing and new values */
-    TABLE(anchor) = table_allocate(h, 2);
-    INDEX(anchor) = (1 << next_index) | (1 << x_next_index);
-    /* determine the proper position in the allocated table */
-    int x_pos = get_pos(x_next_index, INDEX(anchor));
-    int pos = get_pos(next_index, INDEX(anchor));
-    /* fill in the existing value; no need to tag the value pointer
-     * since it is already tagged. */
-    TABLE(anchor)[x_pos].as.kv.key = (void *)x_hash->key;
-    TABLE(anchor)[x_pos].as.kv.value = x_value;
-    /* fill in the new key/value pair, tagging the pointer to the
-     * new value to mark it as a value ptr */
-    TABLE(anchor)[pos].as.kv.key = key;
-    TABLE(anchor)[pos].as.kv.value = tagged(value);
-
-    return &TABLE(anchor)[pos];
-}
-
-static struct search_result
-search_recursive(const struct hamt *h, struct hamt_node *anchor,
-                 struct hash_state *hash, hamt_key_cmp_fn cmp_eq, const void *key,
-                 struct hamt_node *path)
+    uint32_t key = 0;
+    for (size_t end = shift + 30; shift < end; shift += 5) {
+        key = (key << 5) | ((hash >> shift) & 0x1f);
+    }
+    return key;
+}
+
+/* Stable LSD radix sort (3 passes w/ 10 bit digits) of `items` by the sort
+ * key at `shift`; `tmp` is scratch space of the same size */
+static void bulk_sort(struct bulk_item *items, struct bulk_item *tmp,
+                      size_t n, size_t shift)
 {
-    assert(!is_value(VALUE(anchor)) &&
-           "Invariant: path copy requires an internal node");
-    struct hamt_node *copy = path;
-    if (path) {
-        /* copy the table we're pointing to */
-        TABLE(copy) = table_dup(h, anchor);
-        INDEX(copy) = INDEX(anchor);
-        assert(!is_value(VALUE(copy)) && "Copy caused a leaf/internal switch");
-    } else {
-        copy = anchor;
-    }
-
-    /* determine the expected index in table */
-    uint32_t expected_index = hash_get_index(hash);
-    /* check if the expected index is set */
-    if (has_index(copy, expected_index)) {
-        /* if yes, get the compact index to address the array */
-        int pos = get_pos(expected_index, INDEX(copy));
-        /* index into the table and check what type of entry we're looking at */
-        struct hamt_node *next = &TABLE(copy)[pos];
-        if (is_value(VALUE(next))) {
-            if ((*cmp_eq)(key, KEY(next)) == 0) {
-                /* keys match */
-                struct search_result result = {.status = SEARCH_SUCCESS,
-                                               .anchor = copy,
-                                               .value = next,
-                                               .hash = hash};
-                return result;
+    struct bulk_item *src = items, *dst = tmp, *swap;
+    for (size_t pass = 0; pass < 3; ++pass) {
+        size_t count[1024 + 1] = {0};
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t key = bulk_sort_key(src[i].hash, shift);
+            count[((key >> (10 * pass)) & 0x3ff) + 1]++;
+        }
+        for (size_t d = 1; d < 1024; ++d) {
+            count[d] += count[d - 1];
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t key = bulk_sort_key(src[i].hash, shift);
+            uint32_t d = (key >> (10 * pass)) & 0x3ff;
+            dst[count[d]++] = src[i];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != items)
+        memcpy(items, src, n * sizeof(struct bulk_item));
+}
+
+/* Drop all but the last occurrence of every key from the sorted `items`
+ * (equal keys have equal sort keys and are hence adjacent, modulo other keys
+ * they collide with). Returns the new number of items. */
+static size_t bulk_unique(hamt_key_cmp_fn cmp_eq, struct bulk_item *items,
+                          size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t sort_key = bulk_sort_key(items[i].hash, 0);
+        for (size_t j = i + 1;
+             j < n && bulk_sort_key(items[j].hash, 0) == sort_key; ++j) {
+            if (items[j].hash == items[i].hash &&
+                cmp_eq(items[i].key, items[j].key) == 0) {
+                items[i].duplicate = true;
+                break;
             }
-            /* not found: same hash but different key */
-            struct search_result result = {.status = SEARCH_FAIL_KEYMISMATCH,
-                                           .anchor = copy,
-                                           .value = next,
-                                           .hash = hash};
-            return result;
-        } else {
-            /* For table entries, recurse to the next level */
-            assert(TABLE(next) != NULL &&
-                   "invariant: table ptrs must not be NULL");
-            return search_recursive(h, next, hash_next(hash), cmp_eq, key,
-                                    path ? next : NULL);
-        }
-    }
-    /* expected index is not set, terminate search */
-    struct search_result result = {.status = SEARCH_FAIL_NOTFOUND,
-                                   .anchor = copy,
-                                   .value = NULL,
-                                   .hash = hash};
-    return result;
+        }
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!items[i].duplicate)
+            items[k++] = items[i];
+    }
+    return k;
 }
 
-const void *hamt_get(const struct hamt *trie, void *key)
+/* Build the bucket for `anchor` (and its overflow buckets); cf. bulk_build() */
+static struct hamt_node *bulk_build_bucket(struct hamt *h,
+                                           struct hamt_node *anchor,
+                                           struct bulk_item *items, size_t n,
+                                           size_t depth)
 {
-    struct hash_state *hash =
-        &(struct hash_state){.key = key,
-                             .hash_fn = trie->key_hash,
-                             .hash = trie->key_hash(key, 0),
-                             .depth = 0,
-                             .shift = 0};
-    struct search_result sr =
-        search_recursive(trie, trie->root, hash, trie->key_cmp, key, NULL);
-    if (sr.status == SEARCH_SUCCESS) {
-        return untagged(sr.VALUE(value));
+    struct hash_state hash = {.hash_fn = h->key_hash,
+                              .hash64_fn = h->key_hash64,
+                              .depth = depth};
+    size_t n_rows = n > HAMT_BUCKET_SIZE ? HAMT_BUCKET_SIZE : n;
+    struct hamt_node *table = table_allocate(h, n_rows);
+    if (!table)
+        return NULL;
+    memset(table, 0, n_rows * sizeof(struct hamt_node));
+    size_t n_leaves = n > HAMT_BUCKET_SIZE ? n_rows - 1 : n_rows;
+    anchor_init(anchor, table, bucket_index(n_rows),
+                n_leaves < n ? UINT32_C(1) << n_leaves : 0);
+    for (size_t i = 0; i < n_leaves; ++i) {
+        hash.key = items[i].key;
+        leaf_init(&table[i], &hash, items[i].key, items[i].value);
     }
-    return NULL;
+    if (n_leaves < n &&
+        !bulk_build_bucket(h, &table[n_leaves], &items[n_leaves],
+                           n - n_leaves, depth + 1))
+        return NULL;
+    return anchor;
 }
 
-static const struct hamt_node *set(struct hamt *h, struct hamt_node *anchor,
-                                   hamt_key_hash_fn hash_fn, hamt_key_cmp_fn cmp_fn,
-                                   void *key, void *value)
+/* Build the table for `anchor` from the (sorted, duplicate-free) items */
+static struct hamt_node *bulk_build(struct hamt *h, struct hamt_node *anchor,
+                                    struct bulk_item *items,
+                                    struct bulk_item *tmp, size_t n,
+                                    size_t depth, size_t shift)
 {
-    struct hash_state *hash = &(struct hash_state){.key = key,
-                                                   .hash_fn = hash_fn,
-                                                   .hash = hash_fn(key, 0),
-                                                   .depth = 0,
-                                                   .shift = 0};
-    struct search_result sr =
-        search_recursive(h, anchor, hash, cmp_fn, key, NULL);
-    const struct hamt_node *inserted;
-    switch (sr.status) {
-    case SEARCH_SUCCESS:
-        sr.VALUE(value) = tagged(value);
-        inserted = sr.value;
-        break;
-    case SEARCH_FAIL_NOTFOUND:
-        if ((inserted = insert_kv(h, sr.anchor, sr.hash, key, value)) != NULL) {
-            h->size += 1;
+    struct hash_state hash = {.hash_fn = h->key_hash,
+                              .hash64_fn = h->key_hash64,
+                              .depth = depth};
+    if (hash_in_bucket(&hash))
+        return bulk_build_bucket(h, anchor, items, n, depth);
+    if (shift == 5 * hash_levels(&hash)) {
+        /* hash exhausted, regenerate (cf. hash_next()) */
+        for (size_t i = 0; i < n; ++i) {
+            items[i].hash = hash_compute(&hash, items[i].key, depth);
         }
-        break;
-    case SEARCH_FAIL_KEYMISMATCH:
-        if ((inserted = insert_table(h, sr.value, sr.hash, key, value)) !=
-            NULL) {
-            h->size += 1;
+        bulk_sort(items, tmp, n, 0);
+        shift = 0;
+    } else if (shift == 30) {
+        /* the sort key of 64 bit hashes covers six levels at a time */
+        bulk_sort(items, tmp, n, shift);
+    }
+    uint32_t index = 0, nodemap = 0;
+    for (size_t i = 0; i < n;) {
+        uint32_t ix = (items[i].hash >> shift) & 0x1f;
+        size_t j = i + 1;
+        while (j < n && ((items[j].hash >> shift) & 0x1f) == ix)
+            ++j;
+        index |= 1u << ix;
+        nodemap |= j - i > 1 ? 1u << ix : 0;
+        i = j;
+    }
+    size_t n_rows = get_popcount(index);
+    struct hamt_node *table = table_allocate(h, n_rows);
+    if (!table)
+        return NULL;
+    /* zero the rows such that a partially built trie can be deleted */
+    memset(table, 0, n_rows * sizeof(struct hamt_node));
+    anchor_init(anchor, table, index, nodemap);
+    for (size_t i = 0; i < n;) {
+        uint32_t ix = (items[i].hash >> shift) & 0x1f;
+        int row = row_pos(anchor, ix);
+        size_t j = i + 1;
+        while (j < n && ((items[j].hash >> shift) & 0x1f) == ix)
+            ++j;
+        if (j - i == 1) {
+            hash.key = items[i].key;
+            hash.hash = items[i].hash;
+            hash.depth = depth;
+            hash.shift = shift;
+            leaf_init(&table[row], &hash, items[i].key, items[i].value);
+        } else if (!bulk_build(h, &table[row], &items[i], &tmp[i], j - i,
+                               depth + 1, shift + 5)) {
+            return NULL;
         }
-        break;
+        i = j;
     }
-    return inserted;
+    return anchor;
 }
 
-const void *hamt_set(struct hamt *trie, void *key, void *value)
+struct hamt *hamt_create_from_array(const struct hamt_config *cfg, void **keys,
+                                    void **values, size_t n)
 {
-    const struct hamt_node *n =
-        set(trie, trie->root, trie->key_hash, trie->key_cmp, key, value);
-    return untagged(VALUE(n));
+    struct hamt *h = hamt_create(cfg);
+    if (!h || n == 0)
+        return h;
+    struct bulk_item *items =
+        ALLOC(h->ator, 2 * n * sizeof(struct bulk_item));
+    if (!items) {
+        hamt_delete(h);
+        return NULL;
+    }
+    struct hash_state hash;
+    for (size_t i = 0; i < n; ++i) {
+        items[i] = (struct bulk_item){
+            .key = keys[i],
+            .value = values[i],
+            .hash = hash_init(&hash, h, keys[i], 0)->hash,
+            .duplicate = false};
+    }
+    bulk_sort(items, &items[n], n, 0);
+    h->size = bulk_unique(h->key_cmp, items, n);
+    /* the root levels are the most significant digits of the sort key, the
+     * items of every root slot are hence adjacent */
+    size_t mask = root_slots(h) - 1, levels = h->root_levels;
+    for (size_t i = 0; i < h->size;) {
+        size_t slot = items[i].hash & mask;
+        size_t j = i + 1;
+        while (j < h->size && (items[j].hash & mask) == slot)
+            ++j;
+        if (!bulk_build(h, &h->root[slot], &items[i], &items[n + i], j - i,
+                        levels, 5 * levels)) {
+            hamt_delete(h);
+            h = NULL;
+            break;
+        }
+        i = j;
+    }
+    FREE(cfg->ator, items, 2 * n * sizeof(struct bulk_item));
+    return h;
 }
 
-static struct path_result search(const struct hamt *h, struct hamt_node *anchor,
-                                 struct hash_state *hash, hamt_key_cmp_fn cmp_eq,
-                                 const void *key)
+/* Generic instance of the core: keys are hashed and compared through the
+ * functions of the trie's configuration */
+#define CORE_FN(name) name
+#define CORE_HASH(hash, key, gen) hash_compute(hash, key, gen)
+#define CORE_KEY_EQ(cmp_eq, lhs, rhs) ((*(cmp_eq))(lhs, rhs) == 0)
+#include "hamt_core.h"
+
+/*
+ * Integer keys.
+ *
+ * Integer tries store 64 bit keys in the key pointer of a leaf, skipping the
+ * indirection (and the allocation) of boxed keys. The specialized instance
+ * of the core inlines hashing and key comparison; the configured functions
+ * below implement the same semantics for all generic code paths (iterators,
+ * diff, bulk loading, ...). Platforms with narrower pointers do not get
+ * integer tries.
+ */
+#if UINTPTR_MAX >= UINT64_MAX
+
+/* splitmix64 finalizer, seeded with the hash generation */
+static inline uint64_t int_key_mix(uint64_t key, size_t gen)
 {
-    struct path_result pr;
-    pr.root = table_allocate(h, 1);
-    pr.sr = search_recursive(h, anchor, hash, cmp_eq, key, pr.root);
-    return pr;
+    uint64_t x = key + (gen + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-const struct hamt *hamt_pset(const struct hamt *h, void *key, void *value)
+static uint64_t int_key_hash(const void *key, const size_t gen)
 {
-    struct hash_state *hash = &(struct hash_state){.key = key,
-                                                   .hash_fn = h->key_hash,
-                                                   .hash = h->key_hash(key, 0),
-                                                   .depth = 0,
-                                                   .shift = 0};
-    struct path_result pr = search(h, h->root, hash, h->key_cmp, key);
-    struct hamt *cp = hamt_copy_shallow(h);
-    cp->root = pr.root;
-    switch (pr.sr.status) {
-    case SEARCH_SUCCESS:
-        pr.sr.VALUE(value) = tagged(value);
-        break;
-    case SEARCH_FAIL_NOTFOUND:
-        if (insert_kv(cp, pr.sr.anchor, pr.sr.hash, key, value) != NULL) {
-            cp->size += 1;
-        }
-        break;
-    case SEARCH_FAIL_KEYMISMATCH:
-        if (insert_table(cp, pr.sr.value, pr.sr.hash, key, value) != NULL) {
-            cp->size += 1;
-        }
-        break;
-    }
-    return cp;
+    return int_key_mix((uint64_t)(uintptr_t)key, gen);
 }
 
-static struct remove_result
-rem_recursive(struct hamt *h, struct hamt_node *root, struct hamt_node *anchor,
-              struct hash_state *hash, hamt_key_cmp_fn cmp_eq, const void *key,
-              struct hamt_node *path)
+static int int_key_cmp(const void *lhs, const void *rhs)
 {
-    assert(!is_value(VALUE(anchor)) &&
-           "Invariant: removal requires an internal node");
-    /* copy the table we're pointing to */
-    struct hamt_node *copy = path;
-    if (path) {
-        TABLE(copy) = table_dup(h, anchor);
-        INDEX(copy) = INDEX(anchor);
-        assert(!is_value(VALUE(copy)) && "Copy caused a leaf/internal switch");
-    } else {
-        copy = anchor;
-    }
-    /* determine the expected index in table */
-    uint32_t expected_index = hash_get_index(hash);
-    /* check if the expected index is set */
-    if (has_index(copy, expected_index)) {
-        /* if yes, get the compact index to address the array */
-        int pos = get_pos(expected_index, INDEX(copy));
-        /* index into the table and check what type of entry we're looking at */
-        struct hamt_node *next = &TABLE(copy)[pos];
-        if (is_value(VALUE(next))) {
-            if ((*cmp_eq)(key, KEY(next)) == 0) {
-                uint32_t n_rows = get_popcount(INDEX(copy));
-                void *value = VALUE(next);
-                /* We shrink tables while they have more than 2 rows and switch
-                 * to gathering the subtrie otherwise. The exception is when we
-                 * are at the root, where we must shrink the table to one or
-                 * zero.
-                 */
-                if (n_rows > 2 || (n_rows >= 1 && root == copy)) {
-                    // FIXME: this sets copy to NULL when n_rows == 1
-                    // i.e. when we remove the last entry from the trie
-                    copy = table_shrink(h, copy, n_rows, expected_index, pos);
-                } else if (n_rows == 2) {
-                    /* if both rows are value rows, gather, dropping the current
-                     * row */
-                    struct hamt_node *other = &TABLE(copy)[!pos];
-                    if (is_value(VALUE(other))) {
-                        copy = table_gather(h, copy, !pos);
-                        return (struct remove_result){.status = REMOVE_GATHERED,
-                                                      .value = value};
+    uint64_t a = (uint64_t)(uintptr_t)lhs, b = (uint64_t)(uintptr_t)rhs;
+    return (a > b) - (a < b);
+}
+
+#define CORE_FN(name) int_##name
+#define CORE_HASH(hash, key, gen) int_key_mix((uint64_t)(uintptr_t)(key), gen)
+#define CORE_KEY_EQ(cmp_eq, lhs, rhs) ((lhs) == (rhs))
+#include "hamt_core.h"
+
+#define INT_KEY(key) ((void *)(uintptr_t)(key))
+#endif /* UINTPTR_MAX >= UINT64_MAX */
+
+const void *hamt_get(const struct hamt *trie, void *key)
+{
+    struct hash_state *hash = hash_init(&(struct hash_state){0}, trie, key, 0);
+    struct hamt_node *leaf =
+        lookup(root_slot(trie, trie->root, hash), hash, trie->key_cmp, key);
+    return leaf ? untagged(VALUE(leaf)) : NULL;
+}
+
+/*
+ * Batched lookup.
+ *
+ * Every level of a lookup is a dependent load of a table that is likely not
+ * in the cache. `hamt_get_many()` therefore walks groups of keys down the
+ * trie in lockstep: in every round, each key of the group advances by one
+ * level and issues a prefetch for the table (or the key of the leaf) it is
+ * going to inspect in the next round, s.t. the cache misses of all keys
+ * in the group overlap.
+ */
+#define GET_MANY_GROUP_SIZE 16
+
+struct get_many_state {
+    size_t ix;                /* index into the keys/values arrays */
+    struct hamt_node *anchor; /* current table, or ... */
+    struct hamt_node *leaf;   /* ... the leaf that awaits key comparison */
+    struct hash_state hash;
+};
+
+size_t hamt_get_many(const struct hamt *trie, void **keys, size_t n,
+                     const void **values)
+{
+    struct get_many_state group[GET_MANY_GROUP_SIZE];
+    size_t n_found = 0;
+    for (size_t start = 0; start < n; start += GET_MANY_GROUP_SIZE) {
+        size_t n_active = 0;
+        for (size_t i = start; i < n && n_active < GET_MANY_GROUP_SIZE; ++i) {
+            struct get_many_state *st = &group[n_active++];
+            st->ix = i;
+            st->leaf = NULL;
+            hash_init(&st->hash, trie, keys[i], 0);
+            st->anchor = root_slot(trie, trie->root, &st->hash);
+        }
+        while (n_active > 0) {
+            for (size_t k = 0; k < n_active;) {
+                struct get_many_state *st = &group[k];
+                bool done = true;
+                if (st->leaf) {
+                    /* the leaf's key has been prefetched in the last round */
+                    if (trie->key_cmp(keys[st->ix], KEY(st->leaf)) == 0) {
+                        values[st->ix] = untagged(VALUE(st->leaf));
+                        n_found++;
+                    } else {
+                        values[st->ix] = NULL;
+                    }
+                } else if (hash_in_bucket(&st->hash)) {
+                    /* rare enough to not bother with prefetching */
+                    struct hamt_node *leaf = lookup(st->anchor, &st->hash,
+                                                    trie->key_cmp, keys[st->ix]);
+                    values[st->ix] = leaf ? untagged(VALUE(leaf)) : NULL;
+                    n_found += leaf != NULL;
+                } else if (!has_index(st->anchor, hash_get_index(&st->hash))) {
+                    values[st->ix] = NULL;
+                } else {
+                    int pos = row_pos(st->anchor, hash_get_index(&st->hash));
+                    struct hamt_node *next = &TABLE(st->anchor)[pos];
+                    done = false;
+                    if (!is_value(VALUE(next))) {
+                        st->anchor = next;
+                        hash_next(&st->hash);
+                        __builtin_prefetch(TABLE(next));
+                    } else if (leaf_may_match(next, &st->hash)) {
+                        st->leaf = next;
+                        __builtin_prefetch(KEY(next));
                     } else {
-                        /* otherwise shrink the node to n_rows == 1 */
-                        copy =
-                            table_shrink(h, copy, n_rows, expected_index, pos);
+                        values[st->ix] = NULL;
+                        done = true;
                     }
                 }
-                return (struct remove_result){.status = REMOVE_SUCCESS,
-                                              .value = value};
-            }
-            /* not found: same hash but different key */
-            return (struct remove_result){.status = REMOVE_NOTFOUND,
-                                          .value = NULL};
-        } else {
-            /* For table entries, recurse to the next level */
-            assert(TABLE(next) != NULL &&
-                   "invariant: table ptrs must not be NULL");
-            struct remove_result result =
-                rem_recursive(h, root, next, hash_next(hash), cmp_eq, key,
-                              path ? next : NULL);
-            if (next != TABLE(root) && result.status == REMOVE_GATHERED) {
-                /* remove dangling internal nodes: check if we need to
-                 * propagate the gathering of the key-value entry */
-                int n_rows = get_popcount(INDEX(copy));
-                if (n_rows == 1) {
-                    copy = table_gather(h, copy, 0);
-                    return (struct remove_result){.status = REMOVE_GATHERED,
-                                                  .value = result.value};
+                if (done) {
+                    /* retire the key, moving the last active key in */
+                    group[k] = group[--n_active];
+                } else {
+                    ++k;
                 }
             }
-            return (struct remove_result){.status = REMOVE_SUCCESS,
-                                          .value = result.value};
         }
     }
-    return (struct remove_result){.status = REMOVE_NOTFOUND, .value = NULL};
+    return n_found;
 }
 
-static struct path_result rem(struct hamt *h, struct hamt_node *root,
-                              struct hamt_node *anchor, struct hash_state *hash,
-                              hamt_key_cmp_fn cmp_eq, const void *key)
+const void *hamt_set(struct hamt *trie, void *key, void *value)
 {
-    (void) root; /* silence unused warning */
-    struct path_result pr;
-    pr.root = table_allocate(h, 1);
-    pr.rr = rem_recursive(h, pr.root, anchor, hash, cmp_eq, key, pr.root);
-    return pr;
+    const struct hamt_node *n = set(trie, trie->root, key, value);
+    return untagged(VALUE(n));
 }
 
-void *hamt_remove(struct hamt *trie, void *key)
+const struct hamt *hamt_pset(const struct hamt *h, void *key, void *value)
 {
-    struct hash_state *hash =
-        &(struct hash_state){.key = key,
-                             .hash_fn = trie->key_hash,
-                             .hash = trie->key_hash(key, 0),
-                             .depth = 0,
-                             .shift = 0};
-    struct remove_result rr = rem_recursive(trie, trie->root, trie->root, hash,
-                                            trie->key_cmp, key, NULL);
-    if (rr.status == REMOVE_SUCCESS || rr.status == REMOVE_GATHERED) {
-        trie->size -= 1;
-        return untagged(rr.value);
-    }
-    return NULL;
+    /* the copy shares all tables with `h`, hence set() path-copies */
+    struct hamt *cp = hamt_copy_shallow(h);
+    set(cp, cp->root, key, value);
+    return cp;
 }
 
-const struct hamt *hamt_premove(const struct hamt *h, void *key)
+const void *hamt_upsert(struct hamt *trie, void *key, hamt_upsert_fn fn,
+                        void *ctx)
+{
+    const struct hamt_node *n = upsert(trie, trie->root, key, fn, ctx);
+    return n ? untagged(VALUE(n)) : NULL;
+}
+
+const struct hamt *hamt_pupsert(const struct hamt *h, void *key,
+                                hamt_upsert_fn fn, void *ctx)
 {
-    struct hash_state *hash =
-        &(struct hash_state){.key = key,
-                             .hash_fn = h->key_hash,
-                             .hash = h->key_hash(key, 0),
-                             .depth = 0,
-                             .shift = 0};
     struct hamt *cp = hamt_copy_shallow(h);
-    struct path_result pr = rem(cp, cp->root, cp->root, hash, cp->key_cmp, key);
-    cp->root = pr.root;
-    if (pr.rr.status == REMOVE_SUCCESS || pr.rr.status == REMOVE_GATHERED) {
-        cp->size -= 1;
-    }
+    upsert(cp, cp->root, key, fn, ctx);
     return cp;
 }
 
-/* delete recursively from anchor */
-void delete_recursive(struct hamt *h, struct hamt_node *anchor)
+static void *get_or_insert_keep(const void *key, const void *value, void *ctx)
 {
-    if (TABLE(anchor)) {
-        assert(!is_value(VALUE(anchor)) && "delete requires an internal node");
-        size_t n = get_popcount(INDEX(anchor));
-        for (size_t i = 0; i < n; ++i) {
-            if (!is_value(TABLE(anchor)[i].as.kv.value)) {
-                delete_recursive(h, &TABLE(anchor)[i]);
-            }
-        }
-        table_free(h, TABLE(anchor), n);
-        TABLE(anchor) = NULL;
-    }
+    (void)key;
+    return value ? (void *)value : ctx;
 }
 
-void hamt_delete(struct hamt *h)
+const void *hamt_get_or_insert(struct hamt *trie, void *key, void *value)
 {
-    /* Note that we do not touch the table cache - this is the
-     * responsibility of the user! */
-    delete_recursive(h, h->root);
-    FREE(h->ator, h->root, sizeof(struct hamt_node));
-    FREE(h->ator, h, sizeof(struct hamt));
+    return hamt_upsert(trie, key, get_or_insert_keep, value);
 }
 
-size_t hamt_size(const struct hamt *trie) { return trie->size; }
-
-/** Iterators
- *
- * Iterators traverse the HAMT in DFS mode; each iterator instance maintains a
- * "call stack" of nodes encountered so far. Nodes are represented as a pair
- * of (a) a pointer to a `hamt_node` (aka an anchor) and a position that
- * indexes the current position in the table referred to by the anchor.
- *
- * The "call stack" is implemented with dynamic memory allocation to guard
- * against outliers in tree depth; that said, we expect the average stack
- * depth to be in the order of log(n) (where n is the number of items in the
- * HAMT)
- */
-
-struct hamt_iterator_item {
-    struct hamt_node *anchor;
-    size_t pos;
-    struct hamt_iterator_item *next;
-};
+struct hamt *hamt_transient(const struct hamt *trie)
+{
+    /* The transient shares all tables with `trie`. The first modification
+     * on a path copies the shared tables; the copies are exclusively owned
+     * by the transient (refcount 1) and are modified in place from there on. */
+    return hamt_copy_shallow(trie);
+}
 
-struct hamt_iterator {
-    struct hamt *trie;
-    struct hamt_node *cur;
-    struct hamt_iterator_item *tos; /* top of stack */
-};
+const struct hamt *hamt_persistent(struct hamt *trie)
+{
+    /* Freezing is free: ownership is tracked through reference counts and
+     * any subsequent persistent modification will path-copy again. */
+    return trie;
+}
 
-static struct hamt_iterator_item *iterator_push_item(struct hamt_iterator *it,
-                                                     struct hamt_node *anchor,
-                                                     size_t pos)
+void *hamt_remove(struct hamt *trie, void *key)
 {
-    /* push new item onto top of stack */
-    struct hamt_iterator_item *new_item =
-        ALLOC(it->trie->ator, sizeof(struct hamt_iterator_item));
-    if (new_item) {
-        new_item->anchor = anchor;
-        new_item->pos = pos;
-        new_item->next = NULL;
-        new_item->next = it->tos;
-        it->tos = new_item;
+    struct hash_state *hash = hash_init(&(struct hash_state){0}, trie, key, 0);
+    struct hamt_node *slot = root_slot(trie, trie->root, hash);
+    struct remove_result rr = rem(trie, slot, slot, hash, trie->key_cmp, key);
+    if (rr.status == REMOVE_SUCCESS || rr.status == REMOVE_GATHERED) {
+        trie->size -= 1;
+        return untagged(rr.value);
     }
-    return new_item;
+    return NULL;
 }
 
-static struct hamt_iterator_item *iterator_peek_item(struct hamt_iterator *it)
+const struct hamt *hamt_premove(const struct hamt *h, void *key)
 {
-    return it->tos;
+    /* the copy shares all tables with `h`, hence removal path-copies */
+    struct hamt *cp = hamt_copy_shallow(h);
+    hamt_remove(cp, key);
+    return cp;
 }
 
-static struct hamt_iterator_item *iterator_pop_item(struct hamt_iterator *it)
+/*
+ * Batched persistent modification: applying the batch to a single copy
+ * path-copies every shared table at most once (the first modification makes
+ * the table exclusive to the copy, see `table_unshare()`) and creates one new
+ * version instead of one per key.
+ */
+const struct hamt *hamt_pset_many(const struct hamt *h, void **keys,
+                                  void **values, size_t n)
 {
-    /* pop off top of stack */
-    struct hamt_iterator_item *item = it->tos;
-    if (item) {
-        it->tos = it->tos->next;
+    struct hamt *cp = hamt_copy_shallow(h);
+    for (size_t i = 0; i < n; ++i) {
+        set(cp, cp->root, keys[i], values[i]);
     }
-    return item;
+    return cp;
 }
 
-struct hamt_iterator *hamt_it_create(struct hamt *trie)
+const struct hamt *hamt_premove_many(const struct hamt *h, void **keys,
+                                     size_t n)
 {
-    struct hamt_iterator *it =
-        ALLOC(trie->ator, sizeof(struct hamt_iterator));
-    it->trie = trie;
-    it->tos = NULL;
-    it->cur = NULL;
-    iterator_push_item(it, trie->root, 0);
-    hamt_it_next(it);
-    return it;
+    struct hamt *cp = hamt_copy_shallow(h);
+    for (size_t i = 0; i < n; ++i) {
+        hamt_remove(cp, keys[i]);
+    }
+    return cp;
 }
 
-void hamt_it_delete(struct hamt_iterator *it)
+#if UINTPTR_MAX >= UINT64_MAX
+struct hamt *hamt_int_create(const struct hamt_config *cfg)
 {
-    struct hamt_iterator_item *p = it->tos;
-    struct hamt_iterator_item *tmp;
-    while (p) {
-        tmp = p;
-        p = p->next;
-        FREE(it->trie->ator, tmp, sizeof(struct hamt_iterator_item));
-    }
-    FREE(it->trie->ator, it, sizeof(struct hamt_iterator));
+    struct hamt_config int_cfg = *cfg;
+    int_cfg.key_cmp_fn = int_key_cmp;
+    int_cfg.key_hash_fn = NULL;
+    int_cfg.key_hash64_fn = int_key_hash;
+    return hamt_create(&int_cfg);
 }
 
-inline bool hamt_it_valid(struct hamt_iterator *it) { return it->cur != NULL; }
+const void *hamt_int_get(const struct hamt *trie, uint64_t key)
+{
+    assert(trie->key_hash64 == int_key_hash && "not an integer trie");
+    struct hash_state *hash =
+        int_hash_start(&(struct hash_state){0}, trie, INT_KEY(key));
+    struct hamt_node *leaf = int_lookup(root_slot(trie, trie->root, hash),
+                                        hash, trie->key_cmp, INT_KEY(key));
+    return leaf ? untagged(VALUE(leaf)) : NULL;
+}
 
-struct hamt_iterator *hamt_it_next(struct hamt_iterator *it)
+const void *hamt_int_set(struct hamt *trie, uint64_t key, void *value)
 {
-    struct hamt_iterator_item *p;
-    while (it && (p = iterator_peek_item(it)) != NULL) {
-        /* determine number of entries / size of the table */
-        size_t n_pos = get_popcount(INDEX(p->anchor));
-        /* start from the table index we left off from */
-        while (p->pos < n_pos) {
-            /* get a pointer to the current subtrie */
-            struct hamt_node *cur = &TABLE(p->anchor)[p->pos];
-            /* increment the row count */
-            p->pos++;
-            /* check if we have a subtable or a value */
-            if (is_value(VALUE(cur))) {
-                /* cur refers to a value; set the iterator and bail */
-                it->cur = cur;
-                return it;
-            } else {
-                /* cur is a pointer to a subtable; push the item on
-                 * the iterator stack and recurse */
-                iterator_push_item(it, cur, 0);
-                return hamt_it_next(it);
-            }
-        }
-        /* remove table from stack when all rows have been dealt with */
-        iterator_pop_item(it);
-        FREE(it->trie->ator, p, sizeof(struct hamt_iterator_item));
-    }
-    if (it)
-        it->cur = NULL;
-    return it;
+    assert(trie->key_hash64 == int_key_hash && "not an integer trie");
+    const struct hamt_node *n = int_set(trie, trie->root, INT_KEY(key), value);
+    return untagged(VALUE(n));
 }
 
-const void *hamt_it_get_key(struct hamt_iterator *it)
+const struct hamt *hamt_int_pset(const struct hamt *h, uint64_t key,
+                                 void *value)
 {
-    if (it->cur) {
-        return KEY(it->cur);
-    }
-    return NULL;
+    struct hamt *cp = hamt_copy_shallow(h);
+    hamt_int_set(cp, key, value);
+    return cp;
 }
 
-const void *hamt_it_get_value(struct hamt_iterator *it)
+void *hamt_int_remove(struct hamt *trie, uint64_t key)
+{
+    assert(trie->key_hash64 == int_key_hash && "not an integer trie");
+    struct hash_state *hash =
+        int_hash_start(&(struct hash_state){0}, trie, INT_KEY(key));
+    struct hamt_node *slot = root_slot(trie, trie->root, hash);
+    struct remove_result rr =
+        int_rem(trie, slot, slot, hash, trie->key_cmp, INT_KEY(key));
+    if (rr.status == REMOVE_SUCCESS || rr.status == REMOVE_GATHERED) {
+        trie->size -= 1;
+        return untagged(rr.value);
+    }
+    return NULL;
+}
+
+const struct hamt *hamt_int_premove(const struct hamt *h, uint64_t key)
+{
+    struct hamt *cp = hamt_copy_shallow(h);
+    hamt_int_remove(cp, key);
+    return cp;
+}
+#endif
+
+void hamt_delete(struct hamt *h)
+{
+    /* Note that we do not touch the table cache - this is the
+     * responsibility of the user! Arena tries do not release their tables
+     * one by one, the last version drops the arena as a whole. */
+    if (h->arena) {
+        arena_release(h->arena, h->ator);
+    } else {
+        for (size_t i = 0; i < root_slots(h); ++i)
+            table_release(h, &h->root[i]);
+    }
+    FREE(h->ator, h->root, root_slots(h) * sizeof(struct hamt_node));
+    FREE(h->ator, h, sizeof(struct hamt));
+}
+
+void hamt_release(const struct hamt *trie)
+{
+    /* Versions only own references to their tables; deleting a version
+     * frees exactly the tables that are not shared with other versions.
+     * Versions of an arena trie free no tables at all, the last of them
+     * releases the arena. */
+    hamt_delete((struct hamt *)trie);
+}
+
+size_t hamt_size(const struct hamt *trie) { return trie->size; }
+
+/* Follows the last row in a loop, cf. table_release() */
+static void stats_recursive(const struct hamt_node *anchor, size_t depth,
+                            struct hamt_stats *stats)
+{
+    while (anchor) {
+        const struct hamt_node *table = TABLE(anchor), *tail = NULL;
+        uint32_t n_rows = get_popcount(INDEX(anchor));
+        stats->tables += 1;
+        stats->buckets += depth >= HAMT_BUCKET_DEPTH;
+        stats->rows[n_rows] += 1;
+        stats->bytes +=
+            (table_capacity(n_rows) + 1) * sizeof(struct hamt_node);
+        for (uint32_t i = 0; i < n_rows; ++i) {
+            if (!is_value(table[i].as.kv.value)) {
+                if (i + 1 == n_rows)
+                    tail = &table[i];
+                else
+                    stats_recursive(&table[i], depth + 1, stats);
+                continue;
+            }
+            stats->leaves += 1;
+            stats->depth[depth < HAMT_STATS_MAX_DEPTH
+                             ? depth
+                             : HAMT_STATS_MAX_DEPTH - 1]++;
+            if (depth > stats->max_depth)
+                stats->max_depth = depth;
+        }
+        anchor = tail;
+        depth += 1;
+    }
+}
+
+void hamt_stats(const struct hamt *trie, struct hamt_stats *stats)
+{
+    *stats = (struct hamt_stats){
+        .bytes = sizeof(struct hamt) +
+                 root_slots(trie) * sizeof(struct hamt_node)};
+    for (size_t i = 0; i < root_slots(trie); ++i) {
+        if (trie->root[i].as.table.ptr)
+            stats_recursive(&trie->root[i], trie->root_levels, stats);
+    }
+}
+
+/*
+ * Concurrent maps.
+ *
+ * A concurrent map uses the same rows as a HAMT but refers to subtables
+ * through indirection nodes (Ctrie-style). Tables are immutable once
+ * published and carry their bitmap in the header; insertion and removal
+ * build a modified copy of a single table and publish it with a
+ * compare-and-swap on the indirection node that refers to the table,
+ * retrying at that level if another thread won the race. Replaced tables
+ * are reclaimed through epoch-based reclamation once no reader can still
+ * hold a reference. Indirection nodes are never unlinked, i.e. tables are
+ * not contracted on removal. Below HAMT_BUCKET_DEPTH, tables are collision
+ * buckets as in a trie, with the overflow bucket behind an indirection node.
+ */
+struct hamt_cmap {
+    struct hamt trie; /* configuration; the root anchor remains unused */
+    struct hamt_inode root;
+    atomic_size_t size;
+    struct epoch_domain epoch;
+};
+
+static void cmap_table_free(struct hamt_cmap *cm, struct hamt_node *table);
+
+static void cmap_inode_free(struct hamt_cmap *cm, struct hamt_inode *in)
+{
+    cmap_table_free(cm, atomic_load_explicit(&in->table, memory_order_relaxed));
+    FREE(cm->trie.ator, in, sizeof *in);
+}
+
+/* Free `table` and all tables below it; the last row is followed in a
+ * loop, cf. table_release() */
+static void cmap_table_free(struct hamt_cmap *cm, struct hamt_node *table)
+{
+    while (table) {
+        int n = get_popcount(CMAP_INDEX(table));
+        struct hamt_inode *tail = NULL;
+        for (int i = 0; i < n; ++i) {
+            if (is_value(table[i].as.kv.value))
+                continue;
+            if (i + 1 == n)
+                tail = table[i].as.inode.ptr;
+            else
+                cmap_inode_free(cm, table[i].as.inode.ptr);
+        }
+        table_free(&cm->trie, table, n);
+        table = NULL;
+        if (tail) {
+            table = atomic_load_explicit(&tail->table, memory_order_relaxed);
+            FREE(cm->trie.ator, tail, sizeof *tail);
+        }
+    }
+}
+
+static void cmap_reclaim(struct epoch_entry *e, void *ctx)
+{
+    struct hamt_cmap *cm = ctx;
+    struct hamt_node *header =
+        (struct hamt_node *)((char *)e -
+                             offsetof(struct hamt_node, as.header.retired));
+    table_free(&cm->trie, header + 1, get_popcount(header->as.header.index));
+}
+
+/*
+ * Copy of `table` (with bitmap `index`) that has bitmap `new_index`: row
+ * `pos` is replaced (same bitmap), inserted (bit added) or removed (bit
+ * cleared, `row` is ignored).
+ */
+static struct hamt_node *cmap_table_edit(struct hamt_cmap *cm,
+                                         const struct hamt_node *table,
+                                         uint32_t index, uint32_t new_index,
+                                         int pos, const struct hamt_node *row)
+{
+    int n = get_popcount(index), n_new = get_popcount(new_index);
+    struct hamt_node *copy = table_allocate(&cm->trie, n_new);
+    if (!copy)
+        return NULL;
+    CMAP_INDEX(copy) = new_index;
+    if (pos > 0)
+        memcpy(copy, table, pos * sizeof *copy);
+    if (n_new >= n)
+        copy[pos] = *row;
+    int src = pos + (n_new <= n), dst = pos + (n_new >= n);
+    if (n > src)
+        memcpy(copy + dst, table + src, (n - src) * sizeof *copy);
+    return copy;
+}
+
+/*
+ * Scan the bucket `table` (with `n` rows) for `key`. Returns the position of
+ * the matching leaf, or -1 and the overflow bucket (if any) in `overflow`.
+ */
+static int cmap_bucket_scan(const struct hamt_cmap *cm,
+                            const struct hamt_node *table, int n,
+                            const void *key, struct hamt_inode **overflow)
+{
+    *overflow = NULL;
+    for (int i = 0; i < n; ++i) {
+        const struct hamt_node *row = &table[i];
+        if (!is_value(VALUE(row)))
+            *overflow = INODE(row);
+        else if (cm->trie.key_cmp(key, KEY(row)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Build the indirection node for the subtrie that holds the existing
+ * `leaf` and the new key/value pair (`hash` is the hash state of `key` at
+ * the subtrie's depth).
+ */
+static struct hamt_inode *cmap_branch(struct hamt_cmap *cm,
+                                      const struct hamt_node *leaf,
+                                      struct hash_state *hash, void *key,
+                                      void *value)
+{
+    struct hamt_inode *in = ALLOC(cm->trie.ator, sizeof *in);
+    if (!in)
+        return NULL;
+    uint32_t ix = hash_get_index(hash), leaf_ix = ix;
+    if (!hash_in_bucket(hash))
+        leaf_ix = (leaf_rehash(hash, leaf, hash->depth) >> hash->shift) & 0x1f;
+    struct hamt_node *table;
+    if (hash_in_bucket(hash)) {
+        /* the hashes did not diverge, collect both leaves in a bucket */
+        if (!(table = table_allocate(&cm->trie, 2)))
+            goto err_free_inode;
+        CMAP_INDEX(table) = bucket_index(2);
+        table[0] = *leaf;
+        leaf_init(&table[1], hash, key, value);
+    } else if (ix != leaf_ix) {
+        if (!(table = table_allocate(&cm->trie, 2)))
+            goto err_free_inode;
+        CMAP_INDEX(table) = (1u << ix) | (1u << leaf_ix);
+        table[ix < leaf_ix] = *leaf;
+        leaf_init(&table[ix > leaf_ix], hash, key, value);
+    } else {
+        if (!(table = table_allocate(&cm->trie, 1)))
+            goto err_free_inode;
+        CMAP_INDEX(table) = 1u << ix;
+        struct hamt_inode *sub =
+            cmap_branch(cm, leaf, hash_next(hash), key, value);
+        if (!sub) {
+            table_free(&cm->trie, table, 1);
+            goto err_free_inode;
+        }
+        table[0] = (struct hamt_node){.as.inode.ptr = sub};
+    }
+    atomic_init(&in->table, table);
+    return in;
+err_free_inode:
+    FREE(cm->trie.ator, in, sizeof *in);
+    return NULL;
+}
+
+struct hamt_cmap *hamt_cmap_create(const struct hamt_config *cfg)
+{
+    /* neither a wide root nor an arena work with indirection nodes */
+    if (cfg->root_levels || cfg->arena)
+        return NULL;
+    struct hamt_cmap *cm = ALLOC(cfg->ator, sizeof *cm);
+    if (!cm)
+        return NULL;
+    cm->trie = (struct hamt){.root = NULL,
+                             .size = 0,
+                             .key_hash = cfg->key_hash_fn,
+                             .key_hash64 = cfg->key_hash64_fn,
+                             .key_cmp = cfg->key_cmp_fn,
+                             .ator = cfg->ator,
+#if defined(WITH_TABLE_CACHE)
+                             .cache = cfg->cache
+#endif
+    };
+    atomic_init(&cm->root.table, NULL);
+    atomic_init(&cm->size, 0);
+    if (epoch_domain_init(&cm->epoch, cfg->ator, cmap_reclaim, cm) != 0) {
+        FREE(cfg->ator, cm, sizeof *cm);
+        return NULL;
+    }
+    return cm;
+}
+
+void hamt_cmap_delete(struct hamt_cmap *cm)
+{
+    epoch_domain_destroy(&cm->epoch);
+    cmap_table_free(cm, atomic_load(&cm->root.table));
+    FREE(cm->trie.ator, cm, sizeof *cm);
+}
+
+const void *hamt_cmap_get(struct hamt_cmap *cm, void *key)
+{
+    struct epoch_record *r = epoch_enter(&cm->epoch);
+    if (!r)
+        return NULL;
+    struct hash_state hash;
+    hash_init(&hash, &cm->trie, key, 0);
+    const void *value = NULL;
+    struct hamt_inode *in = &cm->root;
+    for (;;) {
+        struct hamt_node *table =
+            atomic_load_explicit(&in->table, memory_order_acquire);
+        if (table && hash_in_bucket(&hash)) {
+            struct hamt_inode *overflow;
+            int pos = cmap_bucket_scan(cm, table,
+                                       get_popcount(CMAP_INDEX(table)), key,
+                                       &overflow);
+            if (pos >= 0)
+                value = untagged(table[pos].as.kv.value);
+            else if ((in = overflow))
+                continue;
+            break;
+        }
+        uint32_t ix = hash_get_index(&hash);
+        if (!table || !(CMAP_INDEX(table) & (1u << ix)))
+            break;
+        struct hamt_node *row = &table[get_pos(ix, CMAP_INDEX(table))];
+        if (!is_value(VALUE(row))) {
+            in = INODE(row);
+            hash_next(&hash);
+            continue;
+        }
+        if (leaf_may_match(row, &hash) && cm->trie.key_cmp(key, KEY(row)) == 0)
+            value = untagged(VALUE(row));
+        break;
+    }
+    epoch_exit(r);
+    return value;
+}
+
+const void *hamt_cmap_set(struct hamt_cmap *cm, void *key, void *value)
+{
+    struct epoch_record *r = epoch_enter(&cm->epoch);
+    if (!r)
+        return NULL;
+    struct hash_state hash;
+    hash_init(&hash, &cm->trie, key, 0);
+    const void *result = NULL;
+    struct hamt_inode *in = &cm->root;
+    for (;;) {
+        struct hamt_node *table =
+            atomic_load_explicit(&in->table, memory_order_acquire);
+        uint32_t index = table ? CMAP_INDEX(table) : 0;
+        uint32_t ix = hash_get_index(&hash);
+        int pos = get_pos(ix, index);
+        struct hamt_node row, *copy;
+        struct hamt_inode *branch = NULL;
+        bool added = true;
+        if (hash_in_bucket(&hash)) {
+            struct hamt_inode *overflow;
+            int n = get_popcount(index);
+            int found = cmap_bucket_scan(cm, table, n, key, &overflow);
+            if (found >= 0) {
+                row = table[found];
+                row.as.kv.value = tagged(value);
+                added = false;
+                copy = cmap_table_edit(cm, table, index, index, found, &row);
+            } else if (overflow) {
+                in = overflow;
+                continue;
+            } else if (n < HAMT_BUCKET_SIZE) {
+                leaf_init(&row, &hash, key, value);
+                copy = cmap_table_edit(cm, table, index, bucket_index(n + 1),
+                                       n, &row);
+            } else {
+                /* full: move the last leaf into a new overflow bucket */
+                if (!(branch = cmap_branch(cm, &table[n - 1], &hash, key,
+                                           value)))
+                    break;
+                row = (struct hamt_node){.as.inode.ptr = branch};
+                copy = cmap_table_edit(cm, table, index, index, n - 1, &row);
+            }
+        } else if (index & (1u << ix)) {
+            const struct hamt_node *cur = &table[pos];
+            if (!is_value(VALUE(cur))) {
+                in = INODE(cur);
+                hash_next(&hash);
+                continue;
+            }
+            if (leaf_may_match(cur, &hash) &&
+                cm->trie.key_cmp(key, KEY(cur)) == 0) {
+                row = *cur;
+                row.as.kv.value = tagged(value);
+                added = false;
+            } else {
+                struct hash_state next = hash;
+                if (!(branch = cmap_branch(cm, cur, hash_next(&next), key,
+                                           value)))
+                    break;
+                row = (struct hamt_node){.as.inode.ptr = branch};
+            }
+            copy = cmap_table_edit(cm, table, index, index, pos, &row);
+        } else {
+            leaf_init(&row, &hash, key, value);
+            copy = cmap_table_edit(cm, table, index, index | (1u << ix), pos,
+                                   &row);
+        }
+        if (!copy) {
+            if (branch)
+                cmap_inode_free(cm, branch);
+            break;
+        }
+        if (atomic_compare_exchange_strong_explicit(
+                &in->table, &table, copy, memory_order_acq_rel,
+                memory_order_acquire)) {
+            if (table)
+                epoch_retire(r, &HEADER(table)->as.header.retired);
+            if (added)
+                atomic_fetch_add_explicit(&cm->size, 1, memory_order_relaxed);
+            result = value;
+            break;
+        }
+        /* lost the race: discard the copy and retry at this level */
+        table_free(&cm->trie, copy, get_popcount(CMAP_INDEX(copy)));
+        if (branch)
+            cmap_inode_free(cm, branch);
+    }
+    epoch_exit(r);
+    return result;
+}
+
+void *hamt_cmap_remove(struct hamt_cmap *cm, void *key)
+{
+    struct epoch_record *r = epoch_enter(&cm->epoch);
+    if (!r)
+        return NULL;
+    struct hash_state hash;
+    hash_init(&hash, &cm->trie, key, 0);
+    void *result = NULL;
+    struct hamt_inode *in = &cm->root;
+    for (;;) {
+        struct hamt_node *table =
+            atomic_load_explicit(&in->table, memory_order_acquire);
+        uint32_t index = table ? CMAP_INDEX(table) : 0;
+        uint32_t new_index;
+        int pos;
+        if (hash_in_bucket(&hash)) {
+            struct hamt_inode *overflow;
+            int n = get_popcount(index);
+            if ((pos = cmap_bucket_scan(cm, table, n, key, &overflow)) < 0) {
+                if (!(in = overflow))
+                    break;
+                continue;
+            }
+            new_index = bucket_index(n - 1);
+        } else {
+            uint32_t ix = hash_get_index(&hash);
+            if (!(index & (1u << ix)))
+                break;
+            pos = get_pos(ix, index);
+            const struct hamt_node *cur = &table[pos];
+            if (!is_value(VALUE(cur))) {
+                in = INODE(cur);
+                hash_next(&hash);
+                continue;
+            }
+            if (!leaf_may_match(cur, &hash) ||
+                cm->trie.key_cmp(key, KEY(cur)) != 0)
+                break;
+            new_index = index & ~(1u << ix);
+        }
+        void *value = untagged(table[pos].as.kv.value);
+        struct hamt_node *copy = NULL;
+        if (new_index &&
+            !(copy = cmap_table_edit(cm, table, index, new_index, pos, NULL)))
+            break;
+        if (atomic_compare_exchange_strong_explicit(
+                &in->table, &table, copy, memory_order_acq_rel,
+                memory_order_acquire)) {
+            epoch_retire(r, &HEADER(table)->as.header.retired);
+            atomic_fetch_sub_explicit(&cm->size, 1, memory_order_relaxed);
+            result = value;
+            break;
+        }
+        if (copy)
+            table_free(&cm->trie, copy, get_popcount(new_index));
+    }
+    epoch_exit(r);
+    return result;
+}
+
+size_t hamt_cmap_size(struct hamt_cmap *cm)
+{
+    return atomic_load_explicit(&cm->size, memory_order_relaxed);
+}
+
+/*
+ * Key sets.
+ *
+ * Sets are tries without values. A row is a bare pointer to a key or to a
+ * subtable, i.e. half the size of a trie row, and the bitmap and the node
+ * map of a table live in its header: the keys come first, the subtables
+ * last (the CHAMP layout, cf. WITH_CHAMP_LAYOUT), such that no pointer
+ * tags are needed. Set tables are allocated in units of trie rows and
+ * share the table cache with tries. Below HAMT_BUCKET_DEPTH, a table is a
+ * bucket of up to HAMT_BUCKET_SIZE rows whose header counts the rows; a
+ * full bucket continues in an overflow bucket in its last row (node map 1).
+ */
+struct hamt_set {
+    struct hamt trie;       /* configuration; the root anchor remains unused */
+    void *root;             /* root table, NULL if the set is empty */
+};
+
+static inline size_t set_units(size_t n_rows) { return (n_rows + 1) / 2; }
+
+static inline size_t set_n_rows(const struct hamt_node *table, size_t depth)
+{
+    return depth >= HAMT_BUCKET_DEPTH ? SET_INDEX(table)
+                                      : (size_t)get_popcount(SET_INDEX(table));
+}
+
+/* Keys are stored in the leading rows of a table */
+static inline size_t set_n_keys(const struct hamt_node *table, size_t depth)
+{
+    return set_n_rows(table, depth) - get_popcount(SET_NODEMAP(table));
+}
+
+static struct hamt_node *set_table_alloc(const struct hamt_set *s,
+                                         size_t n_rows, uint32_t index,
+                                         uint32_t nodemap)
+{
+    struct hamt_node *table = table_allocate(&s->trie, set_units(n_rows));
+    if (table) {
+        SET_INDEX(table) = index;
+        SET_NODEMAP(table) = nodemap;
+    }
+    return table;
+}
+
+static void set_table_free(const struct hamt_set *s, struct hamt_node *table,
+                           size_t n_rows)
+{
+    table_free(&s->trie, table, set_units(n_rows));
+}
+
+/* Drop a reference to `table`, cf. table_release() (which explains why
+ * the last row is followed in a loop) */
+static void set_release(const struct hamt_set *s, struct hamt_node *table,
+                        size_t depth)
+{
+    while (table && table_unref(table) == 0) {
+        size_t n_rows = set_n_rows(table, depth);
+        size_t n_keys = set_n_keys(table, depth);
+        for (size_t i = n_keys; i + 1 < n_rows; ++i)
+            set_release(s, SET_ROWS(table)[i], depth + 1);
+        struct hamt_node *tail =
+            n_rows > n_keys ? SET_ROWS(table)[n_rows - 1] : NULL;
+        set_table_free(s, table, n_rows);
+        table = tail;
+        depth += 1;
+    }
+}
+
+/* Make the table in `*slot` exclusive, cf. table_unshare() */
+static struct hamt_node *set_unshare(const struct hamt_set *s,
+                                     void **slot, size_t depth)
+{
+    struct hamt_node *table = *slot;
+    if (table_refcount(table) == 1)
+        return table;
+    size_t n_rows = set_n_rows(table, depth);
+    struct hamt_node *copy = set_table_alloc(s, n_rows, SET_INDEX(table),
+                                             SET_NODEMAP(table));
+    if (!copy)
+        return NULL;
+    memcpy(SET_ROWS(copy), SET_ROWS(table), n_rows * sizeof(void *));
+    for (size_t i = set_n_keys(table, depth); i < n_rows; ++i)
+        table_retain(SET_ROWS(copy)[i]);
+    set_release(s, table, depth);
+    *slot = copy;
+    return copy;
+}
+
+/*
+ * Open a gap for a key at row `pos` of the table in `*slot` (`grow`), or
+ * drop the key in row `pos`; the table moves if it is shared or if its
+ * capacity does not fit, s.t. a shared table is copied once. The header is
+ * left to the caller.
+ */
+static struct hamt_node *set_table_edit(const struct hamt_set *s,
+                                        void **slot, size_t depth,
+                                        size_t n_rows, size_t pos, bool grow)
+{
+    struct hamt_node *table = *slot;
+    bool shared = table_refcount(table) > 1;
+    size_t n_new = grow ? n_rows + 1 : n_rows - 1;
+    void **src = SET_ROWS(table);
+    if (!shared &&
+        table_capacity(set_units(n_new)) == table_capacity(set_units(n_rows))) {
+        if (grow)
+            memmove(&src[pos + 1], &src[pos], (n_rows - pos) * sizeof *src);
+        else
+            memmove(&src[pos], &src[pos + 1], (n_new - pos) * sizeof *src);
+        return table;
+    }
+    struct hamt_node *copy = NULL;
+    if (n_new > 0) {
+        copy = set_table_alloc(s, n_new, SET_INDEX(table), SET_NODEMAP(table));
+        if (!copy)
+            return NULL;
+        void **dst = SET_ROWS(copy);
+        memcpy(dst, src, pos * sizeof *src);
+        if (grow)
+            memcpy(&dst[pos + 1], &src[pos], (n_rows - pos) * sizeof *src);
+        else
+            memcpy(&dst[pos], &src[pos + 1], (n_new - pos) * sizeof *src);
+        /* the subtables remain the last rows */
+        for (size_t i = n_new - get_popcount(SET_NODEMAP(table));
+             shared && i < n_new; ++i)
+            table_retain(dst[i]);
+    }
+    if (shared)
+        set_release(s, table, depth);
+    else
+        set_table_free(s, table, n_rows);
+    *slot = copy;
+    return copy;
+}
+
+/* Move row `ix` of `table` between the key and the subtable rows (cf.
+ * row_to_table() and row_to_leaf()); returns its new position */
+static size_t set_row_flip(struct hamt_node *table, uint32_t ix)
+{
+    void **rows = SET_ROWS(table);
+    int from = champ_pos(SET_INDEX(table), SET_NODEMAP(table), ix);
+    SET_NODEMAP(table) ^= UINT32_C(1) << ix;
+    int to = champ_pos(SET_INDEX(table), SET_NODEMAP(table), ix);
+    void *row = rows[from];
+    if (from < to)
+        memmove(&rows[from], &rows[from + 1], (to - from) * sizeof *rows);
+    else
+        memmove(&rows[to + 1], &rows[to], (from - to) * sizeof *rows);
+    rows[to] = row;
+    return to;
+}
+
+/* Build the subtable for `old` and `key`, whose hashes agree up to the depth
+ * of `hash` (the hash state of `key`) */
+static struct hamt_node *set_branch(const struct hamt_set *s, void *old,
+                                    struct hash_state *hash, void *key)
+{
+    if (hash_in_bucket(hash)) {
+        struct hamt_node *bucket = set_table_alloc(s, 2, 2, 0);
+        if (bucket) {
+            SET_ROWS(bucket)[0] = old;
+            SET_ROWS(bucket)[1] = key;
+        }
+        return bucket;
+    }
+    struct hash_state x_hash;
+    hash_init(&x_hash, &s->trie, old, hash->depth);
+    uint32_t ix = hash_get_index(hash), x_ix = hash_get_index(&x_hash);
+    if (ix != x_ix) {
+        struct hamt_node *table =
+            set_table_alloc(s, 2, (1u << ix) | (1u << x_ix), 0);
+        if (table) {
+            SET_ROWS(table)[ix < x_ix] = old;
+            SET_ROWS(table)[ix > x_ix] = key;
+        }
+        return table;
+    }
+    struct hamt_node *table = set_table_alloc(s, 1, 1u << ix, 1u << ix);
+    if (!table)
+        return NULL;
+    struct hamt_node *sub = set_branch(s, old, hash_next(hash), key);
+    if (!sub) {
+        set_table_free(s, table, 1);
+        return NULL;
+    }
+    SET_ROWS(table)[0] = sub;
+    return table;
+}
+
+/* Search `key` below `table`, where `hash` is at the depth of `table` */
+static bool set_search(const struct hamt_set *s, const struct hamt_node *table,
+                       struct hash_state hash, const void *key)
+{
+    while (table) {
+        void **rows = SET_ROWS(table);
+        if (hash_in_bucket(&hash)) {
+            size_t n_keys = set_n_keys(table, hash.depth);
+            for (size_t i = 0; i < n_keys; ++i) {
+                if (s->trie.key_cmp(key, rows[i]) == 0)
+                    return true;
+            }
+            if (n_keys == SET_INDEX(table))
+                return false;
+            table = rows[n_keys];
+            hash_next(&hash);
+            continue;
+        }
+        uint32_t ix = hash_get_index(&hash), bit = UINT32_C(1) << ix;
+        if (!(SET_INDEX(table) & bit))
+            return false;
+        void *row = rows[champ_pos(SET_INDEX(table), SET_NODEMAP(table), ix)];
+        if (!(SET_NODEMAP(table) & bit))
+            return s->trie.key_cmp(key, row) == 0;
+        table = row;
+        hash_next(&hash);
+    }
+    return false;
+}
+
+/*
+ * Add `key` to the table in `*slot`; 1 if added, 0 if present, -1 on
+ * allocation failure. Shared tables are copied on the way down, but only
+ * after a read-only search (`probed`) has found the key missing; the table
+ * that grows is copied by set_table_edit() alone.
+ */
+static int set_add_recursive(struct hamt_set *s, void **slot,
+                             struct hash_state *hash, void *key, bool probed)
+{
+    size_t depth = hash->depth;
+    struct hamt_node *table = *slot;
+    if (!probed && table_refcount(table) > 1) {
+        if (set_search(s, table, *hash, key))
+            return 0;
+        probed = true;
+    }
+    void **rows = SET_ROWS(table);
+    if (hash_in_bucket(hash)) {
+        size_t n_rows = SET_INDEX(table), n_keys = set_n_keys(table, depth);
+        for (size_t i = 0; !probed && i < n_keys; ++i) {
+            if (s->trie.key_cmp(key, rows[i]) == 0)
+                return 0;
+        }
+        if (n_keys == n_rows && n_rows < HAMT_BUCKET_SIZE) {
+            if (!(table = set_table_edit(s, slot, depth, n_rows, n_rows, true)))
+                return -1;
+            SET_ROWS(table)[n_rows] = key;
+            SET_INDEX(table) += 1;
+            return 1;
+        }
+        if (!(table = set_unshare(s, slot, depth)))
+            return -1;
+        rows = SET_ROWS(table);
+        if (n_keys < n_rows)
+            return set_add_recursive(s, &rows[n_keys], hash_next(hash), key,
+                                     probed);
+        /* full: move the last key into a new overflow bucket */
+        void *overflow = set_table_alloc(s, 2, 2, 0);
+        if (!overflow)
+            return -1;
+        SET_ROWS(overflow)[0] = rows[n_rows - 1];
+        SET_ROWS(overflow)[1] = key;
+        rows[n_rows - 1] = overflow;
+        SET_NODEMAP(table) = 1;
+        return 1;
+    }
+    uint32_t ix = hash_get_index(hash), bit = UINT32_C(1) << ix;
+    size_t pos = champ_pos(SET_INDEX(table), SET_NODEMAP(table), ix);
+    if (!(SET_INDEX(table) & bit)) {
+        size_t n_rows = get_popcount(SET_INDEX(table));
+        if (!(table = set_table_edit(s, slot, depth, n_rows, pos, true)))
+            return -1;
+        SET_ROWS(table)[pos] = key;
+        SET_INDEX(table) |= bit;
+        return 1;
+    }
+    if (!(SET_NODEMAP(table) & bit) && !probed &&
+        s->trie.key_cmp(key, rows[pos]) == 0)
+        return 0;
+    if (!(table = set_unshare(s, slot, depth)))
+        return -1;
+    rows = SET_ROWS(table);
+    if (SET_NODEMAP(table) & bit)
+        return set_add_recursive(s, &rows[pos], hash_next(hash), key, probed);
+    struct hamt_node *sub = set_branch(s, rows[pos], hash_next(hash), key);
+    if (!sub)
+        return -1;
+    rows[set_row_flip(table, ix)] = sub;
+    return 1;
+}
+
+/*
+ * Remove `key` from the table in `*slot`, returning the stored key (NULL if
+ * there is none). Shared tables are copied only once the key is known to be
+ * present (cf. set_add_recursive()). Tables below the root that end up with
+ * a single key are freed, with the key passed up in `*gathered`.
+ */
+static void *set_remove_recursive(struct hamt_set *s, void **slot,
+                                  struct hash_state *hash, const void *key,
+                                  void **gathered, bool probed)
+{
+    size_t depth = hash->depth;
+    struct hamt_node *table = *slot;
+    if (!probed && table_refcount(table) > 1) {
+        if (!set_search(s, table, *hash, key))
+            return NULL;
+        probed = true;
+    }
+    void **rows = SET_ROWS(table);
+    void *removed = NULL;
+    if (hash_in_bucket(hash)) {
+        size_t n_rows = SET_INDEX(table), i = 0;
+        size_t n_keys = set_n_keys(table, depth);
+        while (i < n_keys && s->trie.key_cmp(key, rows[i]) != 0)
+            ++i;
+        if (i == n_keys && n_keys < n_rows) {
+            if (!(table = set_unshare(s, slot, depth)))
+                return NULL;
+            rows = SET_ROWS(table);
+            void *up = NULL;
+            removed = set_remove_recursive(s, &rows[n_keys], hash_next(hash),
+                                           key, &up, probed);
+            if (!up)
+                return removed;
+            /* the overflow bucket was gathered, its key stays last (and
+             * may be the only one left, see below) */
+            rows[n_keys] = up;
+            SET_NODEMAP(table) = 0;
+        } else {
+            if (i == n_keys)
+                return NULL;
+            removed = rows[i];
+            if (!(table = set_table_edit(s, slot, depth, n_rows, i, false)))
+                return n_rows == 1 ? removed : NULL; /* empty or OOM */
+            SET_INDEX(table) -= 1;
+        }
+    } else {
+        uint32_t ix = hash_get_index(hash), bit = UINT32_C(1) << ix;
+        if (!(SET_INDEX(table) & bit))
+            return NULL;
+        size_t pos = champ_pos(SET_INDEX(table), SET_NODEMAP(table), ix);
+        if (SET_NODEMAP(table) & bit) {
+            if (!(table = set_unshare(s, slot, depth)))
+                return NULL;
+            rows = SET_ROWS(table);
+            void *up = NULL;
+            removed = set_remove_recursive(s, &rows[pos], hash_next(hash),
+                                           key, &up, probed);
+            if (!up)
+                return removed;
+            /* the subtable was gathered into a key */
+            rows[set_row_flip(table, ix)] = up;
+        } else {
+            if (s->trie.key_cmp(key, rows[pos]) != 0)
+                return NULL;
+            removed = rows[pos];
+            size_t n_rows = get_popcount(SET_INDEX(table));
+            if (!(table = set_table_edit(s, slot, depth, n_rows, pos, false)))
+                return n_rows == 1 ? removed : NULL; /* empty or OOM */
+            SET_INDEX(table) &= ~bit;
+        }
+    }
+    if (depth > 0 && set_n_rows(table, depth) == 1 && !SET_NODEMAP(table)) {
+        *gathered = SET_ROWS(table)[0];
+        set_table_free(s, table, 1);
+        *slot = NULL;
+    }
+    return removed;
+}
+
+struct hamt_set *hamt_set_create(const struct hamt_config *cfg)
+{
+    struct hamt_set *s = ALLOC(cfg->ator, sizeof *s);
+    if (!s)
+        return NULL;
+    s->trie = (struct hamt){.root = NULL,
+                            .size = 0,
+                            .key_hash = cfg->key_hash_fn,
+                            .key_hash64 = cfg->key_hash64_fn,
+                            .key_cmp = cfg->key_cmp_fn,
+                            .ator = cfg->ator,
+#if defined(WITH_TABLE_CACHE)
+                            .cache = cfg->cache
+#endif
+    };
+    s->root = NULL;
+    return s;
+}
+
+void hamt_set_delete(struct hamt_set *s)
+{
+    set_release(s, s->root, 0);
+    FREE(s->trie.ator, s, sizeof *s);
+}
+
+void hamt_set_release(const struct hamt_set *s)
+{
+    hamt_set_delete((struct hamt_set *)s);
+}
+
+size_t hamt_set_size(const struct hamt_set *s) { return s->trie.size; }
+
+bool hamt_set_contains(const struct hamt_set *s, const void *key)
+{
+    struct hash_state hash;
+    hash_init(&hash, &s->trie, key, 0);
+    return set_search(s, s->root, hash, key);
+}
+
+int hamt_set_add(struct hamt_set *s, void *key)
+{
+    struct hash_state hash;
+    hash_init(&hash, &s->trie, key, 0);
+    if (!s->root) {
+        uint32_t bit = UINT32_C(1) << hash_get_index(&hash);
+        if (!(s->root = set_table_alloc(s, 1, bit, 0)))
+            return -1;
+        SET_ROWS(s->root)[0] = key;
+        s->trie.size = 1;
+        return 1;
+    }
+    int rc = set_add_recursive(s, &s->root, &hash, key, false);
+    if (rc == 1)
+        s->trie.size += 1;
+    return rc;
+}
+
+void *hamt_set_remove(struct hamt_set *s, const void *key)
+{
+    if (!s->root)
+        return NULL;
+    struct hash_state hash;
+    hash_init(&hash, &s->trie, key, 0);
+    void *removed = set_remove_recursive(s, &s->root, &hash, key, NULL, false);
+    if (removed)
+        s->trie.size -= 1;
+    return removed;
+}
+
+/* Create a new version of `s` that shares all tables with `s` */
+static struct hamt_set *set_copy_shallow(const struct hamt_set *s)
+{
+    struct hamt_set *copy = ALLOC(s->trie.ator, sizeof *copy);
+    if (!copy)
+        return NULL;
+    *copy = *s;
+    if (copy->root)
+        table_retain(copy->root);
+    return copy;
+}
+
+const struct hamt_set *hamt_set_padd(const struct hamt_set *s, void *key)
+{
+    struct hamt_set *copy = set_copy_shallow(s);
+    if (copy && hamt_set_add(copy, key) < 0) {
+        hamt_set_release(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+const struct hamt_set *hamt_set_premove(const struct hamt_set *s,
+                                        const void *key)
+{
+    struct hamt_set *copy = set_copy_shallow(s);
+    if (copy)
+        hamt_set_remove(copy, key);
+    return copy;
+}
+
+/* Follows the last row in a loop, cf. table_release() */
+static int set_foreach_recursive(const struct hamt_node *table, size_t depth,
+                                 hamt_set_foreach_fn fn, void *ctx)
+{
+    while (table) {
+        void **rows = SET_ROWS(table);
+        size_t n_keys = set_n_keys(table, depth);
+        size_t n_rows = set_n_rows(table, depth);
+        for (size_t i = 0; i < n_keys; ++i) {
+            int rc = fn(rows[i], ctx);
+            if (rc != 0)
+                return rc;
+        }
+        for (size_t i = n_keys; i + 1 < n_rows; ++i) {
+            int rc = set_foreach_recursive(rows[i], depth + 1, fn, ctx);
+            if (rc != 0)
+                return rc;
+        }
+        table = n_rows > n_keys ? rows[n_rows - 1] : NULL;
+        depth += 1;
+    }
+    return 0;
+}
+
+int hamt_set_foreach(const struct hamt_set *s, hamt_set_foreach_fn fn,
+                     void *ctx)
+{
+    return s->root ? set_foreach_recursive(s->root, 0, fn, ctx) : 0;
+}
+
+/*
+ * Atoms.
+ *
+ * An atom publishes the current version of a persistent trie to reader
+ * threads. Readers access the current version in epoch-protected read
+ * sections; versions replaced by hamt_atom_store() or
+ * hamt_atom_compare_exchange() are released once all read sections that
+ * might still refer to them have ended, as observed by later stores or by
+ * hamt_atom_reclaim().
+ */
+struct hamt_atom {
+    _Atomic(const struct hamt *) trie;
+    struct hamt_allocator *ator;
+    struct epoch_domain epoch;
+};
+
+static void atom_reclaim(struct epoch_entry *e, void *ctx)
+{
+    (void)ctx;
+    hamt_release((struct hamt *)((char *)e - offsetof(struct hamt, retired)));
+}
+
+struct hamt_atom *hamt_atom_create(const struct hamt *trie)
+{
+    struct hamt_atom *atom = ALLOC(trie->ator, sizeof *atom);
+    if (!atom)
+        return NULL;
+    atom->ator = trie->ator;
+    atomic_init(&atom->trie, trie);
+    if (epoch_domain_init(&atom->epoch, trie->ator, atom_reclaim, NULL) != 0) {
+        FREE(trie->ator, atom, sizeof *atom);
+        return NULL;
+    }
+    return atom;
+}
+
+void hamt_atom_delete(struct hamt_atom *atom)
+{
+    epoch_domain_destroy(&atom->epoch);
+    hamt_release(atomic_load(&atom->trie));
+    FREE(atom->ator, atom, sizeof *atom);
+}
+
+const struct hamt *hamt_atom_read_begin(struct hamt_atom *atom)
+{
+    if (!epoch_enter(&atom->epoch))
+        return NULL;
+    return atomic_load_explicit(&atom->trie, memory_order_acquire);
+}
+
+void hamt_atom_read_end(struct hamt_atom *atom)
+{
+    epoch_exit_current(&atom->epoch);
+}
+
+/* Not epoch-protected: the version may only be used until another thread
+ * replaces it, which cannot happen while the caller is the only writer */
+const struct hamt *hamt_atom_load(struct hamt_atom *atom)
+{
+    return atomic_load_explicit(&atom->trie, memory_order_acquire);
+}
+
+static void atom_retire(struct epoch_record *r, const struct hamt *trie)
+{
+    epoch_retire(r, &((struct hamt *)trie)->retired);
+}
+
+bool hamt_atom_store(struct hamt_atom *atom, const struct hamt *trie)
+{
+    struct epoch_record *r = epoch_enter(&atom->epoch);
+    if (!r)
+        return false;
+    atom_retire(r, atomic_exchange_explicit(&atom->trie, trie,
+                                            memory_order_acq_rel));
+    epoch_exit(r);
+    return true;
+}
+
+bool hamt_atom_compare_exchange(struct hamt_atom *atom,
+                                const struct hamt **expected,
+                                const struct hamt *desired)
+{
+    struct epoch_record *r = epoch_enter(&atom->epoch);
+    if (!r) {
+        *expected = atomic_load_explicit(&atom->trie, memory_order_acquire);
+        return false;
+    }
+    bool exchanged = atomic_compare_exchange_strong_explicit(
+        &atom->trie, expected, desired, memory_order_acq_rel,
+        memory_order_acquire);
+    if (exchanged)
+        atom_retire(r, *expected);
+    epoch_exit(r);
+    return exchanged;
+}
+
+bool hamt_atom_reclaim(struct hamt_atom *atom)
+{
+    return epoch_synchronize(&atom->epoch);
+}
+
+/** Iterators
+ *
+ * Iterators traverse the HAMT in DFS mode; each iterator instance maintains a
+ * "call stack" of nodes encountered so far. Nodes are represented as a pair
+ * of (a) a pointer to a `hamt_node` (aka an anchor) and a position that
+ * indexes the current position in the table referred to by the anchor.
+ *
+ * The "call stack" is implemented with dynamic memory allocation to guard
+ * against outliers in tree depth; that said, we expect the average stack
+ * depth to be in the order of log(n) (where n is the number of items in the
+ * HAMT)
+ */
+
+/*
+ * Iterators keep the path to the current row on an explicit stack of
+ * frames. The frames live inline in the iterator (hash regeneration bounds
+ * the depth of all but pathological tries) and only move to the heap if the
+ * trie is deeper than HAMT_ITERATOR_INLINE_DEPTH.
+ */
+static inline struct hamt_iterator_frame *
+iterator_frames(struct hamt_iterator *it)
+{
+    return it->heap ? it->heap : it->frames;
+}
+
+static bool iterator_grow(struct hamt_iterator *it)
+{
+    size_t capacity = 2 * it->capacity;
+    struct hamt_iterator_frame *heap =
+        ALLOC(it->trie->ator, capacity * sizeof *heap);
+    if (!heap)
+        return false;
+    memcpy(heap, iterator_frames(it), it->depth * sizeof *heap);
+    hamt_it_fini(it);
+    it->heap = heap;
+    it->capacity = capacity;
+    return true;
+}
+
+static bool iterator_push(struct hamt_iterator *it,
+                          const struct hamt_node *anchor)
+{
+    if (it->depth == it->capacity && !iterator_grow(it))
+        return false;
+    iterator_frames(it)[it->depth++] = (struct hamt_iterator_frame){
+        .table = TABLE(anchor), .size = get_popcount(INDEX(anchor)), .pos = 0};
+    return true;
+}
+
+void hamt_it_init(struct hamt_iterator *it, const struct hamt *trie)
+{
+    it->trie = trie;
+    it->cur = NULL;
+    it->heap = NULL;
+    it->depth = 0;
+    it->capacity = HAMT_ITERATOR_INLINE_DEPTH;
+    /* the bottom frame runs over the root slots */
+    it->frames[it->depth++] = (struct hamt_iterator_frame){
+        .table = trie->root, .size = root_slots(trie), .pos = 0};
+    hamt_it_next(it);
+}
+
+void hamt_it_fini(struct hamt_iterator *it)
+{
+    if (it->heap) {
+        FREE(it->trie->ator, it->heap, it->capacity * sizeof *it->heap);
+        it->heap = NULL;
+        it->capacity = HAMT_ITERATOR_INLINE_DEPTH;
+    }
+}
+
+struct hamt_iterator *hamt_it_create(struct hamt *trie)
+{
+    struct hamt_iterator *it =
+        ALLOC(trie->ator, sizeof(struct hamt_iterator));
+    if (it)
+        hamt_it_init(it, trie);
+    return it;
+}
+
+void hamt_it_delete(struct hamt_iterator *it)
+{
+    hamt_it_fini(it);
+    FREE(it->trie->ator, it, sizeof(struct hamt_iterator));
+}
+
+inline bool hamt_it_valid(struct hamt_iterator *it) { return it->cur != NULL; }
+
+struct hamt_iterator *hamt_it_next(struct hamt_iterator *it)
+{
+    if (!it)
+        return NULL;
+    while (it->depth > 0) {
+        struct hamt_iterator_frame *f = &iterator_frames(it)[it->depth - 1];
+        if (f->pos == f->size) {
+            /* all rows of the table have been dealt with */
+            it->depth--;
+            continue;
+        }
+        const struct hamt_node *cur = &f->table[f->pos++];
+        if (is_value(VALUE(cur))) {
+            it->cur = cur;
+            return it;
+        }
+        /* descend into the subtable; bail on allocation failure */
+        if (!iterator_push(it, cur))
+            break;
+    }
+    it->cur = NULL;
+    return it;
+}
+
+const void *hamt_it_get_key(struct hamt_iterator *it)
+{
+    if (it->cur) {
+        return KEY(it->cur);
+    }
+    return NULL;
+}
+
+const void *hamt_it_get_value(struct hamt_iterator *it)
 {
     if (it->cur) {
         return untagged(VALUE(it->cur));
     }
     return NULL;
 }
+
+/* Follows the last row in a loop, cf. table_release() */
+static int foreach_recursive(const struct hamt_node *anchor, hamt_foreach_fn fn,
+                             void *ctx)
+{
+    while (anchor) {
+        const struct hamt_node *table = TABLE(anchor), *tail = NULL;
+        int n_rows = get_popcount(INDEX(anchor));
+        int i = 0;
+        /* the leading leaves (see row_leaves()) need no tag checks */
+        for (int n_leaves = row_leaves(anchor); i < n_leaves; ++i) {
+            const struct hamt_node *row = &table[i];
+            int rc = fn(KEY(row), untagged(VALUE(row)), ctx);
+            if (rc != 0)
+                return rc;
+        }
+        for (; i < n_rows; ++i) {
+            const struct hamt_node *row = &table[i];
+            if (!is_value(VALUE(row)) && i + 1 == n_rows) {
+                tail = row;
+                break;
+            }
+            int rc = is_value(VALUE(row))
+                         ? fn(KEY(row), untagged(VALUE(row)), ctx)
+                         : foreach_recursive(row, fn, ctx);
+            if (rc != 0)
+                return rc;
+        }
+        anchor = tail;
+    }
+    return 0;
+}
+
+int hamt_foreach(const struct hamt *trie, hamt_foreach_fn fn, void *ctx)
+{
+    for (size_t i = 0; i < root_slots(trie); ++i) {
+        int rc = foreach_recursive(&trie->root[i], fn, ctx);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * Parallel traversal.
+ *
+ * The trie is split top-down into subtree tasks until there are at least
+ * PAR_TASKS_PER_THREAD tasks per thread (leaves above the split level are
+ * visited right away). Threads then claim tasks from a shared counter, so
+ * that idle threads pick up the remaining subtrees while others are still
+ * busy with large ones.
+ */
+#define PAR_TASKS_PER_THREAD 8
+
+struct par_job {
+    const struct hamt_node **tasks;
+    size_t n_tasks;
+    atomic_size_t next;  /* next unclaimed task */
+    atomic_int rc;       /* first non-zero callback result */
+    hamt_foreach_fn fn;
+    void *ctx;
+    const struct hamt_reducer *reducer;
+};
+
+struct par_worker {
+    pthread_t thread;
+    struct par_job *job;
+    void *acc; /* accumulator (reductions only) */
+};
+
+static int par_reduce_visit(const void *key, const void *value, void *ctx)
+{
+    struct par_worker *w = ctx;
+    w->job->reducer->accumulate(w->acc, key, value, w->job->ctx);
+    return 0;
+}
+
+static int par_visit(struct par_worker *w, const struct hamt_node *anchor)
+{
+    if (w->job->reducer)
+        return foreach_recursive(anchor, par_reduce_visit, w);
+    return foreach_recursive(anchor, w->job->fn, w->job->ctx);
+}
+
+static int par_visit_root(struct par_worker *w, const struct hamt *trie)
+{
+    for (size_t i = 0; i < root_slots(trie); ++i) {
+        int rc = par_visit(w, &trie->root[i]);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+static void *par_work(void *p)
+{
+    struct par_worker *w = p;
+    struct par_job *job = w->job;
+    size_t i;
+    while (atomic_load_explicit(&job->rc, memory_order_relaxed) == 0 &&
+           (i = atomic_fetch_add_explicit(&job->next, 1,
+                                          memory_order_relaxed)) <
+               job->n_tasks) {
+        int rc = par_visit(w, job->tasks[i]);
+        if (rc != 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&job->rc, &expected, rc);
+        }
+    }
+    return NULL;
+}
+
+/* Split the trie into subtree tasks for `n_threads` threads; the worker `w`
+ * visits the leaves encountered on the way */
+static int par_split(const struct hamt *trie, size_t n_threads,
+                     struct par_worker *w)
+{
+    struct par_job *job = w->job;
+    size_t n = root_slots(trie);
+    const struct hamt_node **tasks = ALLOC(trie->ator, n * sizeof *tasks);
+    if (!tasks)
+        return par_visit_root(w, trie);
+    for (size_t i = 0; i < n; ++i)
+        tasks[i] = &trie->root[i];
+    while (n < PAR_TASKS_PER_THREAD * n_threads) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            for (int j = 0; j < get_popcount(INDEX(tasks[i])); ++j)
+                m += !is_value(TABLE(tasks[i])[j].as.kv.value);
+        }
+        const struct hamt_node **next =
+            m ? ALLOC(trie->ator, m * sizeof *next) : NULL;
+        if (m && !next)
+            break;
+        size_t k = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const struct hamt_node *table = TABLE(tasks[i]);
+            for (int j = 0; j < get_popcount(INDEX(tasks[i])); ++j) {
+                const struct hamt_node *row = &table[j];
+                int rc = 0;
+                if (!is_value(VALUE(row)))
+                    next[k++] = row;
+                else if (job->reducer)
+                    rc = par_reduce_visit(KEY(row), untagged(VALUE(row)), w);
+                else
+                    rc = job->fn(KEY(row), untagged(VALUE(row)), job->ctx);
+                if (rc != 0) {
+                    FREE(trie->ator, tasks, n * sizeof *tasks);
+                    if (next)
+                        FREE(trie->ator, next, m * sizeof *next);
+                    return rc;
+                }
+            }
+        }
+        FREE(trie->ator, tasks, n * sizeof *tasks);
+        tasks = next;
+        n = m;
+        if (!n)
+            break;
+    }
+    job->tasks = tasks;
+    job->n_tasks = n;
+    return 0;
+}
+
+/* Run the job on `n_threads` threads, the calling thread being `workers[0]` */
+static int par_run(const struct hamt *trie, size_t n_threads,
+                   struct par_worker *workers)
+{
+    struct par_job *job = workers[0].job;
+    int rc = par_split(trie, n_threads, &workers[0]);
+    if (rc != 0 || !job->n_tasks)
+        return rc;
+    size_t n_started = 1;
+    for (; n_started < n_threads && n_started < job->n_tasks; ++n_started) {
+        if (pthread_create(&workers[n_started].thread, NULL, par_work,
+                           &workers[n_started]) != 0)
+            break;
+    }
+    par_work(&workers[0]);
+    for (size_t i = 1; i < n_started; ++i)
+        pthread_join(workers[i].thread, NULL);
+    FREE(trie->ator, job->tasks, job->n_tasks * sizeof *job->tasks);
+    return atomic_load(&job->rc);
+}
+
+int hamt_par_foreach(const struct hamt *trie, size_t n_threads,
+                     hamt_foreach_fn fn, void *ctx)
+{
+    if (n_threads <= 1)
+        return hamt_foreach(trie, fn, ctx);
+    struct par_worker *workers = ALLOC(trie->ator, n_threads * sizeof *workers);
+    if (!workers)
+        return hamt_foreach(trie, fn, ctx);
+    struct par_job job = {.tasks = NULL, .n_tasks = 0, .fn = fn, .ctx = ctx,
+                          .reducer = NULL};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.rc, 0);
+    for (size_t i = 0; i < n_threads; ++i)
+        workers[i] = (struct par_worker){.job = &job, .acc = NULL};
+    int rc = par_run(trie, n_threads, workers);
+    FREE(trie->ator, workers, n_threads * sizeof *workers);
+    return rc;
+}
+
+void hamt_par_reduce(const struct hamt *trie, size_t n_threads,
+                     const struct hamt_reducer *reducer, void *result,
+                     void *ctx)
+{
+    struct par_job job = {.tasks = NULL, .n_tasks = 0, .fn = NULL, .ctx = ctx,
+                          .reducer = reducer};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.rc, 0);
+    struct par_worker single = {.job = &job, .acc = result};
+    struct par_worker *workers =
+        n_threads > 1 ? ALLOC(trie->ator, n_threads * sizeof *workers) : NULL;
+    char *accs = workers ? ALLOC(trie->ator, (n_threads - 1) *
+                                                 reducer->acc_size)
+                         : NULL;
+    if (!accs) {
+        if (workers)
+            FREE(trie->ator, workers, n_threads * sizeof *workers);
+        par_visit_root(&single, trie);
+        return;
+    }
+    /* every accumulator starts out as a copy of the identity in `result` */
+    workers[0] = single;
+    for (size_t i = 1; i < n_threads; ++i) {
+        workers[i] = (struct par_worker){
+            .job = &job, .acc = accs + (i - 1) * reducer->acc_size};
+        memcpy(workers[i].acc, result, reducer->acc_size);
+    }
+    par_run(trie, n_threads, workers);
+    for (size_t i = 1; i < n_threads; ++i)
+        reducer->combine(result, workers[i].acc, ctx);
+    FREE(trie->ator, accs, (n_threads - 1) * reducer->acc_size);
+    FREE(trie->ator, workers, n_threads * sizeof *workers);
+}
+
+/*
+ * Comparing versions.
+ *
+ * Versions that derive from each other share every table that was not
+ * modified in between. diff_recursive() walks two tries in parallel, row by
+ * row along the bitmaps, and skips shared tables without looking inside. The
+ * cost of a comparison is therefore proportional to the difference of the
+ * versions rather than to their size.
+ */
+
+struct diff_state {
+    const struct hamt *trie; /* key hash and comparison */
+    hamt_diff_fn fn;
+    void *ctx;
+    const void *skip; /* key to leave out when listing a subtree */
+};
+
+static int diff_only_a(const void *key, const void *value, void *ctx)
+{
+    struct diff_state *ds = ctx;
+    return key == ds->skip ? 0 : ds->fn(key, value, NULL, ds->ctx);
+}
+
+static int diff_only_b(const void *key, const void *value, void *ctx)
+{
+    struct diff_state *ds = ctx;
+    return key == ds->skip ? 0 : ds->fn(key, NULL, value, ds->ctx);
+}
+
+/* Report all pairs in the leaf or subtree `row` (except for `skip`) as being
+ * present in one version only */
+static int diff_list(struct diff_state *ds, const struct hamt_node *row,
+                     hamt_foreach_fn only, const void *skip)
+{
+    ds->skip = skip;
+    int rc = is_value(VALUE(row)) ? only(KEY(row), untagged(VALUE(row)), ds)
+                                  : foreach_recursive(row, only, ds);
+    ds->skip = NULL;
+    return rc;
+}
+
+static bool diff_keys_equal(const struct diff_state *ds,
+                            const struct hamt_node *x,
+                            const struct hamt_node *y)
+{
+    if (KEY(x) == KEY(y))
+        return true;
+#if defined(WITH_LEAF_HASHES)
+    if (LEAF_HASH(x) != LEAF_HASH(y))
+        return false;
+#endif
+    return ds->trie->key_cmp(KEY(x), KEY(y)) == 0;
+}
+
+static int diff_leaves(struct diff_state *ds, const struct hamt_node *x,
+                       const struct hamt_node *y)
+{
+    const void *vx = untagged(VALUE(x)), *vy = untagged(VALUE(y));
+    if (diff_keys_equal(ds, x, y))
+        return vx == vy ? 0 : ds->fn(KEY(x), vx, vy, ds->ctx);
+    int rc = ds->fn(KEY(x), vx, NULL, ds->ctx);
+    return rc != 0 ? rc : ds->fn(KEY(y), NULL, vy, ds->ctx);
+}
+
+/* Compare `leaf` to the subtree `table` whose rows sit at `depth`;
+ * `leaf_in_a` tells which of the two versions holds the leaf */
+static int diff_leaf_table(struct diff_state *ds, const struct hamt_node *leaf,
+                           const struct hamt_node *table, size_t depth,
+                           bool leaf_in_a)
+{
+    struct hash_state *hash =
+        hash_init(&(struct hash_state){0}, ds->trie, KEY(leaf), depth);
+    struct search_result sr =
+        search(ds->trie, (struct hamt_node *)table, hash, ds->trie->key_cmp,
+               KEY(leaf), false);
+    const void *key = KEY(leaf), *v = untagged(VALUE(leaf));
+    const void *match = NULL;
+    int rc = 0;
+    if (sr.status == SEARCH_SUCCESS) {
+        const void *w = untagged(sr.VALUE(value));
+        match = sr.KEY(value);
+        if (v != w)
+            rc = leaf_in_a ? ds->fn(key, v, w, ds->ctx)
+                           : ds->fn(match, w, v, ds->ctx);
+    } else {
+        rc = leaf_in_a ? ds->fn(key, v, NULL, ds->ctx)
+                       : ds->fn(key, NULL, v, ds->ctx);
+    }
+    if (rc != 0)
+        return rc;
+    return diff_list(ds, table, leaf_in_a ? diff_only_b : diff_only_a, match);
+}
+
+/* Buckets are not ordered by hash, their leaves are matched by key */
+struct bucket_diff {
+    struct diff_state *ds;
+    const struct hamt_node *other; /* the bucket to match against */
+    size_t depth;
+    bool in_a; /* whether the listed bucket is the one of version a */
+};
+
+static int diff_bucket_leaf(const void *key, const void *value, void *ctx)
+{
+    struct bucket_diff *bd = ctx;
+    struct diff_state *ds = bd->ds;
+    struct hash_state *hash =
+        hash_init(&(struct hash_state){0}, ds->trie, key, bd->depth);
+    const struct hamt_node *match =
+        lookup((struct hamt_node *)bd->other, hash, ds->trie->key_cmp, key);
+    if (!bd->in_a) /* pairs present in both have been reported already */
+        return match ? 0 : ds->fn(key, NULL, value, ds->ctx);
+    if (!match)
+        return ds->fn(key, value, NULL, ds->ctx);
+    const void *w = untagged(VALUE(match));
+    return w == value ? 0 : ds->fn(key, value, w, ds->ctx);
+}
+
+static int diff_buckets(struct diff_state *ds, const struct hamt_node *a,
+                        const struct hamt_node *b, size_t depth)
+{
+    struct bucket_diff bd = {.ds = ds, .other = b, .depth = depth,
+                             .in_a = true};
+    int rc = foreach_recursive(a, diff_bucket_leaf, &bd);
+    if (rc != 0)
+        return rc;
+    bd = (struct bucket_diff){.ds = ds, .other = a, .depth = depth,
+                              .in_a = false};
+    return foreach_recursive(b, diff_bucket_leaf, &bd);
+}
+
+/* Compare the subtrees of `a` and `b`, whose rows sit at `depth` */
+static int diff_recursive(struct diff_state *ds, const struct hamt_node *a,
+                          const struct hamt_node *b, size_t depth)
+{
+    if (TABLE(a) == TABLE(b))
+        return 0; /* shared table */
+    if (depth >= HAMT_BUCKET_DEPTH)
+        return diff_buckets(ds, a, b, depth);
+    uint32_t index_a = INDEX(a), index_b = INDEX(b);
+    for (uint32_t bits = index_a | index_b; bits; bits &= bits - 1) {
+        uint32_t ix = __builtin_ctz(bits);
+        const struct hamt_node *x =
+            index_a & (1u << ix) ? &TABLE(a)[row_pos(a, ix)] : NULL;
+        const struct hamt_node *y =
+            index_b & (1u << ix) ? &TABLE(b)[row_pos(b, ix)] : NULL;
+        int rc;
+        if (!y)
+            rc = diff_list(ds, x, diff_only_a, NULL);
+        else if (!x)
+            rc = diff_list(ds, y, diff_only_b, NULL);
+        else if (is_value(VALUE(x)) && is_value(VALUE(y)))
+            rc = diff_leaves(ds, x, y);
+        else if (is_value(VALUE(x)))
+            rc = diff_leaf_table(ds, x, y, depth + 1, true);
+        else if (is_value(VALUE(y)))
+            rc = diff_leaf_table(ds, y, x, depth + 1, false);
+        else
+            rc = diff_recursive(ds, x, y, depth + 1);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+int hamt_diff(const struct hamt *a, const struct hamt *b, hamt_diff_fn fn,
+              void *ctx)
+{
+    assert(a->key_hash == b->key_hash && a->key_hash64 == b->key_hash64 &&
+           a->key_cmp == b->key_cmp && a->root_levels == b->root_levels &&
+           "Invariant: tries must use the same hash, key comparison and root");
+    struct diff_state ds = {.trie = a, .fn = fn, .ctx = ctx, .skip = NULL};
+    for (size_t i = 0; i < root_slots(a); ++i) {
+        int rc = diff_recursive(&ds, &a->root[i], &b->root[i], a->root_levels);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * Merge and intersection start out from a transient copy of `a` and apply
+ * the difference to `b`; the result thus shares all tables of `a` (and
+ * path-copies) that are not affected.
+ */
+struct merge_state {
+    struct hamt *result;
+    hamt_merge_fn fn;
+    void *ctx;
+    bool intersect;
+};
+
+static int merge_apply(const void *key, const void *value_a,
+                       const void *value_b, void *ctx)
+{
+    struct merge_state *ms = ctx;
+    if (!value_a) {
+        if (!ms->intersect)
+            hamt_set(ms->result, (void *)key, (void *)value_b);
+    } else if (!value_b) {
+        if (ms->intersect)
+            hamt_remove(ms->result, (void *)key);
+    } else if (ms->fn) {
+        hamt_set(ms->result, (void *)key,
+                 ms->fn(key, value_a, value_b, ms->ctx));
+    } else if (!ms->intersect) {
+        hamt_set(ms->result, (void *)key, (void *)value_b);
+    }
+    return 0;
+}
+
+static const struct hamt *merge(const struct hamt *a, const struct hamt *b,
+                                hamt_merge_fn fn, void *ctx, bool intersect)
+{
+    struct merge_state ms = {.result = hamt_transient(a),
+                             .fn = fn,
+                             .ctx = ctx,
+                             .intersect = intersect};
+    hamt_diff(a, b, merge_apply, &ms);
+    return hamt_persistent(ms.result);
+}
+
+const struct hamt *hamt_merge(const struct hamt *a, const struct hamt *b,
+                              hamt_merge_fn fn, void *ctx)
+{
+    return merge(a, b, fn, ctx, false);
+}
+
+const struct hamt *hamt_intersect(const struct hamt *a, const struct hamt *b,
+                                  hamt_merge_fn fn, void *ctx)
+{
+    return merge(a, b, fn, ctx, true);
+}
+
+/* Change feed: adapt the diff callback to one callback per kind of change */
+struct changes_state {
+    hamt_foreach_fn on_add;
+    hamt_foreach_fn on_remove;
+    hamt_diff_fn on_update;
+    void *ctx;
+};
+
+static int changes_dispatch(const void *key, const void *old_value,
+                            const void *new_value, void *ctx)
+{
+    struct changes_state *cs = ctx;
+    if (!old_value)
+        return cs->on_add ? cs->on_add(key, new_value, cs->ctx) : 0;
+    if (!new_value)
+        return cs->on_remove ? cs->on_remove(key, old_value, cs->ctx) : 0;
+    return cs->on_update ? cs->on_update(key, old_value, new_value, cs->ctx)
+                         : 0;
+}
+
+int hamt_changes(const struct hamt *from, const struct hamt *to,
+                 hamt_foreach_fn on_add, hamt_foreach_fn on_remove,
+                 hamt_diff_fn on_update, void *ctx)
+{
+    struct changes_state cs = {.on_add = on_add,
+                               .on_remove = on_remove,
+                               .on_update = on_update,
+                               .ctx = ctx};
+    return hamt_diff(from, to, changes_dispatch, &cs);
+}
+
+static int equal_stop(const void *key, const void *value_a,
+                      const void *value_b, void *ctx)
+{
+    (void)key;
+    (void)value_a;
+    (void)value_b;
+    (void)ctx;
+    return 1;
+}
+
+/*
+ * The shape of a trie only depends on its keys: a subtree is a leaf if and
+ * only if it holds a single key (removal gathers tables that drop to a
+ * single leaf). Tries with equal contents hence have equal bitmaps and
+ * corresponding rows, and equal_recursive() can bail out on the first table
+ * that differs. Buckets are not ordered and get compared like in a diff.
+ */
+static bool equal_recursive(struct diff_state *ds, const struct hamt_node *a,
+                            const struct hamt_node *b, size_t depth)
+{
+    if (TABLE(a) == TABLE(b))
+        return true;
+    if (depth >= HAMT_BUCKET_DEPTH)
+        return diff_buckets(ds, a, b, depth) == 0;
+    if (INDEX(a) != INDEX(b))
+        return false;
+#if defined(WITH_CHAMP_LAYOUT)
+    if (NODEMAP(a) != NODEMAP(b))
+        return false;
+#endif
+    int n_rows = get_popcount(INDEX(a));
+    int i = 0;
+    for (int n_leaves = row_leaves(a); i < n_leaves; ++i) {
+        const struct hamt_node *x = &TABLE(a)[i], *y = &TABLE(b)[i];
+        if (VALUE(x) != VALUE(y) || !diff_keys_equal(ds, x, y))
+            return false;
+    }
+    for (; i < n_rows; ++i) {
+        const struct hamt_node *x = &TABLE(a)[i], *y = &TABLE(b)[i];
+        if (is_value(VALUE(x)) != is_value(VALUE(y)))
+            return false;
+        if (is_value(VALUE(x)) ? VALUE(x) != VALUE(y) ||
+                                     !diff_keys_equal(ds, x, y)
+                               : !equal_recursive(ds, x, y, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+bool hamt_equal(const struct hamt *a, const struct hamt *b)
+{
+    assert(a->root_levels == b->root_levels &&
+           "Invariant: tries must use the same root");
+    if (a->size != b->size)
+        return false;
+    struct diff_state ds = {.trie = a, .fn = equal_stop, .ctx = NULL};
+    for (size_t i = 0; i < root_slots(a); ++i) {
+        if (!equal_recursive(&ds, &a->root[i], &b->root[i], a->root_levels))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Serialization.
+ *
+ * An image is a position-independent copy of the trie: tables are written
+ * depth-first, children before their parents, and use the row encoding of
+ * `struct hamt_node` with file offsets in place of pointers, i.e. a leaf
+ * row holds the tagged offset of the value and the offset of the key, a
+ * table row the offset of its table and its bitmap. Keys and values are
+ * written as the byte strings returned by the codec, 8-byte aligned. The
+ * image ends with a trailer that locates the root table, such that images
+ * can be written to streams.
+ *
+ * Since keys and values are used in place, a pointer to their bytes in the
+ * image must be usable as a key (value), e.g. NUL-terminated strings.
+ */
+#define IMAGE_MAGIC 0x544d4148u /* "HAMT", also detects byte order */
+#define IMAGE_VERSION 2u /* 2: collision buckets */
+
+#define IMAGE_HASH64 0x1u /* trie uses 64 bit hashes */
+
+struct image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t flags;
+};
+
+struct image_row {
+    uint64_t ref;   /* tagged value offset or table offset */
+    uint64_t other; /* key offset or table bitmap */
+};
+
+struct image_trailer {
+    uint64_t root;       /* offset of the root table */
+    uint64_t root_index; /* bitmap of the root table */
+    uint64_t size;
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct image_writer {
+    int (*write)(const void *buf, size_t len, void *ctx);
+    void *ctx;
+    uint64_t offset;
+    const struct hamt_codec *codec;
+};
+
+static int image_write(struct image_writer *w, const void *buf, size_t len)
+{
+    static const char zeros[8];
+    size_t pad = (8 - len % 8) % 8;
+    if ((len && w->write(buf, len, w->ctx) != 0) ||
+        (pad && w->write(zeros, pad, w->ctx) != 0))
+        return -1;
+    w->offset += len + pad;
+    return 0;
+}
+
+static int image_write_blob(struct image_writer *w, hamt_encode_fn encode,
+                            const void *obj, uint64_t *offset)
+{
+    size_t len = 0;
+    const void *bytes = encode(obj, &len, w->codec->ctx);
+    *offset = w->offset;
+    return image_write(w, bytes, len);
+}
+
+/* Write the subtree of `anchor` and return the offset of its table */
+static int image_write_table(struct image_writer *w,
+                             const struct hamt_node *anchor, uint64_t *offset)
+{
+    struct image_row rows[32];
+    int n_rows = get_popcount(INDEX(anchor));
+    for (int i = 0; i < n_rows; ++i) {
+        /* images keep the rows in index order */
+        const struct hamt_node *row =
+            &TABLE(anchor)[row_pos_ranked(anchor, i)];
+        int rc;
+        if (is_value(VALUE(row))) {
+            rc = image_write_blob(w, w->codec->encode_value,
+                                  untagged(VALUE(row)), &rows[i].ref);
+            rows[i].ref |= HAMT_TAG_VALUE;
+            rc = rc ? rc
+                    : image_write_blob(w, w->codec->encode_key, KEY(row),
+                                       &rows[i].other);
+        } else {
+            rc = image_write_table(w, row, &rows[i].ref);
+            rows[i].other = INDEX(row);
+        }
+        if (rc != 0)
+            return rc;
+    }
+    *offset = w->offset;
+    return image_write(w, rows, n_rows * sizeof(struct image_row));
+}
+
+static int image_write_trie(struct image_writer *w, const struct hamt *trie)
+{
+    if (trie->root_levels)
+        return -1; /* images have a single root table */
+    struct image_header header = {.magic = IMAGE_MAGIC,
+                                  .version = IMAGE_VERSION,
+                                  .flags = trie->key_hash64 ? IMAGE_HASH64 : 0};
+    struct image_trailer trailer = {.root_index = INDEX(trie->root),
+                                    .size = trie->size,
+                                    .magic = IMAGE_MAGIC,
+                                    .version = IMAGE_VERSION};
+    if (image_write(w, &header, sizeof header) != 0 ||
+        image_write_table(w, trie->root, &trailer.root) != 0)
+        return -1;
+    return image_write(w, &trailer, sizeof trailer);
+}
+
+static int image_write_file(const void *buf, size_t len, void *ctx)
+{
+    return fwrite(buf, 1, len, ctx) == len ? 0 : -1;
+}
+
+int hamt_serialize(const struct hamt *trie, FILE *f,
+                   const struct hamt_codec *codec)
+{
+    struct image_writer w = {
+        .write = image_write_file, .ctx = f, .offset = 0, .codec = codec};
+    return image_write_trie(&w, trie);
+}
+
+/* Read-only trie served from a mapped image */
+struct hamt_mapped {
+    const char *base;
+    size_t length;
+    uint64_t root;
+    uint32_t root_index;
+    size_t size;
+    struct hamt trie; /* hash and key comparison */
+};
+
+/*
+ * Rows of the image table at offset `table` with bitmap `index`, or NULL if
+ * the table does not end before `limit`. Images are written bottom-up, i.e.
+ * the subtables and blobs of a table precede it: passing the offset of the
+ * parent table as `limit` keeps every walk inside the mapping and rules out
+ * cycles.
+ */
+static const struct image_row *mapped_rows(const struct hamt_mapped *m,
+                                           uint64_t table, uint32_t index,
+                                           uint64_t limit)
+{
+    uint64_t size = get_popcount(index) * sizeof(struct image_row);
+    if (table % 8 != 0 || table < sizeof(struct image_header) ||
+        table > limit || size > limit - table)
+        return NULL;
+    return (const struct image_row *)(m->base + table);
+}
+
+/* The root table ends before the trailer */
+static inline uint64_t mapped_limit(const struct hamt_mapped *m)
+{
+    return m->length - sizeof(struct image_trailer);
+}
+
+/* Whether the key and value of the leaf `row` of `table` precede it */
+static inline bool mapped_leaf_valid(const struct image_row *row,
+                                     uint64_t table)
+{
+    return row->other <= table &&
+           (row->ref & ~(uint64_t)HAMT_TAG_MASK) <= table;
+}
+
+struct hamt_mapped *hamt_open_mapped(const char *path,
+                                     const struct hamt_config *cfg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >=
+            sizeof(struct image_header) + sizeof(struct image_trailer))
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); /* the mapping keeps the file open */
+    if (base == MAP_FAILED)
+        return NULL;
+    size_t length = st.st_size;
+    const struct image_header *header = base;
+    const struct image_trailer *trailer =
+        (const struct image_trailer *)((const char *)base + length) - 1;
+    struct hamt_mapped *m = NULL;
+    uint64_t flags = cfg->key_hash64_fn ? IMAGE_HASH64 : 0;
+    if (header->magic == IMAGE_MAGIC && header->version == IMAGE_VERSION &&
+        header->flags == flags &&
+        trailer->magic == IMAGE_MAGIC && trailer->version == IMAGE_VERSION)
+        m = ALLOC(cfg->ator, sizeof *m);
+    if (!m) {
+        munmap(base, length);
+        return NULL;
+    }
+    *m = (struct hamt_mapped){.base = base,
+                              .length = length,
+                              .root = trailer->root,
+                              .root_index = trailer->root_index,
+                              .size = trailer->size,
+                              .trie = {.key_hash = cfg->key_hash_fn,
+                                       .key_hash64 = cfg->key_hash64_fn,
+                                       .key_cmp = cfg->key_cmp_fn,
+                                       .ator = cfg->ator}};
+    if (trailer->root_index > UINT32_MAX ||
+        !mapped_rows(m, m->root, m->root_index, mapped_limit(m))) {
+        hamt_mapped_close(m);
+        return NULL;
+    }
+    return m;
+}
+
+void hamt_mapped_close(struct hamt_mapped *m)
+{
+    munmap((void *)m->base, m->length);
+    FREE(m->trie.ator, m, sizeof *m);
+}
+
+size_t hamt_mapped_size(const struct hamt_mapped *m) { return m->size; }
+
+const void *hamt_mapped_get(const struct hamt_mapped *m, const void *key)
+{
+    struct hash_state hash;
+    hash_init(&hash, &m->trie, key, 0);
+    uint64_t table = m->root, limit = mapped_limit(m);
+    uint32_t index = m->root_index;
+    for (;;) {
+        const struct image_row *row = mapped_rows(m, table, index, limit);
+        if (!row)
+            return NULL; /* corrupt image */
+        if (hash_in_bucket(&hash)) {
+            /* scan the bucket, the overflow bucket is in the last row */
+            const struct image_row *end = row + get_popcount(index);
+            for (; row < end && (row->ref & HAMT_TAG_VALUE); ++row) {
+                if (!mapped_leaf_valid(row, table))
+                    return NULL;
+                if (m->trie.key_cmp(key, m->base + row->other) == 0)
+                    break;
+            }
+            if (row == end)
+                return NULL;
+        } else {
+            uint32_t ix = hash_get_index(&hash);
+            if (!(index & (1u << ix)))
+                return NULL;
+            row += get_pos(ix, index);
+        }
+        if (row->ref & HAMT_TAG_VALUE) {
+            if (!mapped_leaf_valid(row, table) ||
+                m->trie.key_cmp(key, m->base + row->other) != 0)
+                return NULL;
+            return m->base + (row->ref & ~(uint64_t)HAMT_TAG_MASK);
+        }
+        limit = table;
+        table = row->ref;
+        index = (uint32_t)row->other;
+        hash_next(&hash);
+    }
+}
+
+static int mapped_foreach_recursive(const struct hamt_mapped *m,
+                                    uint64_t table, uint32_t index,
+                                    uint64_t limit, hamt_foreach_fn fn,
+                                    void *ctx)
+{
+    /* follows the last row in a loop, cf. table_release() */
+    for (;;) {
+        const struct image_row *rows = mapped_rows(m, table, index, limit);
+        if (!rows)
+            return -1; /* corrupt image */
+        int n_rows = get_popcount(index);
+        const struct image_row *tail = NULL;
+        for (int i = 0; i < n_rows; ++i) {
+            int rc;
+            if (!(rows[i].ref & HAMT_TAG_VALUE) && i + 1 == n_rows) {
+                tail = &rows[i];
+                break;
+            }
+            if (!(rows[i].ref & HAMT_TAG_VALUE))
+                rc = mapped_foreach_recursive(m, rows[i].ref,
+                                              (uint32_t)rows[i].other, table,
+                                              fn, ctx);
+            else if (!mapped_leaf_valid(&rows[i], table))
+                rc = -1;
+            else
+                rc = fn(m->base + rows[i].other,
+                        m->base + (rows[i].ref & ~(uint64_t)HAMT_TAG_MASK),
+                        ctx);
+            if (rc != 0)
+                return rc;
+        }
+        if (!tail)
+            return 0;
+        limit = table;
+        table = tail->ref;
+        index = (uint32_t)tail->other;
+    }
+}
+
+int hamt_mapped_foreach(const struct hamt_mapped *m, hamt_foreach_fn fn,
+                        void *ctx)
+{
+    return mapped_foreach_recursive(m, m->root, m->root_index,
+                                    mapped_limit(m), fn, ctx);
+}
+
+/*
+ * Snapshot writer.
+ *
+ * Snapshots are written as a sequence of images to a single stream: the
+ * image header appears once, every snapshot appends its tables and a
+ * trailer, and offsets are relative to the start of the stream. Mapping
+ * the stream thus opens the latest snapshot.
+ *
+ * The writer remembers the offset of every table of the last snapshot
+ * (keyed by table pointer) and keeps that version alive through a shallow
+ * copy, which keeps its tables immutable. Subtrees whose table has already
+ * been written are referenced by offset instead of being written again,
+ * such that a snapshot only writes the tables that changed since the last
+ * one.
+ *
+ * The traversal is a post-order DFS with an explicit stack (every frame
+ * collects the rows of its table until all children have been written),
+ * which allows to stop after every chunk of output.
+ */
+struct snapshot_frame {
+    const struct hamt_node *anchor;
+    int pos;
+    int n_rows;
+    struct image_row rows[32];
+};
+
+struct hamt_snapshot_writer {
+    struct hamt_allocator *ator;
+    hamt_write_fn write;
+    void *ctx;
+    struct image_writer image;
+    char *chunk;
+    size_t chunk_size;
+    size_t chunk_used;
+    size_t n_flushed; /* number of chunks handed to `write` */
+    int error;
+    struct hamt *offsets;     /* table -> offset, for the tables of `prev` */
+    const struct hamt *prev;  /* version of the last snapshot */
+    const struct hamt *cur;   /* version being written */
+    struct snapshot_frame *frames;
+    size_t depth;
+    size_t capacity;
+};
+
+static uint32_t snapshot_table_hash(const void *key, const size_t gen)
+{
+    uint64_t x = (uintptr_t)key + gen * 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+static int snapshot_table_cmp(const void *lhs, const void *rhs)
+{
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static int snapshot_flush(struct hamt_snapshot_writer *w)
+{
+    if (w->chunk_used == 0)
+        return 0;
+    if (w->write(w->chunk, w->chunk_used, w->ctx) != 0)
+        return -1;
+    w->chunk_used = 0;
+    w->n_flushed += 1;
+    return 0;
+}
+
+/* Sink of the image writer: collect output in chunks of `chunk_size` */
+static int snapshot_buffer(const void *buf, size_t len, void *ctx)
+{
+    struct hamt_snapshot_writer *w = ctx;
+    const char *p = buf;
+    while (len > 0) {
+        size_t n = w->chunk_size - w->chunk_used;
+        n = n < len ? n : len;
+        memcpy(w->chunk + w->chunk_used, p, n);
+        w->chunk_used += n;
+        p += n;
+        len -= n;
+        if (w->chunk_used == w->chunk_size && snapshot_flush(w) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+struct hamt_snapshot_writer *
+hamt_snapshot_writer_create(struct hamt_allocator *ator,
+                            const struct hamt_codec *codec, hamt_write_fn write,
+                            void *ctx, size_t chunk_size)
+{
+    struct hamt_snapshot_writer *w = ALLOC(ator, sizeof *w);
+    if (!w)
+        return NULL;
+    chunk_size = chunk_size < 64 ? 64 : chunk_size;
+    *w = (struct hamt_snapshot_writer){
+        .ator = ator,
+        .write = write,
+        .ctx = ctx,
+        .image = {.write = snapshot_buffer, .ctx = w, .offset = 0,
+                  .codec = codec},
+        .chunk = ALLOC(ator, chunk_size),
+        .chunk_size = chunk_size};
+    if (!w->chunk) {
+        FREE(ator, w, sizeof *w);
+        return NULL;
+    }
+    return w;
+}
+
+void hamt_snapshot_writer_delete(struct hamt_snapshot_writer *w)
+{
+    if (w->cur)
+        hamt_release(w->cur);
+    if (w->prev)
+        hamt_release(w->prev);
+    if (w->offsets)
+        hamt_delete(w->offsets);
+    if (w->frames)
+        FREE(w->ator, w->frames, w->capacity * sizeof *w->frames);
+    FREE(w->ator, w->chunk, w->chunk_size);
+    FREE(w->ator, w, sizeof *w);
+}
+
+/* Look up the offset of a table written by an earlier snapshot (or 0) */
+static uint64_t snapshot_offset(struct hamt_snapshot_writer *w,
+                                const struct hamt_node *anchor)
+{
+    struct hamt_node *table = TABLE(anchor);
+    return table ? (uintptr_t)hamt_get(w->offsets, table) : 0;
+}
+
+static int snapshot_push(struct hamt_snapshot_writer *w,
+                         const struct hamt_node *anchor)
+{
+    if (w->depth == w->capacity) {
+        size_t capacity = w->capacity ? 2 * w->capacity : 8;
+        struct snapshot_frame *frames =
+            REALLOC(w->ator, w->frames, w->capacity * sizeof *frames,
+                    capacity * sizeof *frames);
+        if (!frames)
+            return -1;
+        w->frames = frames;
+        w->capacity = capacity;
+    }
+    struct snapshot_frame *f = &w->frames[w->depth++];
+    f->anchor = anchor;
+    f->pos = 0;
+    f->n_rows = get_popcount(INDEX(anchor));
+    return 0;
+}
+
+/* Drop the offsets of the tables of `prev` that `cur` does not share; `cur`
+ * is the anchor at the same position in the new version (or NULL) */
+static void snapshot_forget(struct hamt *offsets, const struct hamt_node *prev,
+                            const struct hamt_node *cur)
+{
+    if (cur && TABLE(prev) == TABLE(cur))
+        return;
+    if (TABLE(prev))
+        hamt_remove(offsets, TABLE(prev));
+    for (uint32_t bits = INDEX(prev); bits; bits &= bits - 1) {
+        uint32_t ix = __builtin_ctz(bits);
+        const struct hamt_node *x = &TABLE(prev)[row_pos(prev, ix)];
+        if (is_value(VALUE(x)))
+            continue;
+        const struct hamt_node *y = NULL;
+        if (cur && (INDEX(cur) & (1u << ix))) {
+            y = &TABLE(cur)[row_pos(cur, ix)];
+            y = is_value(VALUE(y)) ? NULL : y;
+        }
+        snapshot_forget(offsets, x, y);
+    }
+}
+
+/* Write the trailer for table `root` and make `cur` the reference for
+ * deduplication */
+static int snapshot_finish(struct hamt_snapshot_writer *w, uint64_t root)
+{
+    struct image_trailer trailer = {.root = root,
+                                    .root_index = INDEX(w->cur->root),
+                                    .size = w->cur->size,
+                                    .magic = IMAGE_MAGIC,
+                                    .version = IMAGE_VERSION};
+    if (image_write(&w->image, &trailer, sizeof trailer) != 0 ||
+        snapshot_flush(w) != 0)
+        return -1;
+    if (w->prev) {
+        snapshot_forget(w->offsets, w->prev->root, w->cur->root);
+        hamt_release(w->prev);
+    }
+    w->prev = w->cur;
+    w->cur = NULL;
+    return 0;
+}
+
+/* Advance the DFS by one row (or finish a table) */
+static int snapshot_advance(struct hamt_snapshot_writer *w)
+{
+    struct snapshot_frame *f = &w->frames[w->depth - 1];
+    if (f->pos == f->n_rows) {
+        /* all children are written, write the table itself */
+        uint64_t offset = w->image.offset;
+        if (image_write(&w->image, f->rows,
+                        f->n_rows * sizeof(struct image_row)) != 0)
+            return -1;
+        if (TABLE(f->anchor))
+            hamt_set(w->offsets, TABLE(f->anchor), (void *)(uintptr_t)offset);
+        if (--w->depth == 0)
+            return snapshot_finish(w, offset);
+        struct snapshot_frame *parent = &w->frames[w->depth - 1];
+        parent->rows[parent->pos].ref = offset;
+        parent->rows[parent->pos].other = INDEX(f->anchor);
+        parent->pos += 1;
+        return 0;
+    }
+    const struct hamt_node *row =
+        &TABLE(f->anchor)[row_pos_ranked(f->anchor, f->pos)];
+    struct image_row *out = &f->rows[f->pos];
+    if (is_value(VALUE(row))) {
+        const struct hamt_codec *codec = w->image.codec;
+        if (image_write_blob(&w->image, codec->encode_value,
+                             untagged(VALUE(row)), &out->ref) != 0 ||
+            image_write_blob(&w->image, codec->encode_key, KEY(row),
+                             &out->other) != 0)
+            return -1;
+        out->ref |= HAMT_TAG_VALUE;
+        f->pos += 1;
+        return 0;
+    }
+    uint64_t offset = snapshot_offset(w, row);
+    if (!offset)
+        return snapshot_push(w, row);
+    out->ref = offset;
+    out->other = INDEX(row);
+    f->pos += 1;
+    return 0;
+}
+
+int hamt_snapshot_writer_begin(struct hamt_snapshot_writer *w,
+                               const struct hamt *trie)
+{
+    assert(!w->cur && "snapshot in progress");
+    if (w->error || trie->root_levels)
+        return -1;
+    if (!w->offsets) {
+        /* the map lives in an arena: steps may run on any thread and must
+         * not allocate from the cache of the trie */
+        struct hamt_config cfg = {.ator = trie->ator,
+                                  .key_cmp_fn = snapshot_table_cmp,
+                                  .key_hash_fn = snapshot_table_hash,
+                                  .arena = true};
+        struct image_header header = {
+            .magic = IMAGE_MAGIC,
+            .version = IMAGE_VERSION,
+            .flags = trie->key_hash64 ? IMAGE_HASH64 : 0};
+        if (!(w->offsets = hamt_create(&cfg)) ||
+            image_write(&w->image, &header, sizeof header) != 0)
+            return w->error = -1;
+    }
+    w->cur = hamt_copy_shallow(trie);
+    w->depth = 0;
+    uint64_t root = snapshot_offset(w, w->cur->root);
+    int rc = root ? snapshot_finish(w, root) : snapshot_push(w, w->cur->root);
+    return rc != 0 ? (w->error = -1) : 0;
+}
+
+int hamt_snapshot_writer_step(struct hamt_snapshot_writer *w)
+{
+    if (w->error)
+        return -1;
+    if (!w->cur)
+        return 0;
+    /* write (at least) one chunk */
+    size_t n_flushed = w->n_flushed;
+    while (w->cur && w->n_flushed == n_flushed) {
+        if (snapshot_advance(w) != 0)
+            return w->error = -1;
+    }
+    return w->cur ? 1 : 0;
+}
@@ -0,0 +1,444 @@
+/*
+ * Core search and modification functions.
+ *
+ * This file is included by hamt.c once for every key representation, with
+ * the following macros defining the instance:
+ *
+ *   CORE_FN(name)              name of the instance of function `name`
+ *   CORE_HASH(hash, key, gen)  64 bit hash of `key` for generation `gen`,
+ *                              `hash` is any hash state of the trie
+ *   CORE_KEY_EQ(cmp, lhs, rhs) key equality, `cmp` is the trie's comparison
+ *
+ * The generic instance calls through the hash and comparison functions of
+ * the trie configuration; specialized instances expand to inline code. All
+ * instances share the node layout and table management, such that all other
+ * functions work on tries of any instance.
+ */
+
+/* Hash state of `key` at depth 0 */
+static inline struct hash_state *CORE_FN(hash_start)(struct hash_state *h,
+                                                     const struct hamt *trie,
+                                                     const void *key)
+{
+    h->key = key;
+    h->hash_fn = trie->key_hash;
+    h->hash64_fn = trie->key_hash64;
+    h->depth = 0;
+    h->shift = 0;
+    h->hash = CORE_HASH(h, key, 0);
+    return h;
+}
+
+/* cf. hash_next() */
+static inline struct hash_state *CORE_FN(hash_advance)(struct hash_state *h)
+{
+    h->depth += 1;
+    h->shift += 5;
+    if (h->shift == 5 * hash_levels(h)) {
+        h->hash = CORE_HASH(h, h->key, h->depth);
+        h->shift = 0;
+    }
+    return h;
+}
+
+/* cf. leaf_rehash() */
+static inline uint64_t CORE_FN(leaf_hash)(const struct hash_state *hash,
+                                          const struct hamt_node *leaf,
+                                          size_t depth)
+{
+    size_t levels = hash_levels(hash);
+#if defined(WITH_LEAF_HASHES)
+    if (depth < levels)
+        return LEAF_HASH(leaf);
+#endif
+    return CORE_HASH(hash, KEY(leaf), depth - depth % levels);
+}
+
+/*
+ * Replace the leaf at the index of `hash` in the table `parent` points to
+ * with a subtable holding both the leaf and the new pair.
+ */
+static const struct hamt_node *
+CORE_FN(insert_table)(struct hamt *h, struct hamt_node *parent,
+                      struct hash_state *hash, void *key, void *value)
+{
+    /* FIXME: check for alloc failure and bail out correctly (deleting the
+     *        incomplete subtree */
+
+    struct hamt_node *anchor = row_to_table(parent, hash_get_index(hash));
+    /* Collect everything we know about the existing value */
+    struct hash_state *x_hash = &(struct hash_state){
+        .key = KEY(anchor),
+        .hash_fn = hash->hash_fn,
+        .hash64_fn = hash->hash64_fn,
+        .hash = CORE_FN(leaf_hash)(hash, anchor, hash->depth),
+        .depth = hash->depth,
+        .shift = hash->shift};
+    struct hamt_node x_leaf = *anchor; /* tagged (!) value ptr */
+    /* increase depth until the hashes diverge, building a list
+     * of tables along the way */
+    struct hash_state *next_hash = CORE_FN(hash_advance)(hash);
+    struct hash_state *x_next_hash = CORE_FN(hash_advance)(x_hash);
+    while (!hash_in_bucket(next_hash) &&
+           hash_get_index(x_next_hash) == hash_get_index(next_hash)) {
+        uint32_t bit = UINT32_C(1) << hash_get_index(next_hash);
+        anchor_init(anchor, table_allocate(h, 1), bit, bit);
+        next_hash = CORE_FN(hash_advance)(next_hash);
+        x_next_hash = CORE_FN(hash_advance)(x_next_hash);
+        anchor = TABLE(anchor);
+    }
+    if (hash_in_bucket(next_hash)) {
+        /* the hashes did not diverge, collect both leaves in a bucket */
+        anchor_init(anchor, table_allocate(h, 2), bucket_index(2), 0);
+        TABLE(anchor)[0] = x_leaf;
+        leaf_init(&TABLE(anchor)[1], next_hash, key, value);
+        return &TABLE(anchor)[1];
+    }
+    uint32_t next_index = hash_get_index(next_hash);
+    uint32_t x_next_index = hash_get_index(x_next_hash);
+    /* the hashes are different, let's allocate a table with two
+     * entries to store the existing and new values */
+    anchor_init(anchor, table_allocate(h, 2),
+                (UINT32_C(1) << next_index) | (UINT32_C(1) << x_next_index), 0);
+    /* determine the proper position in the allocated table */
+    int x_pos = row_pos(anchor, x_next_index);
+    int pos = row_pos(anchor, next_index);
+    /* fill in the existing value; no need to tag the value pointer
+     * since it is already tagged. */
+    TABLE(anchor)[x_pos] = x_leaf;
+    /* fill in the new key/value pair, tagging the pointer to the
+     * new value to mark it as a value ptr */
+    leaf_init(&TABLE(anchor)[pos], next_hash, key, value);
+
+    return &TABLE(anchor)[pos];
+}
+
+/*
+ * Scan the bucket `anchor` points to for `key`. Returns the matching leaf, or
+ * NULL and the overflow row of the bucket (if any) in `overflow`.
+ */
+static inline struct hamt_node *
+CORE_FN(bucket_scan)(struct hamt_node *anchor, hamt_key_cmp_fn cmp_eq,
+                     const void *key, struct hamt_node **overflow)
+{
+    (void)cmp_eq;
+    struct hamt_node *row = TABLE(anchor);
+    struct hamt_node *end = row + get_popcount(INDEX(anchor));
+    *overflow = NULL;
+    for (; row < end; ++row) {
+        if (!is_value(VALUE(row)))
+            *overflow = row;
+        else if (CORE_KEY_EQ(cmp_eq, key, KEY(row)))
+            return row;
+    }
+    return NULL;
+}
+
+/*
+ * Find the leaf holding `key`, starting at `anchor`; NULL if there is none.
+ * This is the read-only fast path of search().
+ */
+static inline struct hamt_node *CORE_FN(lookup)(struct hamt_node *anchor,
+                                                struct hash_state *hash,
+                                                hamt_key_cmp_fn cmp_eq,
+                                                const void *key)
+{
+    (void)cmp_eq;
+    for (;;) {
+        if (hash_in_bucket(hash)) {
+            struct hamt_node *overflow, *leaf =
+                CORE_FN(bucket_scan)(anchor, cmp_eq, key, &overflow);
+            if (leaf || !overflow)
+                return leaf;
+            anchor = overflow;
+            CORE_FN(hash_advance)(hash);
+            continue;
+        }
+        uint32_t expected_index = hash_get_index(hash);
+        if (!has_index(anchor, expected_index))
+            return NULL;
+        struct hamt_node *next =
+            &TABLE(anchor)[row_pos(anchor, expected_index)];
+        if (is_value(VALUE(next))) {
+            if (leaf_may_match(next, hash) &&
+                CORE_KEY_EQ(cmp_eq, key, KEY(next)))
+                return next;
+            return NULL;
+        }
+        anchor = next;
+        CORE_FN(hash_advance)(hash);
+    }
+}
+
+/*
+ * Search for `key`, starting at `anchor`. If `unshare` is true, every table
+ * on the search path is made exclusive to the trie (see `table_unshare()`)
+ * such that the result can be modified in place. The one exception is the
+ * table of a SEARCH_FAIL_NOTFOUND result: insertion replaces that table
+ * anyway and `table_extend()` deals with shared tables directly, which saves
+ * a copy.
+ */
+static inline struct search_result
+CORE_FN(search)(const struct hamt *h, struct hamt_node *anchor,
+                struct hash_state *hash, hamt_key_cmp_fn cmp_eq,
+                const void *key, bool unshare)
+{
+    (void)cmp_eq;
+    for (;;) {
+        assert(!is_value(VALUE(anchor)) &&
+               "Invariant: search requires an internal node");
+        if (hash_in_bucket(hash)) {
+            if (unshare) {
+                table_unshare(h, anchor);
+            }
+            struct hamt_node *overflow, *leaf =
+                CORE_FN(bucket_scan)(anchor, cmp_eq, key, &overflow);
+            if (leaf || !overflow) {
+                return (struct search_result){
+                    .status = leaf ? SEARCH_SUCCESS : SEARCH_FAIL_NOTFOUND,
+                    .anchor = anchor,
+                    .value = leaf,
+                    .hash = hash};
+            }
+            anchor = overflow;
+            CORE_FN(hash_advance)(hash);
+            continue;
+        }
+        /* determine the expected index in table */
+        uint32_t expected_index = hash_get_index(hash);
+        /* if the expected index is not set, terminate search */
+        if (!has_index(anchor, expected_index)) {
+            return (struct search_result){.status = SEARCH_FAIL_NOTFOUND,
+                                          .anchor = anchor,
+                                          .value = NULL,
+                                          .hash = hash};
+        }
+        if (unshare) {
+            table_unshare(h, anchor);
+        }
+        /* get the compact index to address the array */
+        int pos = row_pos(anchor, expected_index);
+        /* index into the table and check what type of entry we're looking at */
+        struct hamt_node *next = &TABLE(anchor)[pos];
+        if (is_value(VALUE(next))) {
+            /* keys match, or not found: same hash but different key */
+            bool match = leaf_may_match(next, hash) &&
+                         CORE_KEY_EQ(cmp_eq, key, KEY(next));
+            return (struct search_result){
+                .status = match ? SEARCH_SUCCESS : SEARCH_FAIL_KEYMISMATCH,
+                .anchor = anchor,
+                .value = next,
+                .hash = hash};
+        }
+        /* for table entries, continue on the next level */
+        assert(TABLE(next) != NULL && "invariant: table ptrs must not be NULL");
+        anchor = next;
+        CORE_FN(hash_advance)(hash);
+    }
+}
+
+/*
+ * Insert or update `key` in the trie with root `root`, path-copying shared
+ * tables on the way down. The search and the insertion happen in a single
+ * pass. The new value is `fn(key, old value or NULL, ctx)`, or `ctx` itself
+ * if `fn` is NULL.
+ */
+static const struct hamt_node *CORE_FN(upsert)(struct hamt *h,
+                                               struct hamt_node *root,
+                                               void *key, hamt_upsert_fn fn,
+                                               void *ctx)
+{
+    struct hash_state *hash =
+        CORE_FN(hash_start)(&(struct hash_state){0}, h, key);
+    struct hamt_node *anchor = root_slot(h, root, hash);
+    const struct hamt_node *inserted = NULL;
+    for (;;) {
+        if (hash_in_bucket(hash)) {
+            table_unshare(h, anchor);
+            struct hamt_node *overflow, *leaf =
+                CORE_FN(bucket_scan)(anchor, h->key_cmp, key, &overflow);
+            if (leaf) {
+                void *value = fn ? fn(key, untagged(VALUE(leaf)), ctx) : ctx;
+                leaf->as.kv.value = tagged(value);
+                return leaf;
+            }
+            if (!overflow) {
+                void *value = fn ? fn(key, NULL, ctx) : ctx;
+                inserted = bucket_insert(h, anchor, hash, key, value);
+                break;
+            }
+            anchor = overflow;
+            CORE_FN(hash_advance)(hash);
+            continue;
+        }
+        uint32_t expected_index = hash_get_index(hash);
+        if (!has_index(anchor, expected_index)) {
+            /* no shared table to unshare here, see search() */
+            void *value = fn ? fn(key, NULL, ctx) : ctx;
+            inserted = insert_kv(h, anchor, hash, key, value);
+            break;
+        }
+        table_unshare(h, anchor);
+        struct hamt_node *next =
+            &TABLE(anchor)[row_pos(anchor, expected_index)];
+        if (is_value(VALUE(next))) {
+            if (leaf_may_match(next, hash) &&
+                CORE_KEY_EQ(h->key_cmp, key, KEY(next))) {
+                void *value = fn ? fn(key, untagged(VALUE(next)), ctx) : ctx;
+                next->as.kv.value = tagged(value);
+                return next;
+            }
+            void *value = fn ? fn(key, NULL, ctx) : ctx;
+            inserted = CORE_FN(insert_table)(h, anchor, hash, key, value);
+            break;
+        }
+        anchor = next;
+        CORE_FN(hash_advance)(hash);
+    }
+    if (inserted != NULL) {
+        h->size += 1;
+    }
+    return inserted;
+}
+
+static inline const struct hamt_node *CORE_FN(set)(struct hamt *h,
+                                                   struct hamt_node *root,
+                                                   void *key, void *value)
+{
+    return CORE_FN(upsert)(h, root, key, NULL, value);
+}
+
+/*
+ * Remove `key` from the subtrie at `anchor`, path-copying shared tables on
+ * the way down.
+ *
+ * Removing a leaf from a table with two rows where the remaining row is a
+ * leaf as well gathers the table, i.e. replaces it with the remaining leaf.
+ * The gathered leaf then moves up through all single-row tables above it
+ * (except for the root table). Instead of recording the path, the descent
+ * keeps track of where the current run of single-row tables starts.
+ * Removing a key that is not in the trie copies no tables.
+ */
+static struct remove_result
+CORE_FN(rem)(struct hamt *h, struct hamt_node *root, struct hamt_node *anchor,
+             struct hash_state *hash, hamt_key_cmp_fn cmp_eq, const void *key)
+{
+    (void)cmp_eq;
+    /* topmost anchor of the run of single-row tables above `anchor` */
+    struct hamt_node *run = NULL;
+    /* the tables holding `anchor` and `run`, and the indices of their rows
+     * (a gathered leaf may have to move, see row_to_leaf()) */
+    struct hamt_node *parent = NULL, *run_parent = NULL;
+    uint32_t parent_ix = 0, run_ix = 0;
+    bool found = false;
+    for (;;) {
+        assert(!is_value(VALUE(anchor)) &&
+               "Invariant: removal requires an internal node");
+        /* only path-copy once the key is known to be there: probe the rest
+         * of the path before the first shared table */
+        if (!found && TABLE(anchor) && table_refcount(TABLE(anchor)) > 1) {
+            struct hash_state probe = *hash;
+            if (!CORE_FN(lookup)(anchor, &probe, cmp_eq, key))
+                break;
+            found = true;
+        }
+        /* make sure we own the table we're about to modify */
+        struct hamt_node *copy = table_unshare(h, anchor);
+        uint32_t n_rows = get_popcount(INDEX(copy));
+        uint32_t expected_index;
+        struct hamt_node *next;
+        bool in_bucket = hash_in_bucket(hash);
+        if (in_bucket) {
+            /* continue with the overflow bucket unless the key is here */
+            struct hamt_node *overflow;
+            next = CORE_FN(bucket_scan)(copy, cmp_eq, key, &overflow);
+            if (!next && !(next = overflow))
+                break;
+            /* clearing the top bit keeps the bitmap contiguous */
+            expected_index = n_rows - 1;
+        } else {
+            /* determine the expected index in table */
+            expected_index = hash_get_index(hash);
+            if (!has_index(copy, expected_index))
+                break;
+            /* index into the table */
+            next = &TABLE(copy)[row_pos(copy, expected_index)];
+        }
+        int pos = next - TABLE(copy);
+        if (!is_value(VALUE(next))) {
+            /* for table entries, continue on the next level */
+            assert(TABLE(next) != NULL &&
+                   "invariant: table ptrs must not be NULL");
+            if (n_rows != 1 || copy == root) {
+                run = NULL;
+            } else if (!run) {
+                run = copy;
+                run_parent = parent;
+                run_ix = parent_ix;
+            }
+            parent = copy;
+            parent_ix = expected_index;
+            anchor = next;
+            CORE_FN(hash_advance)(hash);
+            continue;
+        }
+        if (!in_bucket && (!leaf_may_match(next, hash) ||
+                           !CORE_KEY_EQ(cmp_eq, key, KEY(next)))) {
+            /* not found: same hash but different key */
+            break;
+        }
+        void *value = VALUE(next);
+        /* We shrink tables while they have more than 2 rows and switch
+         * to gathering the subtrie otherwise. The exception is when we
+         * are at the root, where we must shrink the table to one or
+         * zero.
+         */
+        if (n_rows > 2 || (n_rows >= 1 && root == copy)) {
+            // FIXME: this sets copy to NULL when n_rows == 1
+            // i.e. when we remove the last entry from the trie
+            copy = table_shrink(h, copy, n_rows, expected_index, pos);
+#if defined(WITH_CHAMP_LAYOUT)
+            /* an overflow row moves down along with the top bit */
+            if (in_bucket && copy)
+                NODEMAP(copy) >>= 1;
+#endif
+        } else if (n_rows == 2) {
+            /* if both rows are value rows, gather, dropping the current
+             * row */
+            struct hamt_node *other = &TABLE(copy)[!pos];
+            if (is_value(VALUE(other))) {
+                copy = table_gather(h, copy, !pos);
+                if (run) {
+                    /* move the leaf up, dropping the single-row tables */
+                    struct hamt_node *table = TABLE(run);
+                    *run = *copy;
+                    while (table) {
+                        struct hamt_node *below =
+                            &table[0] == copy ? NULL : table[0].as.table.ptr;
+                        table_free(h, table, 1);
+                        table = below;
+                    }
+                    row_to_leaf(run_parent, run_ix);
+                } else {
+                    row_to_leaf(parent, parent_ix);
+                }
+                return (struct remove_result){.status = REMOVE_GATHERED,
+                                              .value = value};
+            } else {
+                /* otherwise shrink the node to n_rows == 1 */
+                copy = table_shrink(h, copy, n_rows, expected_index, pos);
+#if defined(WITH_CHAMP_LAYOUT)
+                if (in_bucket && copy)
+                    NODEMAP(copy) >>= 1;
+#endif
+            }
+        }
+        return (struct remove_result){.status = REMOVE_SUCCESS,
+                                      .value = value};
+    }
+    return (struct remove_result){.status = REMOVE_NOTFOUND, .value = NULL};
+}
+
+#undef CORE_FN
+#undef CORE_HASH
+#undef CORE_KEY_EQ
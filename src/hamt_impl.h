@@ -0,0 +1,401 @@
+#ifndef HAMT_IMPL_H
+#define HAMT_IMPL_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hamt.h"
+#include "internal_types.h"
+
+/*
+ * Trie representation and the building blocks of the core search and
+ * modification functions (see hamt_core.h). These are shared between the
+ * library and the specialized instances of hamt_define.h, hence all
+ * definitions depend on the same build flags (WITH_TABLE_CACHE,
+ * WITH_LEAF_HASHES, WITH_CHAMP_LAYOUT, ...) as the library.
+ */
+
+/* Pointer tagging */
+#define HAMT_TAG_MASK 0x3 /* last two bits */
+#define HAMT_TAG_VALUE 0x1
+#define tagged(__p) (struct hamt_node *)((uintptr_t)__p | HAMT_TAG_VALUE)
+#define untagged(__p) (struct hamt_node *)((uintptr_t)__p & ~HAMT_TAG_MASK)
+#define is_value(__p) (((uintptr_t)__p & HAMT_TAG_MASK) == HAMT_TAG_VALUE)
+
+struct hamt {
+    struct hamt_node *root; /* root_slots() anchors */
+    size_t root_levels;
+    size_t size;
+    hamt_key_hash_fn key_hash;
+    hamt_key_hash64_fn key_hash64; /* replaces key_hash if set */
+    hamt_key_cmp_fn key_cmp;
+    struct hamt_allocator *ator;
+#if defined(WITH_TABLE_CACHE)
+    struct hamt_table_cache *cache;
+#endif
+    struct hamt_arena *arena;   /* private table arena, or NULL */
+    struct epoch_entry retired; /* deferred release (atoms) */
+};
+
+/* Table cache internals (cache.c) */
+struct hamt_table_cache;
+void table_cache_destroy(struct hamt_table_cache *cache);
+
+/* hashing w/ state management */
+struct hash_state {
+    const void *key;
+    hamt_key_hash_fn hash_fn;
+    hamt_key_hash64_fn hash64_fn;
+    uint64_t hash;
+    size_t depth;
+    size_t shift;
+};
+
+/* Search results */
+typedef enum {
+    SEARCH_SUCCESS,
+    SEARCH_FAIL_NOTFOUND,
+    SEARCH_FAIL_KEYMISMATCH
+} search_status;
+
+struct search_result {
+    search_status status;
+    struct hamt_node *anchor;
+    struct hamt_node *value;
+    struct hash_state *hash;
+};
+
+/* Removal results */
+typedef enum { REMOVE_SUCCESS, REMOVE_GATHERED, REMOVE_NOTFOUND } remove_status;
+
+struct remove_result {
+    remove_status status;
+    void *value;
+};
+
+/* Number of trie levels addressed by a single hash: six for 32 bit hashes
+ * (30 bits), twelve for 64 bit hashes (60 bits) */
+static inline size_t hash_levels(const struct hash_state *h)
+{
+    return h->hash64_fn ? 12 : 6;
+}
+
+static inline uint64_t hash_compute(const struct hash_state *h,
+                                    const void *key, size_t gen)
+{
+    return h->hash64_fn ? h->hash64_fn(key, gen) : h->hash_fn(key, gen);
+}
+
+/* Initialize the hash state of `key` at `depth` */
+static inline struct hash_state *hash_init(struct hash_state *h,
+                                           const struct hamt *trie,
+                                           const void *key, size_t depth)
+{
+    h->key = key;
+    h->hash_fn = trie->key_hash;
+    h->hash64_fn = trie->key_hash64;
+    h->depth = depth;
+    h->shift = 5 * (depth % hash_levels(h));
+    h->hash = hash_compute(h, key, depth - depth % hash_levels(h));
+    return h;
+}
+
+static inline struct hash_state *hash_next(struct hash_state *h)
+{
+    h->depth += 1;
+    h->shift += 5;
+    if (h->shift == 5 * hash_levels(h)) {
+        h->hash = hash_compute(h, h->key, h->depth);
+        h->shift = 0;
+    }
+    return h;
+}
+
+static inline uint32_t hash_get_index(const struct hash_state *h)
+{
+    return (h->hash >> h->shift) & 0x1f;
+}
+
+/* Hash of the key in `leaf` for the generation in use at `depth` (where
+ * hash_next() regenerates the hash every hash_levels() levels); `hash` is
+ * any hash state of the trie */
+static inline uint64_t leaf_rehash(const struct hash_state *hash,
+                                   const struct hamt_node *leaf, size_t depth)
+{
+    size_t levels = hash_levels(hash);
+#if defined(WITH_LEAF_HASHES)
+    if (depth < levels)
+        return LEAF_HASH(leaf);
+#endif
+    return hash_compute(hash, KEY(leaf), depth - depth % levels);
+}
+
+/* Cheap pre-check for key equality: with WITH_LEAF_HASHES, leaves store the
+ * generation 0 hash of their key which allows to reject mismatches without
+ * calling the key comparison function (and touching the key). */
+static inline bool leaf_may_match(const struct hamt_node *leaf,
+                                  const struct hash_state *hash)
+{
+#if defined(WITH_LEAF_HASHES)
+    return hash->depth >= hash_levels(hash) || LEAF_HASH(leaf) == hash->hash;
+#else
+    (void)leaf;
+    (void)hash;
+    return true;
+#endif
+}
+
+/* Fill in a leaf; `hash` is the hash state of `key` at the leaf's depth */
+static inline void leaf_init(struct hamt_node *leaf,
+                             const struct hash_state *hash, void *key,
+                             void *value)
+{
+    leaf->as.kv.key = key;
+    leaf->as.kv.value = tagged(value);
+#if defined(WITH_LEAF_HASHES)
+    LEAF_HASH(leaf) = hash->depth < hash_levels(hash)
+                          ? hash->hash
+                          : hash_compute(hash, key, 0);
+#else
+    (void)hash;
+#endif
+}
+
+/*
+ * Wide roots.
+ *
+ * The root of a trie is an array of anchors (slots) that is indexed directly
+ * by the low 5 * root_levels bits of the generation 0 hash, i.e. by the
+ * indices of the top root_levels levels. The tables of the slots sit at
+ * depth root_levels. By default, root_levels is 0 and the root is a single
+ * anchor.
+ */
+static inline size_t root_slots(const struct hamt *trie)
+{
+    return (size_t)1 << (5 * trie->root_levels);
+}
+
+/* The slot of `root` (the root of `trie`) for `hash`, a hash state at depth
+ * 0; moves `hash` on to the depth of the slot's table */
+static inline struct hamt_node *root_slot(const struct hamt *trie,
+                                          struct hamt_node *root,
+                                          struct hash_state *hash)
+{
+    hash->depth = trie->root_levels;
+    hash->shift = 5 * trie->root_levels;
+    return &root[hash->hash & (root_slots(trie) - 1)];
+}
+
+static inline int get_popcount(uint32_t n) { return __builtin_popcount(n); }
+
+static inline int get_pos(uint32_t sparse_index, uint32_t bitmap)
+{
+    return get_popcount(bitmap & ((UINT32_C(1) << sparse_index) - 1));
+}
+
+static inline bool has_index(const struct hamt_node *anchor, size_t index)
+{
+    assert(anchor && "anchor must not be NULL");
+    assert(index < 32 && "index must not be larger than 31");
+    return INDEX(anchor) & (UINT32_C(1) << index);
+}
+
+/*
+ * Row layout.
+ *
+ * By default, the rows of a table are ordered by index, with leaves and
+ * subtables interleaved. With WITH_CHAMP_LAYOUT, tables use the CHAMP
+ * encoding instead: the anchor also keeps a node map of the indices that
+ * hold subtables, and the leaves (ordered by index) precede the subtables
+ * (ordered by index). Scans over the leaves of a table then run over one
+ * contiguous block without looking at the tags. The bitmap of a bucket
+ * covers its rows in order, so the overflow row is the only subtable and
+ * comes last in either layout.
+ */
+
+/* Position of index `ix` in a CHAMP table with bitmap `index` and node map
+ * `nodemap` (for an index that is not set, the position of a new leaf) */
+static inline int champ_pos(uint32_t index, uint32_t nodemap, uint32_t ix)
+{
+    uint32_t datamap = index & ~nodemap;
+    if (nodemap & (UINT32_C(1) << ix))
+        return get_popcount(datamap) + get_pos(ix, nodemap);
+    return get_pos(ix, datamap);
+}
+
+/* Position of the row with index `ix`; for an index that is not set, the
+ * position a new leaf row would get */
+static inline int row_pos(const struct hamt_node *anchor, uint32_t ix)
+{
+#if defined(WITH_CHAMP_LAYOUT)
+    return champ_pos(INDEX(anchor), NODEMAP(anchor), ix);
+#else
+    return get_pos(ix, INDEX(anchor));
+#endif
+}
+
+/* Position of the row with the `rank`-th smallest index */
+static inline int row_pos_ranked(const struct hamt_node *anchor, int rank)
+{
+#if defined(WITH_CHAMP_LAYOUT)
+    uint32_t bits = INDEX(anchor);
+    for (; rank > 0; --rank)
+        bits &= bits - 1;
+    return row_pos(anchor, __builtin_ctz(bits));
+#else
+    (void)anchor;
+    return rank;
+#endif
+}
+
+/* Number of leading leaf rows, i.e. rows known to be leaves */
+static inline int row_leaves(const struct hamt_node *anchor)
+{
+#if defined(WITH_CHAMP_LAYOUT)
+    return get_popcount(INDEX(anchor) & ~NODEMAP(anchor));
+#else
+    (void)anchor;
+    return 0;
+#endif
+}
+
+/* Point `anchor` to `table` with bitmap `index`, where the rows in
+ * `nodemap` are subtables */
+static inline void anchor_init(struct hamt_node *anchor,
+                               struct hamt_node *table, uint32_t index,
+                               uint32_t nodemap)
+{
+    anchor->as.table.ptr = table;
+    anchor->as.table.index = index;
+#if defined(WITH_CHAMP_LAYOUT)
+    NODEMAP(anchor) = nodemap;
+#else
+    (void)nodemap;
+#endif
+}
+
+/*
+ * Prepare the leaf row with index `ix` to become a subtable, or the subtable
+ * row `ix` to become a leaf: moves the row to its new position (the table
+ * must be exclusively owned) and returns it. The caller then overwrites the
+ * row accordingly.
+ */
+static inline struct hamt_node *row_to_table(struct hamt_node *anchor,
+                                             uint32_t ix)
+{
+    struct hamt_node *table = TABLE(anchor);
+#if defined(WITH_CHAMP_LAYOUT)
+    int from = row_pos(anchor, ix);
+    NODEMAP(anchor) |= UINT32_C(1) << ix;
+    int to = row_pos(anchor, ix);
+    struct hamt_node row = table[from];
+    memmove(&table[from], &table[from + 1], (to - from) * sizeof *table);
+    table[to] = row;
+    return &table[to];
+#else
+    return &table[row_pos(anchor, ix)];
+#endif
+}
+
+static inline struct hamt_node *row_to_leaf(struct hamt_node *anchor,
+                                            uint32_t ix)
+{
+    struct hamt_node *table = TABLE(anchor);
+#if defined(WITH_CHAMP_LAYOUT)
+    int from = row_pos(anchor, ix);
+    NODEMAP(anchor) &= ~(UINT32_C(1) << ix);
+    int to = row_pos(anchor, ix);
+    struct hamt_node row = table[from];
+    memmove(&table[to + 1], &table[to], (from - to) * sizeof *table);
+    table[to] = row;
+    return &table[to];
+#else
+    return &table[row_pos(anchor, ix)];
+#endif
+}
+
+/*
+ * Collision buckets.
+ *
+ * Keys that collide on all hash bits of the first HAMT_BUCKET_DEPTH levels
+ * end up in tables that are not addressed by hash: the rows of a bucket hold
+ * the colliding leaves in no particular order and its bitmap has the n
+ * lowest bits set. A bucket that is full continues in an overflow bucket in
+ * its last row. This bounds the depth of the trie even for weak (e.g.
+ * ignoring `gen`) or adversarial hash functions.
+ *
+ * Buckets are ordinary tables to everything that walks the trie structurally
+ * (iterators, release, serialization, ...); only functions that follow the
+ * hash need to know about them.
+ */
+#ifndef HAMT_BUCKET_DEPTH
+#define HAMT_BUCKET_DEPTH 12 /* 60 bits of hash */
+#endif
+#define HAMT_BUCKET_SIZE 32
+
+/* Whether the rows at the depth of `hash` are bucket rows */
+static inline bool hash_in_bucket(const struct hash_state *h)
+{
+    return h->depth >= HAMT_BUCKET_DEPTH;
+}
+
+static inline uint32_t bucket_index(size_t n_rows)
+{
+    return n_rows >= 32 ? UINT32_MAX : (UINT32_C(1) << n_rows) - 1;
+}
+
+/*
+ * Number of rows allocated for a table with `n_rows` rows. With
+ * WITH_TABLE_SLACK, tables come in capacity classes of powers of two such
+ * that most extensions and shrinks happen in place; the capacity follows
+ * from the row count and need not be stored.
+ */
+static inline size_t table_capacity(size_t n_rows)
+{
+#if defined(WITH_TABLE_SLACK)
+    return n_rows <= 1 ? n_rows
+                       : (size_t)1 << (32 - __builtin_clz((uint32_t)n_rows - 1));
+#else
+    return n_rows;
+#endif
+}
+
+/* Table management */
+struct hamt_node *table_allocate(const struct hamt *h, size_t size);
+void table_free(const struct hamt *h, struct hamt_node *ptr, size_t n_rows);
+struct hamt_node *table_extend(struct hamt *h, struct hamt_node *anchor,
+                               size_t n_rows, uint32_t index, uint32_t pos);
+struct hamt_node *table_shrink(struct hamt *h, struct hamt_node *anchor,
+                               size_t n_rows, uint32_t index, uint32_t pos);
+struct hamt_node *table_gather(struct hamt *h, struct hamt_node *anchor,
+                               uint32_t pos);
+struct hamt_node *table_dup(const struct hamt *h, struct hamt_node *anchor);
+struct hamt_node *table_unshare(const struct hamt *h, struct hamt_node *anchor);
+struct hamt_node *bucket_insert(struct hamt *h, struct hamt_node *anchor,
+                                const struct hash_state *hash, void *key,
+                                void *value);
+struct hamt *hamt_copy_shallow(const struct hamt *h);
+
+static inline const struct hamt_node *insert_kv(struct hamt *h,
+                                                struct hamt_node *anchor,
+                                                struct hash_state *hash,
+                                                void *key, void *value)
+{
+    /* calculate position in new table */
+    uint32_t ix = hash_get_index(hash);
+    int pos = row_pos(anchor, ix);
+    /* extend table */
+    size_t n_rows = get_popcount(INDEX(anchor));
+    anchor = table_extend(h, anchor, n_rows, ix, pos);
+    if (!anchor)
+        return NULL;
+    struct hamt_node *new_table = TABLE(anchor);
+    /* set new k/v pair */
+    leaf_init(&new_table[pos], hash, key, value);
+    /* return a pointer to the inserted k/v pair */
+    return &new_table[pos];
+}
+#endif
@@ -1,25 +1,73 @@
 #ifndef HAMT_TYPES_INTERNAL_H
 #define HAMT_TYPES_INTERNAL_H
 
+#include <stdatomic.h>
 #include <stdint.h>
 
+#include "epoch.h"
+
 /* HAMT node structure */
 
 #define TABLE(a) a->as.table.ptr
 #define INDEX(a) a->as.table.index
+#if defined(WITH_CHAMP_LAYOUT)
+#define NODEMAP(a) a->as.table.nodemap
+#endif
 #define VALUE(a) a->as.kv.value
 #define KEY(a) a->as.kv.key
+#if defined(WITH_LEAF_HASHES)
+#define LEAF_HASH(a) a->as.kv.hash
+#endif
+
+/* Every table is preceded by a header row holding table meta data */
+#define HEADER(t) (&(t)[-1])
+#define REFCOUNT(t) HEADER(t)->as.header.refcount
+
+/* Concurrent maps keep the bitmap of a table in its header and refer to
+ * subtables through indirection nodes */
+#define CMAP_INDEX(t) HEADER(t)->as.header.index
+#define INODE(a) a->as.inode.ptr
+
+/* Key sets keep the bitmap and the node map of a table in its header, and
+ * their rows are bare pointers to keys and subtables */
+#define SET_INDEX(t) HEADER(t)->as.header.index
+#define SET_NODEMAP(t) HEADER(t)->as.header.nodemap
+#define SET_ROWS(t) ((void **)(t))
+
+struct hamt_node;
+
+/* Indirection node: the only mutable part of a concurrent map */
+struct hamt_inode {
+    _Atomic(struct hamt_node *) table;
+};
 
 struct hamt_node {
     union {
         struct {
             void *value; /* tagged pointer */
             void *key;
+#if defined(WITH_LEAF_HASHES)
+            uint64_t hash; /* generation 0 hash of key */
+#endif
         } kv;
         struct {
             struct hamt_node *ptr;
             uint32_t index;
+#if defined(WITH_CHAMP_LAYOUT)
+            uint32_t nodemap; /* subtable rows, see row_pos() */
+#endif
         } table;
+        struct {
+            struct hamt_inode *ptr;
+        } inode;
+        struct {
+            uint32_t refcount; /* number of anchors referring to the table */
+            uint32_t index;    /* bitmap (concurrent maps and sets only) */
+            union {
+                struct epoch_entry retired; /* reclamation (concurrent maps) */
+                uint32_t nodemap;           /* subtable rows (sets) */
+            };
+        } header;
     } as;
 };
 #endif
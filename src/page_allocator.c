@@ -0,0 +1,155 @@
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_HUGETLB, syscall() */
+#endif
+#include "page_allocator.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* mbind(2) policy, see <numaif.h> (not available without libnuma) */
+#define PAGE_MPOL_PREFERRED 1
+
+struct page_allocator {
+    struct hamt_allocator ator; /* first member, see hamt_page_allocator_* */
+    size_t page_size;           /* allocation granularity */
+    size_t huge_page_size;
+    bool transparent;
+    bool numa_bind;
+    int numa_node;
+};
+
+static size_t page_round(const struct page_allocator *pa, size_t size)
+{
+    return (size + pa->page_size - 1) / pa->page_size * pa->page_size;
+}
+
+/* Map `len` bytes aligned to `align` such that THP can back all of them */
+static void *page_map_aligned(size_t len, size_t align)
+{
+    size_t extra = align > 1 ? align : 0;
+    char *p = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (!extra)
+        return p;
+    uintptr_t mask = (uintptr_t)align - 1;
+    char *start = (char *)(((uintptr_t)p + mask) & ~mask);
+    if (start > p)
+        munmap(p, start - p);
+    if (p + extra > start)
+        munmap(start + len, (size_t)(p + extra - start));
+    return start;
+}
+
+static void *page_map_hugetlb(const struct page_allocator *pa, size_t len)
+{
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    int log2_size = 0;
+    while (((size_t)1 << log2_size) < pa->huge_page_size)
+        ++log2_size;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                       (log2_size << MAP_HUGE_SHIFT),
+                   -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    (void)pa;
+    (void)len;
+    return NULL;
+#endif
+}
+
+static void page_bind(const struct page_allocator *pa, void *p, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask = 1ul << pa->numa_node;
+    /* best effort: the pages are still usable if the node does not exist */
+    syscall(SYS_mbind, p, len, PAGE_MPOL_PREFERRED, &mask,
+            8 * sizeof mask, 0);
+#else
+    (void)pa;
+    (void)p;
+    (void)len;
+#endif
+}
+
+static void *page_malloc(const ptrdiff_t size, void *ctx)
+{
+    struct page_allocator *pa = ctx;
+    size_t len = page_round(pa, size);
+    void *p = NULL;
+    /* fall back to transparent huge pages if the hugetlb pool is empty */
+    if (pa->huge_page_size && !pa->transparent)
+        p = page_map_hugetlb(pa, len);
+    if (!p) {
+        p = page_map_aligned(len, pa->huge_page_size);
+        if (!p)
+            return NULL;
+#if defined(MADV_HUGEPAGE)
+        if (pa->huge_page_size)
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+    /* bind before the first touch places the pages */
+    if (pa->numa_bind)
+        page_bind(pa, p, len);
+    return p;
+}
+
+static void page_free(void *ptr, const ptrdiff_t size, void *ctx)
+{
+    struct page_allocator *pa = ctx;
+    if (ptr)
+        munmap(ptr, page_round(pa, size));
+}
+
+static void *page_realloc(void *ptr, const ptrdiff_t old_size,
+                          const ptrdiff_t new_size, void *ctx)
+{
+    struct page_allocator *pa = ctx;
+    if (ptr && page_round(pa, old_size) == page_round(pa, new_size))
+        return ptr;
+    void *p = page_malloc(new_size, ctx);
+    if (p && ptr) {
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        page_free(ptr, old_size, ctx);
+    }
+    return p;
+}
+
+struct hamt_allocator *
+hamt_page_allocator_create(const struct hamt_page_allocator_config *cfg)
+{
+    if (cfg->huge_page_size & (cfg->huge_page_size - 1))
+        return NULL; /* not a power of two */
+    if (cfg->numa_bind &&
+        (cfg->numa_node < 0 || cfg->numa_node >= 8 * (int)sizeof(long)))
+        return NULL;
+    struct page_allocator *pa = malloc(sizeof *pa);
+    if (!pa)
+        return NULL;
+    size_t base = (size_t)sysconf(_SC_PAGESIZE);
+    *pa = (struct page_allocator){
+        .ator = {page_malloc, page_realloc, page_free, pa},
+        .page_size =
+            cfg->huge_page_size > base ? cfg->huge_page_size : base,
+        .huge_page_size = cfg->huge_page_size > base ? cfg->huge_page_size
+                                                     : 0,
+        .transparent = cfg->transparent,
+        .numa_bind = cfg->numa_bind,
+        .numa_node = cfg->numa_node};
+    return &pa->ator;
+}
+
+/* All allocations must have been freed */
+void hamt_page_allocator_delete(struct hamt_allocator *ator)
+{
+    free(ator->ctx);
+}
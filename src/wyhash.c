@@ -0,0 +1,91 @@
+#include "wyhash.h"
+
+#include <string.h>
+
+/*
+ * 64 bit hash in the style of wyhash (Wang Yi, public domain): the input is
+ * consumed 16 bytes at a time through 64x64->128 bit multiplications; long
+ * keys are processed in three independent lanes of 16 bytes each, which
+ * keeps the multipliers busy in parallel.
+ */
+static const uint64_t wyp[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+                                0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+__extension__ typedef unsigned __int128 wy_u128;
+
+/* 128 bit product of a and b; low half in a, high half in b */
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+    wy_u128 r = (wy_u128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/* 1 to 3 bytes */
+static inline uint64_t wyr3(const uint8_t *p, size_t k)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t wyhash64(const void *key, size_t len, uint64_t seed)
+{
+    const uint8_t *p = key;
+    uint64_t a, b;
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t k = (len >> 3) << 2;
+            a = (wyr4(p) << 32) | wyr4(p + k);
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - k);
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                seed1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ seed1);
+                seed2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
@@ -0,0 +1,350 @@
+/*
+ * Benchmark suite; see `make bench`.
+ *
+ *   bench_hamt [n ...]
+ *
+ * For every trie size n, measures ephemeral insert, get (hits and misses),
+ * full iteration, persistent insert and remove, and ephemeral removal on
+ * string keys. Keys and access orders derive from a fixed seed, so runs are
+ * comparable. Reports throughput, latency percentiles of individually timed
+ * operations, the bytes allocated per entry and the peak RSS of the process.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "hamt.h"
+#include "murmur3.h"
+#if defined(WITH_TABLE_CACHE)
+#include "cache.h"
+#endif
+
+#define BENCH_SEED 0x9e3779b97f4a7c15ull
+#define BENCH_KEY_SIZE 16       /* fixed-width keys, incl. terminator */
+#define BENCH_SAMPLES 100000    /* max. timed operations per benchmark */
+#define BENCH_OPS_MAX 1000000   /* max. misses and persistent operations */
+
+/* Allocator that counts the bytes it hands out */
+struct bench_heap {
+    ptrdiff_t live;
+    ptrdiff_t peak;
+};
+
+static void *bench_malloc(const ptrdiff_t size, void *ctx)
+{
+    struct bench_heap *heap = ctx;
+    heap->live += size;
+    if (heap->live > heap->peak)
+        heap->peak = heap->live;
+    return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, const ptrdiff_t old_size,
+                           const ptrdiff_t new_size, void *ctx)
+{
+    struct bench_heap *heap = ctx;
+    heap->live += new_size - old_size;
+    if (heap->live > heap->peak)
+        heap->peak = heap->live;
+    return realloc(ptr, new_size);
+}
+
+static void bench_free(void *ptr, const ptrdiff_t size, void *ctx)
+{
+    struct bench_heap *heap = ctx;
+    heap->live -= size;
+    free(ptr);
+}
+
+static uint32_t bench_key_hash(const void *key, const size_t gen)
+{
+    return murmur3_32((const uint8_t *)key, BENCH_KEY_SIZE - 1, gen);
+}
+
+static int bench_key_cmp(const void *lhs, const void *rhs)
+{
+    return memcmp(lhs, rhs, BENCH_KEY_SIZE - 1);
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Cost of reading the clock, subtracted from the timed operations */
+static uint64_t timer_overhead(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (size_t i = 0; i < 10000; ++i) {
+        uint64_t t0 = now_ns();
+        uint64_t t1 = now_ns();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    return best;
+}
+
+static size_t peak_rss_kib(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss / 1024; /* bytes */
+#else
+    return (size_t)usage.ru_maxrss; /* KiB */
+#endif
+}
+
+struct bench {
+    struct hamt *trie;
+    const struct hamt *version; /* head of the persistent chain */
+    char *keys;                 /* n keys, BENCH_KEY_SIZE bytes each */
+    char *misses;               /* n_misses keys that are not in the trie */
+    uint32_t *order;            /* random permutation of 0..n-1 */
+    size_t n;
+    size_t n_misses;
+    uint64_t overhead;
+    uint64_t *samples;
+};
+
+#define BENCH_KEY(b, i) ((b)->keys + (size_t)(i) * BENCH_KEY_SIZE)
+#define BENCH_MISS(b, i) ((b)->misses + (size_t)(i) * BENCH_KEY_SIZE)
+
+/* Prevents the compiler from dropping the queries */
+static const void *volatile bench_sink;
+
+typedef void (*bench_op_fn)(struct bench *b, size_t i);
+
+static void op_insert(struct bench *b, size_t i)
+{
+    char *key = BENCH_KEY(b, i);
+    hamt_set(b->trie, key, key);
+}
+
+static void op_get_hit(struct bench *b, size_t i)
+{
+    bench_sink = hamt_get(b->trie, BENCH_KEY(b, b->order[i]));
+}
+
+static void op_get_miss(struct bench *b, size_t i)
+{
+    bench_sink = hamt_get(b->trie, BENCH_MISS(b, i));
+}
+
+static void op_pset(struct bench *b, size_t i)
+{
+    char *key = BENCH_KEY(b, b->order[i]);
+    const struct hamt *next = hamt_pset(b->version, key, key);
+    if (b->version != b->trie)
+        hamt_release(b->version);
+    b->version = next;
+}
+
+static void op_premove(struct bench *b, size_t i)
+{
+    const struct hamt *next =
+        hamt_premove(b->version, BENCH_KEY(b, b->order[i]));
+    if (b->version != b->trie)
+        hamt_release(b->version);
+    b->version = next;
+}
+
+static void op_remove(struct bench *b, size_t i)
+{
+    bench_sink = hamt_remove(b->trie, BENCH_KEY(b, b->order[i]));
+}
+
+static int cmp_u64(const void *lhs, const void *rhs)
+{
+    uint64_t l = *(const uint64_t *)lhs, r = *(const uint64_t *)rhs;
+    return (l > r) - (l < r);
+}
+
+static void report(struct bench *b, const char *name, size_t n_ops,
+                   uint64_t elapsed, size_t n_samples)
+{
+    printf("%12zu %-10s %9.2f", b->n, name,
+           elapsed ? n_ops * 1e3 / elapsed : 0.0);
+    if (n_samples == 0) {
+        printf(" %9s %9s %9s\n", "-", "-", "-");
+        return;
+    }
+    qsort(b->samples, n_samples, sizeof *b->samples, cmp_u64);
+    const double q[] = {0.5, 0.99, 0.999};
+    for (size_t k = 0; k < 3; ++k)
+        printf(" %9" PRIu64, b->samples[(size_t)(q[k] * (n_samples - 1))]);
+    printf("\n");
+}
+
+/*
+ * Run `op` for i in [0, n_ops), timing every stride-th call individually.
+ * Throughput is corrected for the cost of reading the clock.
+ */
+static void run(struct bench *b, const char *name, bench_op_fn op,
+                size_t n_ops)
+{
+    size_t stride = (n_ops + BENCH_SAMPLES - 1) / BENCH_SAMPLES;
+    size_t n_samples = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_ops; ++i) {
+        if (i % stride == 0) {
+            uint64_t t0 = now_ns();
+            op(b, i);
+            uint64_t t = now_ns() - t0;
+            b->samples[n_samples++] = t > b->overhead ? t - b->overhead : 0;
+        } else {
+            op(b, i);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t correction = n_samples * b->overhead;
+    elapsed = elapsed > correction ? elapsed - correction : 1;
+    report(b, name, n_ops, elapsed, n_samples);
+}
+
+static void run_iterate(struct bench *b)
+{
+    struct hamt_iterator it;
+    size_t count = 0;
+    uint64_t start = now_ns();
+    for (hamt_it_init(&it, b->trie); hamt_it_valid(&it); hamt_it_next(&it)) {
+        bench_sink = hamt_it_get_value(&it);
+        ++count;
+    }
+    uint64_t elapsed = now_ns() - start;
+    hamt_it_fini(&it);
+    report(b, "iterate", count, elapsed, 0);
+}
+
+static void make_key(char *dst, uint64_t i)
+{
+    /* mix64() is a bijection; truncation to 60 bits makes collisions
+     * among 1e8 keys unlikely and harmless for timing */
+    snprintf(dst, BENCH_KEY_SIZE, "%015" PRIx64,
+             (uint64_t)(mix64(i ^ BENCH_SEED) & 0xfffffffffffffffull));
+}
+
+static int bench_size(size_t n, uint64_t overhead)
+{
+    struct bench_heap heap = {0};
+    struct hamt_allocator ator = {bench_malloc, bench_realloc, bench_free,
+                                  &heap};
+    struct bench b = {.n = n,
+                      .n_misses = n < BENCH_OPS_MAX ? n : BENCH_OPS_MAX,
+                      .overhead = overhead};
+    b.keys = malloc(n * BENCH_KEY_SIZE);
+    b.misses = malloc(b.n_misses * BENCH_KEY_SIZE);
+    b.order = malloc(n * sizeof *b.order);
+    b.samples = malloc(BENCH_SAMPLES * sizeof *b.samples);
+    if (!b.keys || !b.misses || !b.order || !b.samples) {
+        fprintf(stderr, "bench_hamt: out of memory for n=%zu\n", n);
+        free(b.keys);
+        free(b.misses);
+        free(b.order);
+        free(b.samples);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        make_key(BENCH_KEY(&b, i), i);
+        b.order[i] = (uint32_t)i;
+    }
+    for (size_t i = 0; i < b.n_misses; ++i)
+        make_key(BENCH_MISS(&b, i), (uint64_t)n + i);
+    for (size_t i = n; i > 1; --i) {
+        size_t j = mix64(BENCH_SEED + i) % i;
+        uint32_t tmp = b.order[i - 1];
+        b.order[i - 1] = b.order[j];
+        b.order[j] = tmp;
+    }
+
+    struct hamt_config cfg = {.ator = &ator,
+                              .key_cmp_fn = bench_key_cmp,
+                              .key_hash_fn = bench_key_hash};
+#if defined(WITH_TABLE_CACHE)
+    /* An adaptive cache such that the heap figures reflect what the trie
+     * needs rather than the default reserve */
+    struct hamt_table_cache_config tc_cfg = {
+        .bucket_count = HAMT_TABLE_CACHE_MAX_POOLS,
+        .initial_bucket_sizes = NULL,
+        .backing_allocator = &ator,
+        .adaptive = true};
+    cfg.cache = hamt_table_cache_create(&tc_cfg);
+#endif
+    b.trie = hamt_create(&cfg);
+
+    size_t n_persistent = b.n_misses;
+    run(&b, "insert", op_insert, n);
+    ptrdiff_t live = heap.live;
+    run(&b, "get-hit", op_get_hit, n);
+    run(&b, "get-miss", op_get_miss, b.n_misses);
+    run_iterate(&b);
+    b.version = b.trie;
+    run(&b, "pset", op_pset, n_persistent);
+    if (b.version != b.trie)
+        hamt_release(b.version);
+    b.version = b.trie;
+    run(&b, "premove", op_premove, n_persistent);
+    if (b.version != b.trie)
+        hamt_release(b.version);
+    run(&b, "remove", op_remove, n);
+    printf("%12zu %-10s %9.1f B/entry, peak %.1f MiB heap, %.1f MiB RSS\n",
+           n, "memory", (double)live / n, heap.peak / 1048576.0,
+           peak_rss_kib() / 1024.0);
+
+    hamt_delete(b.trie);
+#if defined(WITH_TABLE_CACHE)
+    hamt_table_cache_delete(cfg.cache);
+#endif
+    free(b.keys);
+    free(b.misses);
+    free(b.order);
+    free(b.samples);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t default_sizes[] = {1000, 10000, 100000, 1000000};
+    uint64_t overhead = timer_overhead();
+#if defined(WITH_TABLE_CACHE)
+    const char *variant = "with table cache";
+#else
+    const char *variant = "without table cache";
+#endif
+    printf("# hamt benchmark %s, %d byte keys, timer overhead %" PRIu64
+           " ns\n",
+           variant, BENCH_KEY_SIZE - 1, overhead);
+    printf("# %10s %-10s %9s %9s %9s %9s\n", "n", "op", "Mops/s", "p50/ns",
+           "p99/ns", "p999/ns");
+    if (argc < 2) {
+        for (size_t i = 0; i < sizeof default_sizes / sizeof(size_t); ++i)
+            if (bench_size(default_sizes[i], overhead) != 0)
+                return 1;
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i) {
+        char *end;
+        unsigned long long n = strtoull(argv[i], &end, 10);
+        if (*end != '\0' || n == 0 || n > UINT32_MAX) {
+            fprintf(stderr, "bench_hamt: invalid size '%s'\n", argv[i]);
+            return 1;
+        }
+        if (bench_size((size_t)n, overhead) != 0)
+            return 1;
+    }
+    return 0;
+}
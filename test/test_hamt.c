@@ -1,6 +1,10 @@
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for page_allocator.c, included below */
+#endif
 #include "hamt.h"
 #include "minunit.h"
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,10 +13,14 @@
 #include "uh.h"
 #include "utils.h"
 #include "words.h"
+#include "wyhash.h"
 
 #include "../src/cache.c"
+#include "../src/epoch.c"
 #include "../src/hamt.c"
 #include "../src/murmur3.c"
+#include "../src/page_allocator.c"
+#include "../src/wyhash.c"
 
 void **shuffle_ptr_array(ptrdiff_t size, void *array[size])
 {
@@ -47,7 +55,7 @@ static void debug_print_string(size_t ix, const struct hamt_node *node,
         printf("%*s \\- [ ix=%2lu sz=%2d p=%p: ", (int)depth * 2, "", ix, n,
                (void *)node);
         for (size_t i = 0; i < 32; ++i) {
-            if (node->as.table.index & (1 << i)) {
+            if (node->as.table.index & (UINT32_C(1) << i)) {
                 printf("%2lu(%2i) ", i, get_pos(i, node->as.table.index));
             }
         }
@@ -145,34 +153,55 @@ static uint32_t my_keyhash_string(const void *key, const size_t gen)
     return hash;
 }
 
+/* generation 0 maps all keys to the same hash, forcing hash regeneration */
+static uint32_t my_keyhash_string_gen0_collision(const void *key,
+                                                 const size_t gen)
+{
+    return gen == 0 ? 0 : my_keyhash_string(key, gen);
+}
+
 static uint32_t my_keyhash_universal(const void *key, const size_t gen)
 {
     return sedgewick_universal_hash((const char *)key, 0x8fffffff - (gen << 8));
 }
 
+static uint64_t my_keyhash64_string(const void *key, const size_t gen)
+{
+    return wyhash64(key, strlen((const char *)key), gen);
+}
+
+/* the first two 64 bit hash generations collide: keys end up in buckets */
+static uint64_t my_keyhash64_string_deep_collision(const void *key,
+                                                   const size_t gen)
+{
+    return gen < 24 ? 0 : my_keyhash64_string(key, gen);
+}
+
 #ifdef WITH_TABLE_CACHE
 #ifdef WITH_TABLE_CACHE_STATS
 static void print_allocation_stats(struct hamt *t)
 {
+    struct hamt_table_cache_stats stats;
+    hamt_table_cache_stats(t->cache, &stats);
     ptrdiff_t total_size = 0;
     ptrdiff_t total_allocated_items = 0;
-    for (size_t l = 0; l < 32; ++l) {
-        total_size += t->cache->pools[l].size;
-        total_allocated_items += t->cache->pools[l].size * l;
+    for (size_t l = 0; l < stats.pool_count; ++l) {
+        total_size += stats.pools[l].peak;
+        /* pool l serves tables with l + 1 rows (plus one header row) */
+        total_allocated_items += stats.pools[l].peak * (l + 1);
     }
     printf("    Alloc overhead ratio: %f\n",
            total_allocated_items / (float)t->size);
     printf("    Pool allocator statistics:\n");
     printf("       tsize    psize    psize%%   allocs    frees    fill%%  \n");
     printf("      ------- --------- -------- -------- --------- -------\n");
-    for (size_t l = 0; l < 32; ++l) {
+    for (size_t l = 0; l < stats.pool_count; ++l) {
         printf("      %6lu  %8lu  %5.2f%%  %7lu  %9lu  %4.2f%% \n", l + 1,
-               t->cache->pools[l].size,
-               100 * t->cache->pools[l].size / (float)total_size,
-               t->cache->pools[l].stats.alloc_count,
-               t->cache->pools[l].stats.free_count,
-               100 * (1.0 - (t->cache->pools[l].stats.free_count /
-                             (float)t->cache->pools[l].stats.alloc_count)));
+               stats.pools[l].peak,
+               100 * stats.pools[l].peak / (float)total_size,
+               stats.pools[l].alloc_count, stats.pools[l].free_count,
+               100 * (1.0 - (stats.pools[l].free_count /
+                             (float)stats.pools[l].alloc_count)));
     }
 }
 #endif
@@ -217,10 +246,10 @@ MU_TEST_CASE(cache_test_create_delete)
 
     MU_ASSERT(cache->backing_allocator == &hamt_allocator_default,
               "backing allocator should point to default allocator");
-    for (ptrdiff_t i = 0; i < 32; ++i) {
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
         MU_ASSERT(cache->pools[i].size == 0,
                   "initial number of allocations should be zero");
-        MU_ASSERT(cache->pools[i].table_size == i + 1, "wrong table size");
+        MU_ASSERT(cache->pools[i].table_size == i + 2, "wrong table size");
         MU_ASSERT(cache->pools[i].buf_ix == 0,
                   "high water mark should start at zero");
         MU_ASSERT(cache->pools[i].chunk != NULL, "chunk should not be NULL");
@@ -228,7 +257,7 @@ MU_TEST_CASE(cache_test_create_delete)
         MU_ASSERT(cache->pools[i].chunk->next == NULL,
                   "expect a single chunk at init");
         MU_ASSERT(cache->pools[i].chunk->size ==
-                      (i + 1) * hamt_table_cache_default_bucket_sizes[i],
+                      (i + 2) * hamt_table_cache_default_bucket_sizes[i],
                   "initial chunk size should be table size times default "
                   "bucket size");
     }
@@ -245,16 +274,16 @@ MU_TEST_CASE(cache_test_allocator_stride)
         .initial_bucket_sizes = hamt_table_cache_default_bucket_sizes};
     struct hamt_table_cache *cache = hamt_table_cache_create(&cfg);
 
-    for (size_t i = 0; i < 32; ++i) {
-        ptrdiff_t expected_stride = (i + 1) * sizeof(struct hamt_node);
-        char *p = (char *)hamt_table_cache_alloc(cache, i + 1);
-        ptrdiff_t tables_per_chunk = cache->pools[i].chunk->size / (i + 1);
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+        ptrdiff_t expected_stride = (i + 2) * sizeof(struct hamt_node);
+        char *p = (char *)hamt_table_cache_alloc(cache, i + 2);
+        ptrdiff_t tables_per_chunk = cache->pools[i].chunk->size / (i + 2);
         /*
         printf("  table size %lu, expected stride %lu, testing %lu tables\n",
-                i+1, expected_stride, tables_per_chunk);
+                i+2, expected_stride, tables_per_chunk);
         */
         for (ptrdiff_t j = 0; j < tables_per_chunk - 1; ++j) {
-            char *q = (char *)hamt_table_cache_alloc(cache, i + 1);
+            char *q = (char *)hamt_table_cache_alloc(cache, i + 2);
             MU_ASSERT(q - p == expected_stride, "wrong stride");
             p = q;
         }
@@ -277,8 +306,8 @@ MU_TEST_CASE(cache_test_freelist_addressing)
         .bucket_count = hamt_table_cache_config_default_bucket_count,
         .initial_bucket_sizes = bucket_sizes};
 
-    /* note: 1-based loops */
-    for (ptrdiff_t n_rows = 1; n_rows < 33; ++n_rows) {
+    /* note: tables have at least two nodes (the header and a row) */
+    for (ptrdiff_t n_rows = 2; n_rows <= cfg.bucket_count + 1; ++n_rows) {
         for (ptrdiff_t n_chunks = 1; n_chunks < 5; ++n_chunks) {
             /* create a new pool every time for isolated testing */
             struct hamt_table_cache *cache = hamt_table_cache_create(&cfg);
@@ -293,7 +322,7 @@ MU_TEST_CASE(cache_test_freelist_addressing)
 
             ptrdiff_t n_pointers = 0;
             for (ptrdiff_t k = 0; k < n_chunks; ++k) {
-                n_pointers += (1 << k) * bucket_sizes[n_rows - 1];
+                n_pointers += (1 << k) * bucket_sizes[n_rows - 2];
             }
             struct hamt_node **ptrs;
             ptrs = malloc(n_pointers * sizeof(struct hamt_node *));
@@ -305,7 +334,7 @@ MU_TEST_CASE(cache_test_freelist_addressing)
             }
 
             /* make sure we created the correct number of chunks */
-            struct table_allocator *ator = &cache->pools[n_rows - 1];
+            struct table_allocator *ator = &cache->pools[n_rows - 2];
             MU_ASSERT(ator->chunk_count == (size_t) n_chunks,
                       "Invalid number of chunks");
 
@@ -361,6 +390,265 @@ MU_TEST_CASE(cache_test_freelist_addressing)
     return 0;
 }
 
+#define CONCURRENT_CACHE_THREADS 4
+#define CONCURRENT_CACHE_TABLES 10000
+
+struct cache_thread_arg {
+    struct hamt_table_cache *cache;
+    uintptr_t id;
+    struct hamt_node *tables[CONCURRENT_CACHE_TABLES];
+};
+
+/* allocate and tag tables of all sizes; keep the last round allocated */
+static void *cache_thread_fn(void *p)
+{
+    struct cache_thread_arg *arg = p;
+    size_t n_pools = arg->cache->pool_count;
+    for (size_t round = 0; round < 4; ++round) {
+        for (uintptr_t i = 0; i < CONCURRENT_CACHE_TABLES; ++i) {
+            size_t n = 2 + i % n_pools;
+            struct hamt_node *t = hamt_table_cache_alloc(arg->cache, n);
+            if (!t)
+                return p;
+            for (size_t r = 0; r < n; ++r)
+                t[r].as.kv.key =
+                    (void *)(arg->id * CONCURRENT_CACHE_TABLES + i);
+            arg->tables[i] = t;
+        }
+        for (uintptr_t i = 0; i < CONCURRENT_CACHE_TABLES; ++i) {
+            size_t n = 2 + i % n_pools;
+            for (size_t r = 0; r < n; ++r)
+                if (arg->tables[i][r].as.kv.key !=
+                    (void *)(arg->id * CONCURRENT_CACHE_TABLES + i))
+                    return p;
+            if (round < 3)
+                hamt_table_cache_free(arg->cache, n, arg->tables[i]);
+        }
+    }
+    return NULL;
+}
+
+MU_TEST_CASE(cache_test_concurrent)
+{
+    printf("Testing concurrent cache...\n");
+    ptrdiff_t bucket_sizes[33];
+    for (size_t i = 0; i < 33; ++i)
+        bucket_sizes[i] = 16;
+    struct hamt_table_cache_config cfg = {
+        .backing_allocator = &hamt_allocator_default,
+        .bucket_count = hamt_table_cache_config_default_bucket_count,
+        .initial_bucket_sizes = bucket_sizes,
+        .concurrent = true};
+    struct hamt_table_cache *cache = hamt_table_cache_create(&cfg);
+    MU_ASSERT(cache->concurrent, "cache should be concurrent");
+
+    struct cache_thread_arg *args =
+        malloc(CONCURRENT_CACHE_THREADS * sizeof *args);
+    pthread_t threads[CONCURRENT_CACHE_THREADS];
+    for (int run = 0; run < 2; ++run) {
+        for (uintptr_t t = 0; t < CONCURRENT_CACHE_THREADS; ++t) {
+            args[t].cache = cache;
+            args[t].id = t;
+            pthread_create(&threads[t], NULL, cache_thread_fn, &args[t]);
+        }
+        for (size_t t = 0; t < CONCURRENT_CACHE_THREADS; ++t) {
+            void *ret;
+            pthread_join(threads[t], &ret);
+            MU_ASSERT(ret == NULL, "tables handed out twice");
+        }
+        /* the magazines of exited threads went back to the depots */
+        MU_ASSERT(cache->locals == pthread_getspecific(cache->local_key) &&
+                      (!cache->locals || !cache->locals->next),
+                  "thread-local caches left behind");
+        /* free everything from the main thread */
+        for (size_t t = 0; t < CONCURRENT_CACHE_THREADS; ++t) {
+            for (size_t i = 0; i < CONCURRENT_CACHE_TABLES; ++i) {
+                hamt_table_cache_free(cache, 2 + i % cache->pool_count,
+                                      args[t].tables[i]);
+            }
+        }
+    }
+    /* the pools only ever served as many tables as were in use at once */
+    for (ptrdiff_t i = 0; i < cache->pool_count; ++i) {
+        ptrdiff_t in_use = CONCURRENT_CACHE_THREADS *
+                           (CONCURRENT_CACHE_TABLES / cfg.bucket_count + 1);
+        MU_ASSERT(cache->pools[i].size <
+                      in_use + (CONCURRENT_CACHE_THREADS + 1) * 3 *
+                                   TABLE_CACHE_MAGAZINE_SIZE,
+                  "depot failed to recycle magazines");
+    }
+    /* the depots hold all tables but those in the main thread's magazines */
+    MU_ASSERT(hamt_table_cache_trim(cache) > 0, "depot tables not trimmed");
+    free(args);
+    hamt_table_cache_delete(cache);
+    free(cache);
+    return 0;
+}
+
+MU_TEST_CASE(test_page_allocator)
+{
+    printf(". testing page allocator\n");
+    struct hamt_page_allocator_config configs[] = {
+        {.huge_page_size = 0},
+        {.huge_page_size = 2 << 20},
+        {.huge_page_size = 2 << 20, .transparent = true},
+        {.numa_bind = true, .numa_node = 0}};
+    for (size_t k = 0; k < sizeof configs / sizeof *configs; ++k) {
+        struct hamt_allocator *ator = hamt_page_allocator_create(&configs[k]);
+        MU_ASSERT(ator != NULL, "page allocator creation failed");
+        char *p = ator->malloc(100, ator->ctx);
+        MU_ASSERT(p != NULL, "page allocation failed");
+        if (configs[k].huge_page_size)
+            MU_ASSERT((uintptr_t)p % configs[k].huge_page_size == 0,
+                      "huge page allocation not aligned");
+        memset(p, 0x42, 100);
+        p = ator->realloc(p, 100, 5 << 20, ator->ctx);
+        MU_ASSERT(p != NULL && p[99] == 0x42, "realloc lost the contents");
+        memset(p, 0x43, 5 << 20);
+        ator->free(p, 5 << 20, ator->ctx);
+        hamt_page_allocator_delete(ator);
+    }
+    MU_ASSERT(hamt_page_allocator_create(
+                  &(struct hamt_page_allocator_config){
+                      .huge_page_size = 3 << 20}) == NULL,
+              "accepted invalid huge page size");
+#if defined(WITH_TABLE_CACHE)
+    /* chunks from huge pages, the cache's own state from the heap */
+    struct hamt_allocator *pages =
+        hamt_page_allocator_create(&configs[1]);
+    struct hamt_table_cache_config tc_cfg = {
+        .backing_allocator = &hamt_allocator_default,
+        .bucket_count = hamt_table_cache_config_default_bucket_count,
+        .adaptive = true,
+        .chunk_allocator = pages,
+        .max_chunk_bytes = 1 << 20,
+        .chunk_page_size = 2 << 20};
+    struct hamt_table_cache *cache = hamt_table_cache_create(&tc_cfg);
+    struct hamt_config cfg = {.ator = &hamt_allocator_default,
+                              .key_cmp_fn = my_keycmp_string,
+                              .key_hash_fn = my_keyhash_string,
+                              .cache = cache};
+    size_t n = 100000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n);
+    struct hamt *t = hamt_create(&cfg);
+    for (size_t i = 0; i < n; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        MU_ASSERT(hamt_get(t, words[i]) == words[i], "lookup failed");
+    }
+    /* the chunks fill their huge pages up to less than a table */
+    struct hamt_table_cache_stats stats;
+    hamt_table_cache_stats(cache, &stats);
+    for (size_t i = 0; i < stats.pool_count; ++i) {
+        struct hamt_table_pool_stats *ps = &stats.pools[i];
+        size_t table_bytes = ps->table_size * sizeof(struct hamt_node);
+        MU_ASSERT(ps->chunk_bytes >=
+                      ps->chunk_count * ((2 << 20) - table_bytes + 1),
+                  "chunk does not fill a huge page");
+    }
+    hamt_delete(t);
+    MU_ASSERT(hamt_table_cache_trim(cache) > 0, "nothing unmapped");
+    hamt_table_cache_delete(cache);
+    free(cache);
+    hamt_page_allocator_delete(pages);
+    words_free(words, n);
+#endif
+    return 0;
+}
+
+#if defined(WITH_TABLE_CACHE)
+static size_t cache_chunk_bytes(struct hamt_table_cache *cache)
+{
+    struct hamt_table_cache_stats stats;
+    hamt_table_cache_stats(cache, &stats);
+    for (size_t i = 0; i < stats.pool_count; ++i) {
+        struct hamt_table_pool_stats *ps = &stats.pools[i];
+        if (ps->live + ps->free != ps->peak)
+            return SIZE_MAX;
+    }
+    return stats.chunk_bytes;
+}
+
+MU_TEST_CASE(cache_test_adaptive_trim)
+{
+    printf("Testing adaptive cache and trim...\n");
+    size_t n = 100000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n);
+    struct hamt_table_cache_config tc_cfg = {
+        .backing_allocator = &hamt_allocator_default,
+        .bucket_count = hamt_table_cache_config_default_bucket_count,
+        .initial_bucket_sizes = NULL,
+        .adaptive = true};
+    struct hamt_table_cache *cache = hamt_table_cache_create(&tc_cfg);
+    MU_ASSERT(cache_chunk_bytes(cache) == 0, "adaptive cache should be empty");
+    struct hamt_config cfg = {.ator = &hamt_allocator_default,
+                              .key_cmp_fn = my_keycmp_string,
+                              .key_hash_fn = my_keyhash_string,
+                              .cache = cache};
+    struct hamt *t = hamt_create(&cfg);
+    for (size_t i = 0; i < n; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    /* pools grow with demand, i.e. to at most double their high-water mark */
+    struct hamt_table_cache_stats stats;
+    hamt_table_cache_stats(cache, &stats);
+    for (size_t i = 0; i < stats.pool_count; ++i) {
+        struct hamt_table_pool_stats *ps = &stats.pools[i];
+        size_t bytes = ps->table_size * sizeof(struct hamt_node);
+        MU_ASSERT(ps->chunk_bytes <= (2 * ps->peak + 64) * bytes,
+                  "pool grew beyond demand");
+    }
+    /* remove most keys; the surviving tables pin some chunks */
+    for (size_t i = 0; i < n; i++) {
+        if (i % 10)
+            hamt_remove(t, words[i]);
+    }
+    size_t before = cache_chunk_bytes(cache);
+    size_t released = hamt_table_cache_trim(cache);
+    MU_ASSERT(released > 0, "nothing released");
+    MU_ASSERT(cache_chunk_bytes(cache) < before, "chunk bytes did not shrink");
+    for (size_t i = 0; i < n; i++) {
+        MU_ASSERT((hamt_get(t, words[i]) != NULL) == (i % 10 == 0),
+                  "trim corrupted the trie");
+    }
+    /* tables of trimmed pools are still served */
+    for (size_t i = 0; i < n; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    MU_ASSERT(hamt_size(t) == n, "wrong size after refill");
+    hamt_delete(t);
+    hamt_table_cache_trim(cache);
+    MU_ASSERT(cache_chunk_bytes(cache) == 0, "chunks left after full trim");
+    hamt_table_cache_delete(cache);
+    free(cache);
+
+    /* a preallocated cache releases its unused reserve */
+    tc_cfg.initial_bucket_sizes = hamt_table_cache_default_bucket_sizes;
+    tc_cfg.adaptive = false;
+    cache = hamt_table_cache_create(&tc_cfg);
+    struct hamt_node *p = hamt_table_cache_alloc(cache, 3);
+    before = cache_chunk_bytes(cache);
+    hamt_table_cache_trim(cache);
+    size_t chunk_bytes =
+        3 * sizeof(struct hamt_node) * hamt_table_cache_default_bucket_sizes[1];
+    MU_ASSERT(cache_chunk_bytes(cache) == chunk_bytes,
+              "only the chunk in use should remain");
+    hamt_table_cache_free(cache, 3, p);
+    hamt_table_cache_trim(cache);
+    MU_ASSERT(cache_chunk_bytes(cache) == 0, "unused reserve not released");
+    p = hamt_table_cache_alloc(cache, 3);
+    MU_ASSERT(p != NULL && cache_chunk_bytes(cache) > 0, "no chunk after trim");
+    hamt_table_cache_free(cache, 3, p);
+    hamt_table_cache_delete(cache);
+    free(cache);
+    words_free(words, n);
+    return 0;
+}
+#endif
+
 MU_TEST_CASE(test_popcount)
 {
     printf(". testing popcount\n");
@@ -473,19 +761,32 @@ MU_TEST_CASE(test_search)
 
     struct hamt_node *t_root =
         (struct hamt_node *)calloc(sizeof(struct hamt_node), 3);
-    t_root[0].as.table.index = (1 << 4) | (1 << 17);
-    t_root[0].as.table.ptr = t_8;
-    t_root[1].as.table.index = (1 << 0) | (1 << 16);
-    t_root[1].as.table.ptr = t_23;
-    t_root[2].as.kv.key = &keys[0];
-    t_root[2].as.kv.value = tagged(&values[0]);
+#if defined(WITH_CHAMP_LAYOUT)
+    /* leaves first */
+    struct hamt_node *r_8 = &t_root[1], *r_23 = &t_root[2], *r_0 = &t_root[0];
+#else
+    struct hamt_node *r_8 = &t_root[0], *r_23 = &t_root[1], *r_0 = &t_root[2];
+#endif
+    r_8->as.table.index = (1 << 4) | (1 << 17);
+    r_8->as.table.ptr = t_8;
+    r_23->as.table.index = (1 << 0) | (1 << 16);
+    r_23->as.table.ptr = t_23;
+    r_0->as.kv.key = &keys[0];
+    r_0->as.kv.value = tagged(&values[0]);
+#if defined(WITH_LEAF_HASHES)
+    t_8[0].as.kv.hash = my_hash_1(&keys[2], 0);
+    t_8[1].as.kv.hash = my_hash_1(&keys[3], 0);
+    t_23[0].as.kv.hash = my_hash_1(&keys[4], 0);
+    t_23[1].as.kv.hash = my_hash_1(&keys[1], 0);
+    r_0->as.kv.hash = my_hash_1(&keys[0], 0);
+#endif
 
     struct hamt t;
     t.key_cmp = my_strncmp_1;
     t.ator = &hamt_allocator_default;
     t.root = ALLOC(t.ator, sizeof(struct hamt_node));
-    t.root->as.table.index = (1 << 8) | (1 << 23) | (1 << 31);
-    t.root->as.table.ptr = t_root;
+    anchor_init(t.root, t_root, (1 << 8) | (1 << 23) | (1u << 31),
+                (1 << 8) | (1 << 23));
 
     struct {
         char *key;
@@ -505,8 +806,8 @@ MU_TEST_CASE(test_search)
                                  .hash = my_hash_1(test_cases[i].key, 0),
                                  .depth = 0,
                                  .shift = 0};
-        struct search_result sr = search_recursive(
-            &t, t.root, hash, my_strncmp_1, test_cases[i].key, NULL);
+        struct search_result sr = search(
+            &t, t.root, hash, my_strncmp_1, test_cases[i].key, false);
         MU_ASSERT(sr.status == test_cases[i].expected_status,
                   "Unexpected search result status");
         if (test_cases[i].expected_status == SEARCH_SUCCESS) {
@@ -544,13 +845,17 @@ MU_TEST_CASE(test_set_with_collisions)
     t_root[0].as.kv.value = tagged(&values[0]);
     t_root[1].as.kv.key = &keys[1];
     t_root[1].as.kv.value = tagged(&values[1]);
+#if defined(WITH_LEAF_HASHES)
+    t_root[0].as.kv.hash = my_hash_1(&keys[0], 0);
+    t_root[1].as.kv.hash = my_hash_1(&keys[1], 0);
+#endif
 
     t->root->as.table.ptr = t_root;
-    t->root->as.table.index = (1 << 23) | (1 << 31);
+    t->root->as.table.index = (1 << 23) | (UINT32_C(1) << 31);
 
     /* insert value and find it again */
     const struct hamt_node *new_node =
-        set(t, t->root, t->key_hash, t->key_cmp, &keys[2], &values[2]);
+        set(t, t->root, &keys[2], &values[2]);
     struct hash_state *hash =
         &(struct hash_state){.key = &keys[2],
                              .hash_fn = t->key_hash,
@@ -558,7 +863,7 @@ MU_TEST_CASE(test_set_with_collisions)
                              .depth = 0,
                              .shift = 0};
     struct search_result sr =
-        search_recursive(t, t->root, hash, t->key_cmp, &keys[2], NULL);
+        search(t, t->root, hash, t->key_cmp, &keys[2], false);
     MU_ASSERT(sr.status == SEARCH_SUCCESS, "failed to find inserted value");
     MU_ASSERT(new_node == sr.value, "Query result points to the wrong node");
     hamt_delete(t);
@@ -580,7 +885,7 @@ MU_TEST_CASE(test_set_whole_enchilada_00)
         create_config(&hamt_allocator_default, my_hash_1, my_strncmp_1);
     struct hamt *t = hamt_create(cfg);
     for (size_t i = 0; i < 5; ++i) {
-        set(t, t->root, t->key_hash, t->key_cmp, &data[i].key, &data[i].value);
+        set(t, t->root, &data[i].key, &data[i].value);
     }
 
     for (size_t i = 0; i < 5; ++i) {
@@ -591,7 +896,7 @@ MU_TEST_CASE(test_set_whole_enchilada_00)
                                  .depth = 0,
                                  .shift = 0};
         struct search_result sr =
-            search_recursive(t, t->root, hash, t->key_cmp, &data[i].key, NULL);
+            search(t, t->root, hash, t->key_cmp, &data[i].key, false);
         MU_ASSERT(sr.status == SEARCH_SUCCESS, "failed to find inserted value");
         int *value = (int *)untagged(sr.value->as.kv.value);
         MU_ASSERT(value, "found value is NULL");
@@ -619,7 +924,7 @@ MU_TEST_CASE(test_set_stringkeys)
     struct hamt *t = hamt_create(cfg);
     for (size_t i = 0; i < 6; ++i) {
         // printf("setting (%s, %d)\n", data[i].key, data[i].value);
-        set(t, t->root, t->key_hash, t->key_cmp, data[i].key, &data[i].value);
+        set(t, t->root, data[i].key, &data[i].value);
         // debug_print_string(t->root, 4);
     }
 
@@ -632,7 +937,7 @@ MU_TEST_CASE(test_set_stringkeys)
                                  .depth = 0,
                                  .shift = 0};
         struct search_result sr =
-            search_recursive(t, t->root, hash, t->key_cmp, data[i].key, NULL);
+            search(t, t->root, hash, t->key_cmp, data[i].key, false);
         MU_ASSERT(sr.status == SEARCH_SUCCESS, "failed to find inserted value");
         int *value = (int *)untagged(sr.value->as.kv.value);
         MU_ASSERT(value, "found value is NULL");
@@ -675,7 +980,7 @@ MU_TEST_CASE(test_aspell_dict_en)
                              .depth = 0,
                              .shift = 0};
     struct search_result sr =
-        search_recursive(t, t->root, hash, t->key_cmp, target, NULL);
+        search(t, t->root, hash, t->key_cmp, target, false);
     MU_ASSERT(sr.status == SEARCH_SUCCESS, "fail");
     char *value = (char *)untagged(sr.value->as.kv.value);
 
@@ -728,6 +1033,116 @@ MU_TEST_SUITE(test_setget_large_scale)
     return 0;
 }
 
+MU_TEST_CASE(test_get_many)
+{
+    printf(". testing batched lookup\n");
+
+    /* load the first half of the numbers, query all of them */
+    size_t n_items = 1e5 + 3; /* not a multiple of the group size */
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    const void **values = malloc(n_items * sizeof(void *));
+
+    MU_ASSERT(hamt_get_many(t, (void **)words, n_items, values) == 0,
+              "found keys in an empty trie");
+    for (size_t i = 0; i < n_items; ++i) {
+        MU_ASSERT(values[i] == NULL, "found key in an empty trie");
+    }
+    for (size_t i = 0; i < n_items; i += 2) {
+        hamt_set(t, words[i], words[i]);
+    }
+    MU_ASSERT(hamt_get_many(t, (void **)words, n_items, values) ==
+                  hamt_size(t),
+              "wrong number of keys found");
+    for (size_t i = 0; i < n_items; ++i) {
+        MU_ASSERT(values[i] == hamt_get(t, words[i]),
+                  "batched lookup differs from single lookup");
+    }
+    MU_ASSERT(hamt_get_many(t, (void **)words, 0, values) == 0,
+              "empty batch should not find anything");
+
+    free(values);
+    hamt_delete(t);
+    words_free(words, n_items);
+    delete_config(cfg);
+    return 0;
+}
+
+#if defined(WITH_LEAF_HASHES)
+static size_t n_keycmp_calls = 0;
+
+static int my_keycmp_string_counting(const void *lhs, const void *rhs)
+{
+    n_keycmp_calls++;
+    return my_keycmp_string(lhs, rhs);
+}
+
+MU_TEST_CASE(test_leaf_hashes)
+{
+    printf(". testing hash mismatch detection w/ leaf hashes\n");
+
+    size_t n_items = 2e4;
+    char **words = NULL;
+    words_load_numbers(&words, 0, 2 * n_items);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string_counting);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; ++i) {
+        hamt_set(t, words[i], words[i]);
+    }
+    /* looking up keys that are not in the trie should only require key
+     * comparisons for full 32-bit hash collisions */
+    n_keycmp_calls = 0;
+    for (size_t i = n_items; i < 2 * n_items; ++i) {
+        MU_ASSERT(hamt_get(t, words[i]) == NULL, "found non-existing key");
+        MU_ASSERT(hamt_remove(t, words[i]) == NULL, "removed non-existing key");
+    }
+    MU_ASSERT(n_keycmp_calls < 4, "unexpected key comparisons");
+    for (size_t i = 0; i < n_items; ++i) {
+        MU_ASSERT(hamt_get(t, words[i]) == words[i], "failed to find key");
+    }
+    hamt_delete(t);
+    words_free(words, 2 * n_items);
+    delete_config(cfg);
+    return 0;
+}
+#endif
+
+MU_TEST_CASE(test_set_deep_collisions)
+{
+    printf(". testing set/get/remove w/ hash regeneration\n");
+
+    size_t n_items = 1000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    struct hamt_config *cfg =
+        create_config(&hamt_allocator_default,
+                      my_keyhash_string_gen0_collision, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; ++i) {
+        hamt_set(t, words[i], words[i]);
+        for (size_t k = 0; k <= i; ++k) {
+            MU_ASSERT(hamt_get(t, words[k]) == words[k],
+                      "failed to find key after split below level 6");
+        }
+    }
+    for (size_t i = 0; i < n_items; ++i) {
+        MU_ASSERT(hamt_remove(t, words[i]) == words[i], "failed to remove key");
+        for (size_t k = i + 1; k < n_items; ++k) {
+            MU_ASSERT(hamt_get(t, words[k]) == words[k],
+                      "lost key after removal");
+        }
+    }
+    MU_ASSERT(hamt_size(t) == 0, "trie should be empty");
+    hamt_delete(t);
+    words_free(words, n_items);
+    delete_config(cfg);
+    return 0;
+}
+
 MU_TEST_CASE(test_shrink_table)
 {
     printf(". testing table operations: shrink\n");
@@ -751,7 +1166,7 @@ MU_TEST_CASE(test_shrink_table)
         memset(a0, 0, sizeof(struct hamt_node));
         TABLE(a0) = table_allocate(t, N);
         for (size_t i = 0; i < N; ++i) {
-            INDEX(a0) |= (1 << data[i].index);
+            INDEX(a0) |= (UINT32_C(1) << data[i].index);
             TABLE(a0)[i].as.kv.key = (void *)data[i].key;
             TABLE(a0)[i].as.kv.value = tagged(&data[i].value);
         }
@@ -798,7 +1213,7 @@ MU_TEST_CASE(test_gather_table)
     a0->as.table.index = 0;
     a0->as.table.ptr = table_allocate(t, N);
     for (size_t i = 0; i < N; ++i) {
-        a0->as.table.index |= (1 << data[i].index);
+        a0->as.table.index |= (UINT32_C(1) << data[i].index);
         a0->as.table.ptr[i].as.kv.key = (void *)data[i].key;
         a0->as.table.ptr[i].as.kv.value = tagged(&data[i].value);
     }
@@ -829,8 +1244,7 @@ MU_TEST_CASE(test_remove)
 
     for (size_t k = 0; k < 3; ++k) {
         for (size_t i = 0; i < N; ++i) {
-            set(t, t->root, t->key_hash, t->key_cmp, data[i].key,
-                &data[i].value);
+            set(t, t->root, data[i].key, &data[i].value);
         }
         for (size_t i = 0; i < N; ++i) {
             struct hash_state *hash =
@@ -839,12 +1253,12 @@ MU_TEST_CASE(test_remove)
                                      .hash = t->key_hash(data[i].key, 0),
                                      .depth = 0,
                                      .shift = 0};
-            struct path_result pr =
-                rem(t, t->root, t->root, hash, t->key_cmp, data[i].key);
-            MU_ASSERT(pr.rr.status == REMOVE_SUCCESS ||
-                          pr.rr.status == REMOVE_GATHERED,
+            struct remove_result rr = rem(
+                t, t->root, t->root, hash, t->key_cmp, data[i].key);
+            MU_ASSERT(rr.status == REMOVE_SUCCESS ||
+                          rr.status == REMOVE_GATHERED,
                       "failed to find inserted value");
-            MU_ASSERT(*(int *)untagged(pr.rr.value) == data[i].value,
+            MU_ASSERT(*(int *)untagged(rr.value) == data[i].value,
                       "wrong value in remove");
         }
     }
@@ -871,7 +1285,7 @@ MU_TEST_CASE(test_create_delete)
     } data[6] = {{"humpty", 1}, {"dumpty", 2}, {"sat", 3},
                  {"on", 4},     {"the", 5},    {"wall", 6}};
     for (size_t i = 0; i < 6; ++i) {
-        set(t, t->root, t->key_hash, t->key_cmp, data[i].key, &data[i].value);
+        set(t, t->root, data[i].key, &data[i].value);
     }
     hamt_delete(t);
     delete_config(cfg);
@@ -948,7 +1362,76 @@ MU_TEST_CASE(test_iterators)
     MU_ASSERT(count == 6, "Wrong number of items in iteration");
     hamt_it_delete(it);
 
+    /* iterators on the stack visit the same sequence */
+    struct hamt_iterator sit;
+    count = 0;
+    for (hamt_it_init(&sit, t); hamt_it_valid(&sit); hamt_it_next(&sit)) {
+        MU_ASSERT(strcmp((char *)hamt_it_get_key(&sit), expected[count].key) ==
+                      0,
+                  "Unexpected key in iteration");
+        count += 1;
+    }
+    MU_ASSERT(count == 6, "Wrong number of items in iteration");
+    hamt_it_fini(&sit);
+
+    hamt_delete(t);
+    delete_config(cfg);
+    return 0;
+}
+
+static int count_items(const void *key, const void *value, void *ctx)
+{
+    (void)key;
+    (void)value;
+    *(size_t *)ctx += 1;
+    return 0;
+}
+
+static int stop_at_key(const void *key, const void *value, void *ctx)
+{
+    (void)value;
+    return strcmp(key, ctx) == 0 ? 42 : 0;
+}
+
+/* the first three hash generations collide: all keys end up in buckets */
+static uint32_t my_keyhash_string_deep_collision(const void *key,
+                                                 const size_t gen)
+{
+    return gen < 18 ? 0 : my_keyhash_string(key, gen);
+}
+
+MU_TEST_CASE(test_iterators_deep)
+{
+    printf(". testing iterators beyond the inline depth\n");
+    size_t n_items = 1000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    struct hamt_config *cfg =
+        create_config(&hamt_allocator_default,
+                      my_keyhash_string_deep_collision, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    struct hamt_iterator it;
+    size_t count = 0;
+    hamt_it_init(&it, t);
+    bool spilled = false;
+    for (; hamt_it_valid(&it); hamt_it_next(&it)) {
+        MU_ASSERT(hamt_get(t, (void *)hamt_it_get_key(&it)) ==
+                      hamt_it_get_value(&it),
+                  "Unexpected value in iteration");
+        spilled |= it.heap != NULL;
+        count += 1;
+    }
+    /* the colliding keys fill a chain of overflow buckets */
+    MU_ASSERT(spilled, "deep trie should spill the iterator stack");
+    hamt_it_fini(&it);
+    MU_ASSERT(count == n_items, "Wrong number of items in iteration");
+    MU_ASSERT(hamt_foreach(t, stop_at_key, words[n_items / 2]) == 42,
+              "foreach did not stop");
     hamt_delete(t);
+    words_free(words, n_items);
     delete_config(cfg);
     return 0;
 }
@@ -983,6 +1466,11 @@ MU_TEST_CASE(test_iterators_1m)
      * the HAMT is aware of */
     // printf("size: %lu, count: %lu\n", hamt_size(t), count);
     MU_ASSERT(count == hamt_size(t), "Wrong number of items in iteration");
+    /* same for the callback interface */
+    count = 0;
+    MU_ASSERT(hamt_foreach(t, count_items, &count) == 0,
+              "foreach stopped early");
+    MU_ASSERT(count == hamt_size(t), "Wrong number of items in foreach");
     /* clean up */
     hamt_it_delete(it);
     hamt_delete(t);
@@ -990,80 +1478,1810 @@ MU_TEST_CASE(test_iterators_1m)
     return 0;
 }
 
-MU_TEST_CASE(test_persistent_set)
+static int count_items_atomic(const void *key, const void *value, void *ctx)
 {
-    printf(". testing set/insert w/ structural sharing\n");
+    (void)key;
+    (void)value;
+    atomic_fetch_add((atomic_size_t *)ctx, 1);
+    return 0;
+}
 
-    /* test data, see above */
-    struct {
-        char *key;
-        int value;
-    } data[6] = {{"humpty", 1}, {"dumpty", 2}, {"sat", 3},
-                 {"on", 4},     {"the", 5},    {"wall", 6}};
+struct sum_acc {
+    size_t count;
+    long sum;
+};
 
-    struct hamt_config *cfg = create_config(
-        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
-    const struct hamt *t = hamt_create(cfg);
-    const struct hamt *tmp;
-    for (size_t i = 0; i < 6; ++i) {
-        tmp = hamt_pset(t, data[i].key, &data[i].value);
-        debug_print_string(0, tmp->root, 0);
-        printf("---\n");
-        MU_ASSERT(hamt_size(tmp) == hamt_size(t) + 1, "wrong trie size");
-        for (size_t k = 0; k <= i; k++) {
-            if (k < i) {
-                /* test if pre-insert keys are still accessible
-                 * in the original trie */
-                MU_ASSERT(hamt_get(t, data[k].key) == &data[k].value,
-                          "failed to find all expected values in existing");
-            }
-            /* test is pre-insert keys and the new key are accessible
-             * in the new trie */
-            MU_ASSERT(hamt_get(tmp, data[k].key) == &data[k].value,
-                      "failed to find all expected values in copy");
+static void sum_accumulate(void *acc, const void *key, const void *value,
+                           void *ctx)
+{
+    (void)key;
+    (void)ctx;
+    struct sum_acc *a = acc;
+    a->count += 1;
+    a->sum += atol(value);
+}
+
+static void sum_combine(void *acc, const void *other, void *ctx)
+{
+    (void)ctx;
+    struct sum_acc *a = acc;
+    const struct sum_acc *b = other;
+    a->count += b->count;
+    a->sum += b->sum;
+}
+
+MU_TEST_CASE(test_par_foreach)
+{
+    printf(". testing parallel traversal and reduction\n");
+    size_t n_items = 100000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    const struct hamt_reducer reducer = {.acc_size = sizeof(struct sum_acc),
+                                         .accumulate = sum_accumulate,
+                                         .combine = sum_combine};
+    hamt_key_hash_fn hashes[2] = {my_keyhash_string,
+                                  my_keyhash_string_deep_collision};
+    for (size_t h = 0; h < 2; ++h) {
+        /* the second trie is a single path to depth 18 */
+        size_t n = h == 0 ? n_items : 1000;
+        struct hamt_config *cfg = create_config(&hamt_allocator_default,
+                                                hashes[h], my_keycmp_string);
+        struct hamt *t = hamt_create(cfg);
+        for (size_t i = 0; i < n; i++) {
+            hamt_set(t, words[i], words[i]);
         }
-        /* make sure that the new key is not accessible in the
-         * existing trie */
-        MU_ASSERT(hamt_get(t, data[i].key) == NULL, "unexpected side effect");
-        t = tmp;
+        for (size_t n_threads = 0; n_threads <= 4; ++n_threads) {
+            atomic_size_t count;
+            atomic_init(&count, 0);
+            MU_ASSERT(hamt_par_foreach(t, n_threads, count_items_atomic,
+                                       &count) == 0,
+                      "par_foreach stopped early");
+            MU_ASSERT(atomic_load(&count) == n,
+                      "Wrong number of items in par_foreach");
+            MU_ASSERT(hamt_par_foreach(t, n_threads, stop_at_key,
+                                       words[n / 2]) == 42,
+                      "par_foreach did not stop");
+            struct sum_acc sum = {0, 0};
+            hamt_par_reduce(t, n_threads, &reducer, &sum, NULL);
+            MU_ASSERT(sum.count == n, "Wrong number of items in reduction");
+            MU_ASSERT(sum.sum == (long)(n * (n - 1) / 2), "Wrong sum");
+        }
+        hamt_delete(t);
+        delete_config(cfg);
     }
-    /* There is no way to cleanly free the structurally shared
-     * tries without garbage collection. Leak them. */
+    words_free(words, n_items);
     return 0;
 }
 
-MU_TEST_CASE(test_persistent_aspell_dict_en)
+struct diff_counts {
+    size_t only_a, only_b, changed;
+};
+
+static int count_diff(const void *key, const void *value_a,
+                      const void *value_b, void *ctx)
 {
-    printf(". testing large-scale set/insert w/ structural sharing\n");
+    (void)key;
+    struct diff_counts *c = ctx;
+    if (!value_b)
+        c->only_a += 1;
+    else if (!value_a)
+        c->only_b += 1;
+    else
+        c->changed += 1;
+    return 0;
+}
 
-    char **words = NULL;
-    const struct hamt *t;
+static void *pick_b(const void *key, const void *value_a,
+                    const void *value_b, void *ctx)
+{
+    (void)key;
+    (void)value_a;
+    (void)ctx;
+    return (void *)value_b;
+}
 
-    words_load(&words, WORDS_MAX);
-    struct hamt_config *cfg = create_config(
-        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
-    t = hamt_create(cfg);
-    for (size_t i = 0; i < WORDS_MAX; i++) {
-        /* structural sharing */
-        t = hamt_pset(t, words[i], words[i]);
+MU_TEST_CASE(test_set_operations)
+{
+    printf(". testing diff, merge and intersection\n");
+    size_t n_items = 10000, n_changed = 100;
+    char **words = NULL, **values = NULL;
+    words_load_numbers(&words, 0, n_items + n_changed);
+    words_load_numbers(&values, n_items, n_changed);
+    hamt_key_hash_fn hashes[2] = {my_keyhash_string,
+                                  my_keyhash_string_deep_collision};
+    for (size_t h = 0; h < 2; ++h) {
+        struct hamt_config *cfg = create_config(&hamt_allocator_default,
+                                                hashes[h], my_keycmp_string);
+        struct hamt *t = hamt_create(cfg);
+        for (size_t i = 0; i < n_items; i++) {
+            hamt_set(t, words[i], words[i]);
+        }
+        const struct hamt *a = hamt_persistent(t);
+        /* b: remove the first n_changed keys, update the next n_changed
+         * keys and add n_changed new ones */
+        struct hamt *bt = hamt_transient(a);
+        for (size_t i = 0; i < n_changed; i++) {
+            hamt_remove(bt, words[i]);
+            hamt_set(bt, words[n_changed + i], values[i]);
+            hamt_set(bt, words[n_items + i], words[n_items + i]);
+        }
+        const struct hamt *b = hamt_persistent(bt);
+
+        struct diff_counts c = {0, 0, 0};
+        MU_ASSERT(hamt_diff(a, a, count_diff, &c) == 0 && c.only_a == 0 &&
+                      c.only_b == 0 && c.changed == 0,
+                  "diff of identical versions must be empty");
+        MU_ASSERT(hamt_diff(a, b, count_diff, &c) == 0, "diff stopped");
+        MU_ASSERT(c.only_a == n_changed && c.only_b == n_changed &&
+                      c.changed == n_changed,
+                  "unexpected diff");
+
+        /* no shared tables */
+        struct hamt *r = hamt_create(cfg);
+        for (size_t i = n_items; i-- > 0;) {
+            hamt_set(r, words[i], words[i]);
+        }
+        c = (struct diff_counts){0, 0, 0};
+        MU_ASSERT(hamt_diff(r, a, count_diff, &c) == 0 && c.only_a == 0 &&
+                      c.only_b == 0 && c.changed == 0,
+                  "diff of equal tries must be empty");
+        hamt_delete(r);
+        c = (struct diff_counts){0, 0, 0};
+
+        const struct hamt *m = hamt_merge(a, b, NULL, NULL);
+        MU_ASSERT(hamt_size(m) == n_items + n_changed, "wrong merge size");
+        for (size_t i = 0; i < n_items + n_changed; i++) {
+            const void *expected = i >= n_changed && i < 2 * n_changed
+                                       ? values[i - n_changed]
+                                       : words[i];
+            MU_ASSERT(hamt_get(m, words[i]) == expected, "wrong merge value");
+        }
+        const struct hamt *x = hamt_intersect(a, b, pick_b, NULL);
+        MU_ASSERT(hamt_size(x) == n_items - n_changed,
+                  "wrong intersection size");
+        for (size_t i = 0; i < n_items + n_changed; i++) {
+            const void *expected = i < n_changed || i >= n_items ? NULL
+                                   : i < 2 * n_changed ? values[i - n_changed]
+                                                       : words[i];
+            MU_ASSERT(hamt_get(x, words[i]) == expected,
+                      "wrong intersection value");
+        }
+        /* a is unaffected */
+        MU_ASSERT(hamt_size(a) == n_items, "merge modified its input");
+        for (size_t i = 0; i < n_items; i++) {
+            MU_ASSERT(hamt_get(a, words[i]) == words[i],
+                      "merge modified its input");
+        }
+        hamt_release(x);
+        hamt_release(m);
+        hamt_release(b);
+        hamt_release(a);
+        delete_config(cfg);
     }
+    words_free(values, n_changed);
+    words_free(words, n_items + n_changed);
+    return 0;
+}
 
-    /* Check if we can retrieve the entire dictionary */
-    for (size_t i = 0; i < WORDS_MAX; i++) {
-        MU_ASSERT(hamt_get(t, words[i]) != NULL, "could not find expected key");
-    }
+static int replay_add(const void *key, const void *value, void *ctx)
+{
+    hamt_set(ctx, (void *)key, (void *)value);
+    return 0;
+}
 
-    words_free(words, WORDS_MAX);
-    /* There is no way to cleanly free the structurally shared
-     * tries without garbage collection. Leak them. */
+static int replay_remove(const void *key, const void *value, void *ctx)
+{
+    (void)value;
+    hamt_remove(ctx, (void *)key);
     return 0;
 }
 
-MU_TEST_CASE(test_table_extend)
+static int replay_update(const void *key, const void *old_value,
+                         const void *new_value, void *ctx)
 {
-    printf(". testing table_extend\n");
-    struct hamt_config *cfg = create_config(
-        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    (void)old_value;
+    hamt_set(ctx, (void *)key, (void *)new_value);
+    return 0;
+}
+
+MU_TEST_CASE(test_changes)
+{
+    printf(". testing change feeds and equality\n");
+    size_t n_items = 10000, n_changed = 100;
+    char **words = NULL, **values = NULL;
+    words_load_numbers(&words, 0, n_items + n_changed);
+    words_load_numbers(&values, n_items, n_changed);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    const struct hamt *from = hamt_persistent(t);
+    struct hamt *tt = hamt_transient(from);
+    for (size_t i = 0; i < n_changed; i++) {
+        hamt_remove(tt, words[i]);
+        hamt_set(tt, words[n_changed + i], values[i]);
+        hamt_set(tt, words[n_items + i], words[n_items + i]);
+    }
+    const struct hamt *to = hamt_persistent(tt);
+    MU_ASSERT(hamt_equal(from, from), "a version must equal itself");
+    MU_ASSERT(!hamt_equal(from, to), "different versions must not be equal");
+
+    /* replaying the change feed on `from` yields `to` */
+    struct hamt *replica = hamt_transient(from);
+    MU_ASSERT(hamt_changes(from, to, replay_add, replay_remove, replay_update,
+                           replica) == 0,
+              "change feed stopped");
+    MU_ASSERT(hamt_size(replica) == hamt_size(to), "wrong replica size");
+    MU_ASSERT(hamt_equal(replica, to), "replica differs");
+    MU_ASSERT(hamt_equal(to, replica), "replica differs");
+    /* same size, one value differs */
+    hamt_set(replica, words[n_items - 1], values[0]);
+    MU_ASSERT(!hamt_equal(replica, to), "replica must differ");
+    MU_ASSERT(hamt_changes(from, to, NULL, NULL, NULL, NULL) == 0,
+              "NULL callbacks must be skipped");
+
+    hamt_release(replica);
+    hamt_release(to);
+    hamt_release(from);
+    delete_config(cfg);
+    words_free(values, n_changed);
+    words_free(words, n_items + n_changed);
+    return 0;
+}
+
+static const void *encode_string(const void *obj, size_t *len, void *ctx)
+{
+    (void)ctx;
+    *len = strlen(obj) + 1;
+    return obj;
+}
+
+static int check_mapped_item(const void *key, const void *value, void *ctx)
+{
+    const struct hamt *t = ctx;
+    return strcmp(hamt_get(t, (void *)key), value) == 0 ? 0 : 1;
+}
+
+MU_TEST_CASE(test_serialize_mapped)
+{
+    printf(". testing serialization and mapped images\n");
+    size_t n_items = 10000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items + 1);
+    const struct hamt_codec codec = {.encode_key = encode_string,
+                                     .encode_value = encode_string,
+                                     .ctx = NULL};
+    hamt_key_hash_fn hashes[2] = {my_keyhash_string,
+                                  my_keyhash_string_deep_collision};
+    for (size_t h = 0; h < 2; ++h) {
+        struct hamt_config *cfg = create_config(&hamt_allocator_default,
+                                                hashes[h], my_keycmp_string);
+        struct hamt *t = hamt_create(cfg);
+        size_t n = h == 0 ? n_items : 1000;
+        for (size_t i = 0; i < n; i++) {
+            hamt_set(t, words[i], words[n - 1 - i]);
+        }
+        char path[] = "/tmp/test_hamt_XXXXXX";
+        int fd = mkstemp(path);
+        MU_ASSERT(fd >= 0, "cannot create image file");
+        FILE *f = fdopen(fd, "wb");
+        MU_ASSERT(hamt_serialize(t, f, &codec) == 0, "serialization failed");
+        fclose(f);
+
+        struct hamt_mapped *m = hamt_open_mapped(path, cfg);
+        MU_ASSERT(m != NULL, "cannot open mapped image");
+        MU_ASSERT(hamt_mapped_size(m) == n, "wrong size of mapped trie");
+        for (size_t i = 0; i < n; i++) {
+            const char *value = hamt_mapped_get(m, words[i]);
+            MU_ASSERT(value && strcmp(value, words[n - 1 - i]) == 0,
+                      "wrong value in mapped trie");
+        }
+        MU_ASSERT(hamt_mapped_get(m, words[n_items]) == NULL,
+                  "unexpected key in mapped trie");
+        size_t count = 0;
+        MU_ASSERT(hamt_mapped_foreach(m, count_items, &count) == 0 &&
+                      count == n,
+                  "wrong number of items in mapped trie");
+        MU_ASSERT(hamt_mapped_foreach(m, check_mapped_item, t) == 0,
+                  "wrong item in mapped trie");
+        hamt_mapped_close(m);
+
+        /* a table row of the root that refers past its table is rejected */
+        if (h == 0) {
+            f = fopen(path, "r+b");
+            struct image_trailer trailer;
+            struct image_row row;
+            fseek(f, -(long)sizeof trailer, SEEK_END);
+            MU_ASSERT(fread(&trailer, sizeof trailer, 1, f) == 1,
+                      "cannot read trailer");
+            long pos = trailer.root;
+            do {
+                fseek(f, pos, SEEK_SET);
+                MU_ASSERT(fread(&row, sizeof row, 1, f) == 1,
+                          "cannot read root row");
+                pos += sizeof row;
+            } while (row.ref & HAMT_TAG_VALUE);
+            row.ref = trailer.root;
+            fseek(f, pos - sizeof row, SEEK_SET);
+            fwrite(&row, sizeof row, 1, f);
+            fclose(f);
+            m = hamt_open_mapped(path, cfg);
+            MU_ASSERT(m != NULL, "cannot open corrupt image");
+            count = 0;
+            MU_ASSERT(hamt_mapped_foreach(m, count_items, &count) == -1,
+                      "traversed a cycle");
+            for (size_t i = 0; i < n; i++)
+                hamt_mapped_get(m, words[i]);
+            hamt_mapped_close(m);
+        }
+        remove(path);
+        hamt_delete(t);
+        delete_config(cfg);
+    }
+    words_free(words, n_items + 1);
+    return 0;
+}
+
+struct chunk_sink {
+    FILE *f;
+    size_t n_bytes;
+    size_t max_chunk;
+};
+
+static int write_chunk(const void *buf, size_t len, void *ctx)
+{
+    struct chunk_sink *sink = ctx;
+    sink->n_bytes += len;
+    sink->max_chunk = len > sink->max_chunk ? len : sink->max_chunk;
+    return fwrite(buf, 1, len, sink->f) == len ? 0 : -1;
+}
+
+MU_TEST_CASE(test_snapshot_writer)
+{
+    printf(". testing incremental snapshots\n");
+    size_t n_items = 10000, n_changed = 10;
+    char **words = NULL, **values = NULL;
+    words_load_numbers(&words, 0, n_items);
+    words_load_numbers(&values, n_items, n_changed);
+    const struct hamt_codec codec = {.encode_key = encode_string,
+                                     .encode_value = encode_string,
+                                     .ctx = NULL};
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    const struct hamt *v1 = hamt_persistent(t);
+
+    char path[] = "/tmp/test_hamt_XXXXXX";
+    int fd = mkstemp(path);
+    MU_ASSERT(fd >= 0, "cannot create snapshot file");
+    struct chunk_sink sink = {.f = fdopen(fd, "wb"), .n_bytes = 0,
+                              .max_chunk = 0};
+    size_t chunk_size = 4096;
+    struct hamt_snapshot_writer *w = hamt_snapshot_writer_create(
+        &hamt_allocator_default, &codec, write_chunk, &sink, chunk_size);
+    MU_ASSERT(hamt_snapshot_writer_begin(w, v1) == 0, "begin failed");
+    /* the writer's offsets do not share the trie's table cache */
+    MU_ASSERT(w->offsets->arena != NULL, "offsets not in an arena");
+    /* modifications while the snapshot is written do not affect it */
+    struct hamt *tt = hamt_transient(v1);
+    int rc;
+    for (size_t i = 0; (rc = hamt_snapshot_writer_step(w)) == 1; ++i) {
+        if (i < n_changed)
+            hamt_set(tt, words[i], values[i]);
+    }
+    MU_ASSERT(rc == 0, "snapshot failed");
+    MU_ASSERT(sink.max_chunk <= chunk_size, "chunk too large");
+    const struct hamt *v2 = hamt_persistent(tt);
+    hamt_release(v1);
+    size_t full = sink.n_bytes;
+
+    /* the second snapshot only writes the changed tables */
+    MU_ASSERT(hamt_snapshot_writer_begin(w, v2) == 0, "begin failed");
+    while ((rc = hamt_snapshot_writer_step(w)) == 1)
+        ;
+    MU_ASSERT(rc == 0, "snapshot failed");
+
+    size_t incremental = sink.n_bytes - full;
+    MU_ASSERT(incremental < full / 10, "snapshot is not incremental");
+    /* an unmodified version only adds a trailer */
+    MU_ASSERT(hamt_snapshot_writer_begin(w, v2) == 0, "begin failed");
+    MU_ASSERT(hamt_snapshot_writer_step(w) == 0, "snapshot failed");
+    MU_ASSERT(sink.n_bytes - full - incremental <= 64,
+              "unmodified version written again");
+    hamt_snapshot_writer_delete(w);
+    fclose(sink.f);
+
+    /* the stream maps to the latest snapshot */
+    struct hamt_mapped *m = hamt_open_mapped(path, cfg);
+    MU_ASSERT(m != NULL, "cannot open snapshot");
+    MU_ASSERT(hamt_mapped_size(m) == n_items, "wrong snapshot size");
+    for (size_t i = 0; i < n_items; i++) {
+        const char *value = hamt_mapped_get(m, words[i]);
+        MU_ASSERT(value && strcmp(value, hamt_get(v2, words[i])) == 0,
+                  "wrong value in snapshot");
+    }
+    hamt_mapped_close(m);
+    remove(path);
+    hamt_release(v2);
+    delete_config(cfg);
+    words_free(values, n_changed);
+    words_free(words, n_items);
+    return 0;
+}
+
+MU_TEST_CASE(test_hash64)
+{
+    printf(". testing 64 bit hashes\n");
+    MU_ASSERT(wyhash64("abc", 3, 0) != wyhash64("abd", 3, 0) &&
+                  wyhash64("abc", 3, 0) != wyhash64("abc", 3, 1) &&
+                  wyhash64("abc", 3, 0) != wyhash64("abc", 2, 0),
+              "wyhash64 collision");
+    size_t n_items = 20000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    hamt_key_hash64_fn hashes[2] = {my_keyhash64_string,
+                                    my_keyhash64_string_deep_collision};
+    for (size_t h = 0; h < 2; ++h) {
+        size_t n = h == 0 ? n_items : 1000;
+        struct hamt_config *cfg = create_config(
+            &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+        cfg->key_hash64_fn = hashes[h];
+        struct hamt *t = hamt_create(cfg);
+        for (size_t i = 0; i < n; i++) {
+            hamt_set(t, words[i], words[i]);
+        }
+        MU_ASSERT(hamt_size(t) == n, "wrong size");
+        struct hamt *b = hamt_create_from_array(cfg, (void **)words,
+                                                (void **)words, n);
+        MU_ASSERT(hamt_equal(t, b), "bulk loaded trie differs");
+        for (size_t i = 0; i < n; i++) {
+            MU_ASSERT(hamt_get(t, words[i]) == words[i], "wrong value");
+            MU_ASSERT(hamt_get(b, words[i]) == words[i], "wrong value");
+        }
+        size_t depth = 0;
+        for (struct hamt_node *anchor = t->root; !is_value(VALUE(anchor));
+             anchor = &TABLE(anchor)[0])
+            depth += 1;
+        MU_ASSERT(h == 0 || depth == HAMT_BUCKET_DEPTH + 1,
+                  "collisions should end in a bucket");
+        for (size_t i = 0; i < n; i += 2) {
+            MU_ASSERT(hamt_remove(t, words[i]) == words[i], "remove failed");
+        }
+        for (size_t i = 0; i < n; i++) {
+            MU_ASSERT(hamt_get(t, words[i]) == (i % 2 ? words[i] : NULL),
+                      "wrong value after removal");
+        }
+        hamt_delete(b);
+        hamt_delete(t);
+        delete_config(cfg);
+    }
+    words_free(words, n_items);
+    return 0;
+}
+
+/* ignores the generation: regenerating the hash never resolves collisions */
+static uint32_t my_keyhash_constant(const void *key, const size_t gen)
+{
+    (void)key;
+    (void)gen;
+    return 42;
+}
+
+static size_t trie_max_depth(const struct hamt_node *anchor)
+{
+    if (is_value(VALUE(anchor)))
+        return 0;
+    size_t max = 0;
+    for (int i = 0; i < get_popcount(INDEX(anchor)); ++i) {
+        size_t depth = trie_max_depth(&TABLE(anchor)[i]);
+        max = depth > max ? depth : max;
+    }
+    return max + 1;
+}
+
+MU_TEST_CASE(test_collision_buckets)
+{
+    printf(". testing collision buckets\n");
+    size_t n = 500;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n + 1);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_constant, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    MU_ASSERT(hamt_size(t) == n, "wrong size");
+    MU_ASSERT(trie_max_depth(t->root) <=
+                  HAMT_BUCKET_DEPTH + 1 + n / (HAMT_BUCKET_SIZE - 1),
+              "collisions should be bounded by buckets");
+    const void **values = malloc((n + 1) * sizeof *values);
+    MU_ASSERT(hamt_get_many(t, (void **)words, n + 1, values) == n,
+              "batched lookup failed");
+    for (size_t i = 0; i < n; i++) {
+        MU_ASSERT(hamt_get(t, words[i]) == words[i], "wrong value");
+        MU_ASSERT(values[i] == words[i], "wrong batched value");
+    }
+    MU_ASSERT(hamt_get(t, words[n]) == NULL && values[n] == NULL,
+              "unexpected key");
+    free(values);
+    /* bulk loading builds the same buckets, modulo order */
+    struct hamt *b =
+        hamt_create_from_array(cfg, (void **)words, (void **)words, n);
+    MU_ASSERT(hamt_equal(t, b), "bulk loaded trie differs");
+    hamt_delete(b);
+    /* versions differ in the buckets only */
+    const struct hamt *p = hamt_premove(t, words[7]);
+    const struct hamt *q = hamt_pset(p, words[n], words[n]);
+    struct diff_counts c = {0};
+    MU_ASSERT(hamt_diff(t, q, count_diff, &c) == 0 && c.only_a == 1 &&
+                  c.only_b == 1 && c.changed == 0,
+              "wrong bucket diff");
+    hamt_release(q);
+    hamt_release(p);
+    for (size_t i = 0; i < n; i += 2) {
+        MU_ASSERT(hamt_remove(t, words[i]) == words[i], "remove failed");
+    }
+    for (size_t i = 0; i < n; i++) {
+        MU_ASSERT(hamt_get(t, words[i]) == (i % 2 ? words[i] : NULL),
+                  "wrong value after removal");
+    }
+    for (size_t i = 1; i < n; i += 2) {
+        MU_ASSERT(hamt_remove(t, words[i]) == words[i], "remove failed");
+    }
+    MU_ASSERT(hamt_size(t) == 0 && INDEX(t->root) == 0,
+              "trie should be empty");
+    hamt_delete(t);
+    delete_config(cfg);
+    words_free(words, n + 1);
+    return 0;
+}
+
+#if UINTPTR_MAX >= UINT64_MAX
+MU_TEST_CASE(test_int_keys)
+{
+    printf(". testing integer keys\n");
+    size_t n = 100000;
+    static int value;
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_int_create(cfg);
+    /* include 0 and keys that differ in the high bits only */
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t key = i % 2 ? i : i << 40;
+        hamt_int_set(t, key, &value + (i % 7));
+    }
+    MU_ASSERT(hamt_size(t) == n, "wrong size");
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t key = i % 2 ? i : i << 40;
+        MU_ASSERT(hamt_int_get(t, key) == &value + (i % 7), "wrong value");
+    }
+    MU_ASSERT(hamt_int_get(t, UINT64_MAX) == NULL, "unexpected key");
+    /* overwrite */
+    MU_ASSERT(hamt_int_set(t, 1, &value) == &value, "overwrite failed");
+    MU_ASSERT(hamt_size(t) == n, "overwrite changed size");
+    /* generic iteration sees the same keys */
+    size_t n_iter = 0;
+    struct hamt_iterator *it = hamt_it_create(t);
+    while (hamt_it_valid(it)) {
+        uint64_t key = (uintptr_t)hamt_it_get_key(it);
+        MU_ASSERT(hamt_int_get(t, key) != NULL, "iterator key not found");
+        n_iter++;
+        hamt_it_next(it);
+    }
+    hamt_it_delete(it);
+    MU_ASSERT(n_iter == n, "wrong iteration count");
+    /* persistent ops leave the original untouched */
+    const struct hamt *p = hamt_int_premove(t, 3);
+    const struct hamt *q = hamt_int_pset(p, UINT64_MAX, &value);
+    MU_ASSERT(hamt_int_get(t, 3) != NULL && hamt_int_get(p, 3) == NULL,
+              "premove modified the source");
+    MU_ASSERT(hamt_int_get(p, UINT64_MAX) == NULL &&
+                  hamt_int_get(q, UINT64_MAX) == &value,
+              "pset modified the source");
+    MU_ASSERT(hamt_size(q) == n, "wrong size after pset/premove");
+    hamt_release(q);
+    hamt_release(p);
+    for (uint64_t i = 0; i < n; i += 2) {
+        uint64_t key = i << 40;
+        MU_ASSERT(hamt_int_remove(t, key) == &value + (i % 7),
+                  "remove failed");
+    }
+    MU_ASSERT(hamt_size(t) == n / 2, "wrong size after removal");
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t key = i % 2 ? i : i << 40;
+        MU_ASSERT((hamt_int_get(t, key) != NULL) == (i % 2),
+                  "wrong value after removal");
+    }
+    hamt_delete(t);
+    delete_config(cfg);
+    return 0;
+}
+#endif
+
+/* string keys, specialized at compile time */
+#define HAMT_NAME strmap
+#define HAMT_KEY_TYPE const char
+#define HAMT_VALUE_TYPE const char
+#define HAMT_HASH(key, gen) wyhash64(key, strlen(key), gen)
+#define HAMT_EQ(lhs, rhs) (strcmp(lhs, rhs) == 0)
+#include "hamt_define.h"
+
+MU_TEST_CASE(test_define)
+{
+    printf(". testing compile-time specialized tries\n");
+    size_t n_items = 20000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = strmap_create(cfg);
+    for (size_t i = 0; i < n_items; i++) {
+        strmap_set(t, words[i], words[i]);
+    }
+    MU_ASSERT(hamt_size(t) == n_items, "wrong size");
+    for (size_t i = 0; i < n_items; i++) {
+        /* copies of the keys find the same entries */
+        char key[32];
+        strcpy(key, words[i]);
+        MU_ASSERT(strmap_get(t, key) == words[i], "wrong value");
+        MU_ASSERT(hamt_get(t, key) == words[i], "generic lookup differs");
+    }
+    MU_ASSERT(strmap_get(t, "not a number") == NULL, "unexpected key");
+    /* values are tagged pointers and need to be aligned */
+    static _Alignas(4) const char y[] = "y";
+    const struct hamt *p = strmap_premove(t, words[0]);
+    const struct hamt *q = strmap_pset(p, "x", y);
+    MU_ASSERT(strmap_get(t, words[0]) == words[0] &&
+                  strmap_get(p, words[0]) == NULL,
+              "premove modified the source");
+    MU_ASSERT(strmap_get(p, "x") == NULL && strmap_get(q, "x") == y,
+              "pset modified the source");
+    hamt_release(q);
+    hamt_release(p);
+    for (size_t i = 0; i < n_items; i += 2) {
+        MU_ASSERT(strmap_remove(t, words[i]) == words[i], "remove failed");
+    }
+    for (size_t i = 0; i < n_items; i++) {
+        MU_ASSERT(strmap_get(t, words[i]) == (i % 2 ? words[i] : NULL),
+                  "wrong value after removal");
+    }
+    hamt_delete(t);
+    delete_config(cfg);
+    words_free(words, n_items);
+    return 0;
+}
+
+struct counter_pool {
+    size_t *counts;
+    size_t n_used;
+};
+
+static void *upsert_count(const void *key, const void *value, void *ctx)
+{
+    (void)key;
+    struct counter_pool *pool = ctx;
+    size_t *count = (size_t *)value;
+    if (!count) {
+        count = &pool->counts[pool->n_used++];
+        *count = 0;
+    }
+    *count += 1;
+    return count;
+}
+
+MU_TEST_CASE(test_upsert)
+{
+    printf(". testing upsert\n");
+    size_t n_keys = 1000, n_rounds = 5;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_keys);
+    struct counter_pool pool = {calloc(n_keys, sizeof(size_t)), 0};
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    /* key i is counted i % n_rounds + 1 times */
+    for (size_t r = 0; r < n_rounds; r++) {
+        for (size_t i = 0; i < n_keys; i++) {
+            if (i % n_rounds >= r) {
+                hamt_upsert(t, words[i], upsert_count, &pool);
+            }
+        }
+    }
+    MU_ASSERT(hamt_size(t) == n_keys, "wrong size");
+    MU_ASSERT(pool.n_used == n_keys, "upsert allocated too many counters");
+    for (size_t i = 0; i < n_keys; i++) {
+        const size_t *count = hamt_get(t, words[i]);
+        MU_ASSERT(count && *count == i % n_rounds + 1, "wrong count");
+    }
+    /* get_or_insert keeps existing values */
+    size_t other = 0;
+    const void *slot = hamt_get_or_insert(t, words[0], &other);
+    MU_ASSERT(slot == hamt_get(t, words[0]) && slot != &other,
+              "get_or_insert replaced a value");
+    MU_ASSERT(hamt_get_or_insert(t, "x", &other) == &other &&
+                  hamt_size(t) == n_keys + 1,
+              "get_or_insert failed to insert");
+    /* the persistent variant leaves the source untouched */
+    size_t *counts = pool.counts;
+    pool.counts = calloc(1, sizeof(size_t));
+    pool.n_used = 0;
+    const struct hamt *p = hamt_pupsert(t, "y", upsert_count, &pool);
+    MU_ASSERT(hamt_get(t, "y") == NULL && hamt_get(p, "y") == pool.counts &&
+                  hamt_size(p) == n_keys + 2,
+              "pupsert failed");
+    hamt_release(p);
+    hamt_delete(t);
+    delete_config(cfg);
+    free(pool.counts);
+    free(counts);
+    words_free(words, n_keys);
+    return 0;
+}
+
+MU_TEST_CASE(test_persistent_set)
+{
+    printf(". testing set/insert w/ structural sharing\n");
+
+    /* test data, see above */
+    struct {
+        char *key;
+        int value;
+    } data[6] = {{"humpty", 1}, {"dumpty", 2}, {"sat", 3},
+                 {"on", 4},     {"the", 5},    {"wall", 6}};
+
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    const struct hamt *t = hamt_create(cfg);
+    const struct hamt *tmp;
+    for (size_t i = 0; i < 6; ++i) {
+        tmp = hamt_pset(t, data[i].key, &data[i].value);
+        debug_print_string(0, tmp->root, 0);
+        printf("---\n");
+        MU_ASSERT(hamt_size(tmp) == hamt_size(t) + 1, "wrong trie size");
+        for (size_t k = 0; k <= i; k++) {
+            if (k < i) {
+                /* test if pre-insert keys are still accessible
+                 * in the original trie */
+                MU_ASSERT(hamt_get(t, data[k].key) == &data[k].value,
+                          "failed to find all expected values in existing");
+            }
+            /* test is pre-insert keys and the new key are accessible
+             * in the new trie */
+            MU_ASSERT(hamt_get(tmp, data[k].key) == &data[k].value,
+                      "failed to find all expected values in copy");
+        }
+        /* make sure that the new key is not accessible in the
+         * existing trie */
+        MU_ASSERT(hamt_get(t, data[i].key) == NULL, "unexpected side effect");
+        hamt_release(t);
+        t = tmp;
+    }
+    hamt_release(t);
+    delete_config(cfg);
+    return 0;
+}
+
+MU_TEST_CASE(test_persistent_aspell_dict_en)
+{
+    printf(". testing large-scale set/insert w/ structural sharing\n");
+
+    char **words = NULL;
+    const struct hamt *t;
+
+    words_load(&words, WORDS_MAX);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    t = hamt_create(cfg);
+    for (size_t i = 0; i < WORDS_MAX; i++) {
+        /* structural sharing */
+        const struct hamt *s = hamt_pset(t, words[i], words[i]);
+        hamt_release(t);
+        t = s;
+    }
+
+    /* Check if we can retrieve the entire dictionary */
+    for (size_t i = 0; i < WORDS_MAX; i++) {
+        MU_ASSERT(hamt_get(t, words[i]) != NULL, "could not find expected key");
+    }
+
+    hamt_release(t);
+    words_free(words, WORDS_MAX);
+    delete_config(cfg);
+    return 0;
+}
+
+MU_TEST_CASE(test_persistent_release)
+{
+    printf(". testing reference-counted release of persistent versions\n");
+
+    enum { N = 1000, N_VERSIONS = 64 };
+    char **words = NULL;
+    words_load(&words, N);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+
+    /* build a base version and derive a chain of versions from it, keeping
+     * every version alive */
+    struct hamt *base = hamt_create(cfg);
+    for (size_t i = 0; i < N; i++) {
+        hamt_set(base, words[i], words[i]);
+    }
+    const struct hamt *versions[N_VERSIONS];
+    versions[0] = base;
+    for (size_t v = 1; v < N_VERSIONS; ++v) {
+        /* odd versions drop a key, even versions re-add it */
+        versions[v] = v % 2 ? hamt_premove(versions[v - 1], words[v])
+                            : hamt_pset(versions[v - 1], words[v - 1], words[v]);
+    }
+    /* mutating a version must not affect the versions it shares tables
+     * with */
+    hamt_set(base, words[1], words[0]);
+    MU_ASSERT(hamt_get(versions[1], words[1]) == NULL,
+              "modification of the base leaked into a derived version");
+    MU_ASSERT(hamt_get(versions[2], words[1]) == words[2],
+              "modification of the base leaked into a derived version");
+
+    /* release in random order and check that the survivors are intact */
+    shuffle_ptr_array(N_VERSIONS, (void **)versions);
+    for (size_t v = 0; v < N_VERSIONS; ++v) {
+        hamt_release(versions[v]);
+        for (size_t w = v + 1; w < N_VERSIONS; ++w) {
+            MU_ASSERT(hamt_get(versions[w], words[N - 1]) == words[N - 1],
+                      "release of a version corrupted another version");
+        }
+    }
+#if defined(WITH_TABLE_CACHE) && defined(WITH_TABLE_CACHE_STATS)
+    /* every table that was handed out must have been returned */
+    for (ptrdiff_t l = 0; l < cfg->cache->pool_count; ++l) {
+        MU_ASSERT(cfg->cache->pools[l].stats.alloc_count ==
+                      cfg->cache->pools[l].stats.free_count,
+                  "releasing all versions leaked tables");
+    }
+#endif
+    words_free(words, N);
+    delete_config(cfg);
+    return 0;
+}
+
+#if defined(WITH_TABLE_CACHE) && defined(WITH_TABLE_CACHE_STATS)
+static size_t cache_alloc_count(struct hamt_table_cache *cache)
+{
+    size_t count = 0;
+    for (ptrdiff_t l = 0; l < cache->pool_count; ++l) {
+        count += cache->pools[l].stats.alloc_count;
+    }
+    return count;
+}
+#endif
+
+MU_TEST_CASE(test_pset_many)
+{
+    printf(". testing batched persistent modification\n");
+    size_t n_items = 10000, k = 500;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n_items + k);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < n_items; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    /* updates, new keys and a duplicate (the last occurrence wins) */
+    void **keys = malloc((k + 1) * sizeof *keys);
+    void **values = malloc((k + 1) * sizeof *values);
+    size_t n_updates = 0;
+    for (size_t i = 0; i < k; i++) {
+        keys[i] = words[i * 21];
+        values[i] = words[n_items + k - 1 - i];
+        n_updates += i * 21 < n_items;
+    }
+    keys[k] = keys[0];
+    values[k] = words[1];
+    const struct hamt *seq = t;
+    for (size_t i = 0; i <= k; i++) {
+        const struct hamt *next = hamt_pset(seq, keys[i], values[i]);
+        if (seq != t)
+            hamt_release(seq);
+        seq = next;
+    }
+    const struct hamt *batch = hamt_pset_many(t, keys, values, k + 1);
+    MU_ASSERT(hamt_equal(batch, seq), "batch differs from single updates");
+    MU_ASSERT(hamt_get(batch, keys[0]) == words[1], "wrong duplicate value");
+    MU_ASSERT(hamt_size(t) == n_items && hamt_get(t, keys[0]) == keys[0],
+              "pset_many modified the source");
+    const struct hamt *removed = hamt_premove_many(batch, keys, k + 1);
+    for (size_t i = 0; i <= k; i++) {
+        MU_ASSERT(hamt_get(removed, keys[i]) == NULL, "key not removed");
+        MU_ASSERT(hamt_get(batch, keys[i]) != NULL,
+                  "premove_many modified the source");
+    }
+    MU_ASSERT(hamt_size(batch) == n_items + k - n_updates &&
+                  hamt_size(removed) == n_items - n_updates,
+              "wrong size");
+    hamt_release(removed);
+    hamt_release(batch);
+    hamt_release(seq);
+    hamt_delete(t);
+    free(values);
+    free(keys);
+    delete_config(cfg);
+    words_free(words, n_items + k);
+    return 0;
+}
+
+MU_TEST_CASE(test_transient)
+{
+    printf(". testing batch modification w/ transients\n");
+
+    enum { N = 10000 };
+    char **words = NULL;
+    words_load(&words, N);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+
+    /* persistent base version w/ the first half of the words */
+    const struct hamt *base = hamt_create(cfg);
+    for (size_t i = 0; i < N / 2; i++) {
+        const struct hamt *tmp = hamt_pset(base, words[i], words[i]);
+        hamt_release(base);
+        base = tmp;
+    }
+
+    /* batch-add the second half through a transient */
+    struct hamt *t = hamt_transient(base);
+    for (size_t i = N / 2; i < N; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    /* the transient owns its path to the last key and updates in place */
+#if defined(WITH_TABLE_CACHE) && defined(WITH_TABLE_CACHE_STATS)
+    size_t n_allocs = cache_alloc_count(cfg->cache);
+    hamt_set(t, words[N - 1], words[0]);
+    MU_ASSERT(cache_alloc_count(cfg->cache) == n_allocs,
+              "in-place update of an owned path must not allocate");
+#else
+    hamt_set(t, words[N - 1], words[0]);
+#endif
+    const struct hamt *p = hamt_persistent(t);
+
+    MU_ASSERT(hamt_size(base) == N / 2, "transient modified base size");
+    MU_ASSERT(hamt_size(p) == N, "wrong size of transient result");
+    for (size_t i = 0; i < N; i++) {
+        MU_ASSERT(hamt_get(base, words[i]) == (i < N / 2 ? words[i] : NULL),
+                  "transient modified the base version");
+        MU_ASSERT(hamt_get(p, words[i]) == (i < N - 1 ? words[i] : words[0]),
+                  "transient result is missing values");
+    }
+    /* versions derived from the frozen transient share its tables */
+    const struct hamt *q = hamt_premove(p, words[0]);
+    MU_ASSERT(hamt_get(p, words[0]) == words[0], "premove modified its source");
+    MU_ASSERT(hamt_get(q, words[0]) == NULL, "premove failed");
+
+    hamt_release(q);
+    hamt_release(p);
+    hamt_release(base);
+#if defined(WITH_TABLE_CACHE) && defined(WITH_TABLE_CACHE_STATS)
+    for (ptrdiff_t l = 0; l < cfg->cache->pool_count; ++l) {
+        MU_ASSERT(cfg->cache->pools[l].stats.alloc_count ==
+                      cfg->cache->pools[l].stats.free_count,
+                  "releasing all versions leaked tables");
+    }
+#endif
+    words_free(words, N);
+    delete_config(cfg);
+    return 0;
+}
+
+#define CMAP_THREADS 4
+#define CMAP_KEYS 40000
+
+struct cmap_thread_arg {
+    struct hamt_cmap *cmap;
+    char **words;
+    size_t id;
+    bool remove;
+};
+
+/* every writer covers half of the keys, i.e. each key is set twice */
+static void *cmap_writer_fn(void *p)
+{
+    struct cmap_thread_arg *arg = p;
+    for (size_t i = arg->id * CMAP_KEYS / CMAP_THREADS, k = 0;
+         k < CMAP_KEYS / 2; ++k, i = (i + 1) % CMAP_KEYS) {
+        if (arg->remove) {
+            void *value = hamt_cmap_remove(arg->cmap, arg->words[i]);
+            if (value && value != arg->words[i])
+                return p;
+        } else if (hamt_cmap_set(arg->cmap, arg->words[i], arg->words[i]) !=
+                   arg->words[i]) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void *cmap_reader_fn(void *p)
+{
+    struct cmap_thread_arg *arg = p;
+    for (size_t round = 0; round < 4; ++round) {
+        for (size_t i = 0; i < CMAP_KEYS; ++i) {
+            const void *value = hamt_cmap_get(arg->cmap, arg->words[i]);
+            if (value && value != arg->words[i])
+                return p;
+        }
+    }
+    return NULL;
+}
+
+static void cmap_run_threads(struct hamt_cmap *cm, char **words, bool remove,
+                             void *ret[CMAP_THREADS + 1])
+{
+    struct cmap_thread_arg args[CMAP_THREADS + 1];
+    pthread_t threads[CMAP_THREADS + 1];
+    for (size_t t = 0; t <= CMAP_THREADS; ++t) {
+        args[t] = (struct cmap_thread_arg){
+            .cmap = cm, .words = words, .id = t, .remove = remove};
+        pthread_create(&threads[t], NULL,
+                       t < CMAP_THREADS ? cmap_writer_fn : cmap_reader_fn,
+                       &args[t]);
+    }
+    for (size_t t = 0; t <= CMAP_THREADS; ++t)
+        pthread_join(threads[t], &ret[t]);
+}
+
+static int count_key(const void *key, void *ctx)
+{
+    (void)key;
+    *(size_t *)ctx += 1;
+    return 0;
+}
+
+#if !defined(WITH_TABLE_CACHE)
+/* allocator that fails once its budget of allocations is used up */
+static void *budget_malloc(const ptrdiff_t size, void *ctx)
+{
+    return (*(int *)ctx)-- > 0 ? malloc(size) : NULL;
+}
+
+static void *budget_realloc(void *ptr, const ptrdiff_t old_size,
+                            const ptrdiff_t new_size, void *ctx)
+{
+    (void)old_size;
+    return (*(int *)ctx)-- > 0 ? realloc(ptr, new_size) : NULL;
+}
+
+static void budget_free(void *ptr, const ptrdiff_t size, void *ctx)
+{
+    (void)size;
+    (void)ctx;
+    free(ptr);
+}
+#endif
+
+MU_TEST_CASE(test_key_set)
+{
+    printf(". testing key sets\n");
+    size_t n = 20000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n + 1);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt_set *s = hamt_set_create(cfg);
+    for (size_t i = 0; i < n; ++i) {
+        MU_ASSERT(hamt_set_add(s, words[i]) == 1, "add failed");
+    }
+    MU_ASSERT(hamt_set_add(s, words[7]) == 0 && hamt_set_size(s) == n,
+              "duplicate keys must not be added");
+    for (size_t i = 0; i < n; ++i) {
+        MU_ASSERT(hamt_set_contains(s, words[i]), "missing key");
+    }
+    MU_ASSERT(!hamt_set_contains(s, words[n]), "unexpected key");
+    size_t count = 0;
+    MU_ASSERT(hamt_set_foreach(s, count_key, &count) == 0 && count == n,
+              "foreach should visit every key");
+#if defined(WITH_TABLE_CACHE)
+    /* leaves take half the space of trie leaves */
+    struct hamt *t = hamt_create(cfg);
+    struct hamt_table_cache_stats before, after;
+    hamt_table_cache_stats(cfg->cache, &before);
+    for (size_t i = 0; i < n; ++i) {
+        hamt_set(t, words[i], words[i]);
+    }
+    hamt_table_cache_stats(cfg->cache, &after);
+    size_t trie_bytes = after.live_bytes - before.live_bytes;
+    hamt_delete(t);
+    MU_ASSERT(before.live_bytes < 0.7 * trie_bytes,
+              "sets should need less memory than tries");
+#endif
+    /* persistent versions */
+    const struct hamt_set *p = hamt_set_premove(s, words[3]);
+    const struct hamt_set *q = hamt_set_padd(p, words[n]);
+    MU_ASSERT(hamt_set_contains(s, words[3]) && !hamt_set_contains(p, words[3]),
+              "premove must not modify the source version");
+    MU_ASSERT(!hamt_set_contains(p, words[n]) && hamt_set_contains(q, words[n]),
+              "padd must not modify the source version");
+    MU_ASSERT(hamt_set_size(s) == n && hamt_set_size(p) == n - 1 &&
+                  hamt_set_size(q) == n,
+              "wrong sizes");
+    hamt_set_release(p);
+    /* no-ops copy no tables */
+    p = hamt_set_padd(s, words[7]);
+    MU_ASSERT(p->root == s->root, "adding a present key must not copy");
+    hamt_set_release(p);
+    p = hamt_set_premove(s, words[n]);
+    MU_ASSERT(p->root == s->root, "removing a missing key must not copy");
+    hamt_set_release(p);
+    for (size_t i = 0; i < n; i += 2) {
+        MU_ASSERT(hamt_set_remove(s, words[i]) == words[i], "remove failed");
+    }
+    MU_ASSERT(hamt_set_remove(s, words[0]) == NULL, "double remove");
+    for (size_t i = 0; i < n; ++i) {
+        MU_ASSERT(hamt_set_contains(s, words[i]) == (i % 2 == 1),
+                  "wrong keys after removal");
+        MU_ASSERT(hamt_set_contains(q, words[i]) == (i != 3),
+                  "removal must not modify other versions");
+    }
+    for (size_t i = 1; i < n; i += 2) {
+        hamt_set_remove(s, words[i]);
+    }
+    MU_ASSERT(hamt_set_size(s) == 0 && !hamt_set_contains(s, words[1]),
+              "set should be empty");
+    hamt_set_release(q);
+    hamt_set_delete(s);
+    delete_config(cfg);
+#if !defined(WITH_TABLE_CACHE)
+    /* failed allocations are not mistaken for present keys */
+    int budget = 1000;
+    struct hamt_allocator budget_ator = {budget_malloc, budget_realloc,
+                                         budget_free, &budget};
+    cfg = create_config(&budget_ator, my_keyhash_string, my_keycmp_string);
+    s = hamt_set_create(cfg);
+    for (size_t i = 0; i < 100; ++i) {
+        MU_ASSERT(hamt_set_add(s, words[i]) == 1, "add failed");
+    }
+    budget = 1; /* the copy of the set, but none of its (shared) tables */
+    MU_ASSERT(hamt_set_padd(s, words[n]) == NULL,
+              "padd must fail without memory");
+    budget = 1;
+    p = hamt_set_premove(s, words[n]);
+    MU_ASSERT(p && hamt_set_add(s, words[n]) == -1 &&
+                  hamt_set_size(s) == 100 && !hamt_set_contains(s, words[n]),
+              "add must report allocation failures");
+    MU_ASSERT(hamt_set_add(s, words[0]) == 0, "present keys need no memory");
+    hamt_set_release(p);
+    hamt_set_delete(s);
+    delete_config(cfg);
+#endif
+    /* colliding keys end up in buckets */
+    cfg = create_config(&hamt_allocator_default, my_keyhash_constant,
+                        my_keycmp_string);
+    s = hamt_set_create(cfg);
+    for (size_t i = 0; i < 100; ++i) {
+        hamt_set_add(s, words[i]);
+    }
+    p = hamt_set_premove(s, words[50]);
+    for (size_t i = 0; i < 100; i += 2) {
+        MU_ASSERT(hamt_set_remove(s, words[i]) == words[i],
+                  "bucket remove failed");
+    }
+    for (size_t i = 0; i < 100; ++i) {
+        MU_ASSERT(hamt_set_contains(s, words[i]) == (i % 2 == 1) &&
+                      hamt_set_contains(p, words[i]) == (i != 50),
+                  "wrong keys in buckets");
+    }
+    hamt_set_release(p);
+    hamt_set_delete(s);
+    /* emptying buckets with overflow buckets, front to back */
+    s = hamt_set_create(cfg);
+    for (size_t round = 0; round < 2; ++round) {
+        for (size_t i = 0; i < 3 * HAMT_BUCKET_SIZE; ++i) {
+            MU_ASSERT(hamt_set_add(s, words[i]) == 1, "bucket add failed");
+        }
+        for (size_t i = 0; i < 3 * HAMT_BUCKET_SIZE; ++i) {
+            MU_ASSERT(hamt_set_remove(s, words[i]) == words[i],
+                      "bucket remove failed");
+        }
+        MU_ASSERT(hamt_set_size(s) == 0 && !hamt_set_contains(s, words[0]),
+                  "emptied buckets should leave an empty set");
+    }
+    hamt_set_delete(s);
+    delete_config(cfg);
+    words_free(words, n + 1);
+    return 0;
+}
+
+#define FLOOD_KEYS 20000
+#define FLOOD_STACK (16 * 1024)
+
+struct flood_args {
+    struct hamt *trie;
+    struct hamt_set *set;
+    size_t items, keys;
+    struct hamt_stats stats;
+};
+
+static void *flood_walk_fn(void *arg)
+{
+    struct flood_args *a = arg;
+    hamt_foreach(a->trie, count_items, &a->items);
+    hamt_stats(a->trie, &a->stats);
+    hamt_set_foreach(a->set, count_key, &a->keys);
+    hamt_delete(a->trie);
+    hamt_set_delete(a->set);
+    return NULL;
+}
+
+MU_TEST_CASE(test_flood_small_stack)
+{
+    printf(". testing hash flooding on a small stack\n");
+    char **words = NULL;
+    words_load_numbers(&words, 0, FLOOD_KEYS);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_constant, my_keycmp_string);
+    struct flood_args a = {.trie = hamt_create(cfg),
+                           .set = hamt_set_create(cfg)};
+    for (size_t i = 0; i < FLOOD_KEYS; ++i) {
+        hamt_set(a.trie, words[i], words[i]);
+        hamt_set_add(a.set, words[i]);
+    }
+    /* the overflow chain is far deeper than the stack allows frames */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    MU_ASSERT(pthread_attr_setstacksize(&attr, FLOOD_STACK) == 0,
+              "cannot set the stack size");
+    pthread_t thread;
+    MU_ASSERT(pthread_create(&thread, &attr, flood_walk_fn, &a) == 0,
+              "cannot create the walker");
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+    MU_ASSERT(a.items == FLOOD_KEYS && a.keys == FLOOD_KEYS &&
+                  a.stats.leaves == FLOOD_KEYS &&
+                  a.stats.buckets >= FLOOD_KEYS / HAMT_BUCKET_SIZE,
+              "flooded walks are incomplete");
+    delete_config(cfg);
+    words_free(words, FLOOD_KEYS);
+    return 0;
+}
+
+MU_TEST_CASE(test_cmap)
+{
+    printf(". testing concurrent map\n");
+
+    char **words = NULL;
+    words_load_numbers(&words, 0, CMAP_KEYS);
+    struct hamt_config cfg = {.ator = &hamt_allocator_default,
+                              .key_cmp_fn = my_keycmp_string,
+                              .key_hash_fn = my_keyhash_string};
+#if defined(WITH_TABLE_CACHE)
+    struct hamt_table_cache_config tc_cfg = {
+        .bucket_count = hamt_table_cache_config_default_bucket_count,
+        .initial_bucket_sizes = hamt_table_cache_default_bucket_sizes,
+        .backing_allocator = &hamt_allocator_default,
+        .concurrent = true};
+    cfg.cache = hamt_table_cache_create(&tc_cfg);
+#endif
+    struct hamt_cmap *cm = hamt_cmap_create(&cfg);
+
+    /* single-threaded semantics */
+    MU_ASSERT(hamt_cmap_get(cm, words[0]) == NULL, "found key in empty map");
+    MU_ASSERT(hamt_cmap_set(cm, words[0], words[1]) == words[1], "set failed");
+    MU_ASSERT(hamt_cmap_set(cm, words[0], words[0]) == words[0], "set failed");
+    MU_ASSERT(hamt_cmap_size(cm) == 1, "overwriting changed the size");
+    MU_ASSERT(hamt_cmap_get(cm, words[0]) == words[0], "overwrite failed");
+    MU_ASSERT(hamt_cmap_remove(cm, words[1]) == NULL, "removed missing key");
+    MU_ASSERT(hamt_cmap_remove(cm, words[0]) == words[0], "remove failed");
+    MU_ASSERT(hamt_cmap_size(cm) == 0, "wrong size after remove");
+
+    /* full-hash collisions end up in (overflow) buckets */
+    struct hamt_config collide_cfg = cfg;
+    collide_cfg.key_hash_fn = my_keyhash_constant;
+    struct hamt_cmap *cc = hamt_cmap_create(&collide_cfg);
+    size_t n_colliding = 3 * HAMT_BUCKET_SIZE;
+    for (size_t round = 0; round < 2; ++round) {
+        for (size_t i = 0; i < n_colliding; ++i)
+            MU_ASSERT(hamt_cmap_set(cc, words[i], words[i]) == words[i],
+                      "bucket insert failed");
+        MU_ASSERT(hamt_cmap_size(cc) == n_colliding, "wrong bucket size");
+        for (size_t i = 0; i < n_colliding; ++i)
+            MU_ASSERT(hamt_cmap_get(cc, words[i]) == words[i],
+                      "bucket lookup failed");
+        MU_ASSERT(hamt_cmap_get(cc, words[n_colliding]) == NULL,
+                  "found missing key in bucket");
+        for (size_t i = 0; i < n_colliding; ++i)
+            MU_ASSERT(hamt_cmap_remove(cc, words[i]) == words[i],
+                      "bucket remove failed");
+        MU_ASSERT(hamt_cmap_size(cc) == 0, "bucket remove left keys");
+    }
+    hamt_cmap_delete(cc);
+
+    collide_cfg = cfg;
+    collide_cfg.root_levels = 1;
+    MU_ASSERT(hamt_cmap_create(&collide_cfg) == NULL, "accepted a wide root");
+    collide_cfg = cfg;
+    collide_cfg.arena = true;
+    MU_ASSERT(hamt_cmap_create(&collide_cfg) == NULL, "accepted an arena");
+
+    /* concurrent writers with a concurrent reader */
+    void *ret[CMAP_THREADS + 1];
+    cmap_run_threads(cm, words, false, ret);
+    for (size_t t = 0; t <= CMAP_THREADS; ++t)
+        MU_ASSERT(ret[t] == NULL, "thread observed a wrong value");
+    MU_ASSERT(hamt_cmap_size(cm) == CMAP_KEYS, "lost or duplicated keys");
+    for (size_t i = 0; i < CMAP_KEYS; ++i)
+        MU_ASSERT(hamt_cmap_get(cm, words[i]) == words[i], "lost a key");
+
+    cmap_run_threads(cm, words, true, ret);
+    for (size_t t = 0; t <= CMAP_THREADS; ++t)
+        MU_ASSERT(ret[t] == NULL, "thread observed a wrong value");
+    MU_ASSERT(hamt_cmap_size(cm) == 0, "concurrent removal left keys");
+    for (size_t i = 0; i < CMAP_KEYS; ++i)
+        MU_ASSERT(hamt_cmap_get(cm, words[i]) == NULL, "failed to remove");
+
+    hamt_cmap_delete(cm);
+#if defined(WITH_TABLE_CACHE)
+    hamt_table_cache_delete(cfg.cache);
+    free(cfg.cache);
+#endif
+    words_free(words, CMAP_KEYS);
+    return 0;
+}
+
+#define ATOM_READERS 3
+#define ATOM_KEYS 20000
+
+struct atom_reader_arg {
+    struct hamt_atom *atom;
+    char **words;
+};
+
+/* versions are prefixes of `words`: check that each snapshot is complete */
+static void *atom_reader_fn(void *p)
+{
+    struct atom_reader_arg *arg = p;
+    size_t last = 0;
+    while (last < ATOM_KEYS) {
+        const struct hamt *t = hamt_atom_read_begin(arg->atom);
+        size_t n = hamt_size(t);
+        bool ok = n >= last && (n == 0 || hamt_get(t, arg->words[n - 1]) ==
+                                              arg->words[n - 1]);
+        if (n < ATOM_KEYS)
+            ok = ok && hamt_get(t, arg->words[n]) == NULL;
+        hamt_atom_read_end(arg->atom);
+        if (!ok)
+            return p;
+        last = n;
+    }
+    return NULL;
+}
+
+MU_TEST_CASE(test_atom)
+{
+    printf(". testing atoms\n");
+
+    char **words = NULL;
+    words_load_numbers(&words, 0, ATOM_KEYS);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt_atom *atom = hamt_atom_create(hamt_create(cfg));
+
+    /* single writer, concurrent readers */
+    struct atom_reader_arg arg = {.atom = atom, .words = words};
+    pthread_t readers[ATOM_READERS];
+    for (size_t t = 0; t < ATOM_READERS; ++t)
+        pthread_create(&readers[t], NULL, atom_reader_fn, &arg);
+    for (size_t i = 0; i < ATOM_KEYS; ++i) {
+        const struct hamt *cur = hamt_atom_load(atom);
+        MU_ASSERT(hamt_atom_store(atom, hamt_pset(cur, words[i], words[i])),
+                  "failed to publish a version");
+    }
+    for (size_t t = 0; t < ATOM_READERS; ++t) {
+        void *ret;
+        pthread_join(readers[t], &ret);
+        MU_ASSERT(ret == NULL, "reader observed an inconsistent version");
+    }
+
+    /* compare-exchange only succeeds on the current version */
+    const struct hamt *cur = hamt_atom_load(atom);
+    const struct hamt *next = hamt_premove(cur, words[0]);
+    const struct hamt *expected = next;
+    MU_ASSERT(!hamt_atom_compare_exchange(atom, &expected, next),
+              "exchanged a stale version");
+    MU_ASSERT(expected == cur, "failed exchange must load the current version");
+    MU_ASSERT(hamt_atom_compare_exchange(atom, &expected, next),
+              "failed to exchange the current version");
+    MU_ASSERT(hamt_atom_load(atom) == next, "exchange did not publish");
+
+    /* deleting the atom releases the current and all replaced versions */
+    hamt_atom_delete(atom);
+#if defined(WITH_TABLE_CACHE) && defined(WITH_TABLE_CACHE_STATS)
+    for (ptrdiff_t l = 0; l < cfg->cache->pool_count; ++l) {
+        MU_ASSERT(cfg->cache->pools[l].stats.alloc_count ==
+                      cfg->cache->pools[l].stats.free_count,
+                  "replaced versions leaked tables");
+    }
+#endif
+    words_free(words, ATOM_KEYS);
+    delete_config(cfg);
+    return 0;
+}
+
+MU_TEST_CASE(test_create_from_array)
+{
+    printf(". testing bulk loading\n");
+
+    enum { N_DUPLICATES = 1000 };
+    char **words = NULL;
+    words_load(&words, WORDS_MAX);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+
+    /* input w/ duplicate keys at the end: the last value wins */
+    size_t n = WORDS_MAX + N_DUPLICATES;
+    void **keys = malloc(n * sizeof(void *));
+    void **values = malloc(n * sizeof(void *));
+    for (size_t i = 0; i < WORDS_MAX; ++i) {
+        keys[i] = values[i] = words[i];
+    }
+    for (size_t i = 0; i < N_DUPLICATES; ++i) {
+        keys[WORDS_MAX + i] = words[i];
+        values[WORDS_MAX + i] = words[WORDS_MAX - 1 - i];
+    }
+    struct hamt *t = hamt_create_from_array(cfg, keys, values, n);
+    MU_ASSERT(t != NULL, "bulk load failed");
+    MU_ASSERT(hamt_size(t) == WORDS_MAX, "wrong size after bulk load");
+
+    /* the reference trie w/ the same contents */
+    struct hamt *r = hamt_create(cfg);
+    for (size_t i = 0; i < n; ++i) {
+        hamt_set(r, keys[i], values[i]);
+    }
+    for (size_t i = 0; i < WORDS_MAX; ++i) {
+        MU_ASSERT(hamt_get(t, words[i]) == hamt_get(r, words[i]),
+                  "bulk loaded trie returns the wrong value");
+    }
+    /* the trie structure is fully defined by the keys, hence iteration
+     * order must be identical */
+    struct hamt_iterator *it = hamt_it_create(t);
+    struct hamt_iterator *rit = hamt_it_create(r);
+    while (hamt_it_valid(it) && hamt_it_valid(rit)) {
+        MU_ASSERT(hamt_it_get_key(it) == hamt_it_get_key(rit),
+                  "bulk loaded trie differs in structure");
+        hamt_it_next(it);
+        hamt_it_next(rit);
+    }
+    MU_ASSERT(!hamt_it_valid(it) && !hamt_it_valid(rit),
+              "bulk loaded trie differs in size");
+    hamt_it_delete(it);
+    hamt_it_delete(rit);
+
+    /* the result is a regular trie */
+    for (size_t i = 0; i < WORDS_MAX; ++i) {
+        MU_ASSERT(hamt_remove(t, words[i]) != NULL, "remove failed");
+    }
+    MU_ASSERT(hamt_size(t) == 0, "trie should be empty");
+    hamt_delete(t);
+    hamt_delete(r);
+
+    /* corner cases */
+    t = hamt_create_from_array(cfg, keys, values, 0);
+    MU_ASSERT(t && hamt_size(t) == 0, "empty bulk load failed");
+    hamt_delete(t);
+    t = hamt_create_from_array(cfg, keys, values, 1);
+    MU_ASSERT(t && hamt_get(t, words[0]) == words[0], "single bulk load failed");
+    hamt_delete(t);
+
+    free(values);
+    free(keys);
+    words_free(words, WORDS_MAX);
+    delete_config(cfg);
+    return 0;
+}
+
+MU_TEST_CASE(test_wide_root)
+{
+    printf(". testing wide roots\n");
+    char **words = NULL;
+    words_load(&words, WORDS_MAX);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    cfg->root_levels = HAMT_MAX_ROOT_LEVELS + 1;
+    MU_ASSERT(hamt_create(cfg) == NULL, "accepted too many root levels");
+    for (size_t levels = 1; levels <= 2; ++levels) {
+        cfg->root_levels = levels;
+        struct hamt *t = hamt_create(cfg);
+        for (size_t i = 0; i < WORDS_MAX; ++i) {
+            hamt_set(t, words[i], words[i]);
+        }
+        MU_ASSERT(hamt_size(t) == WORDS_MAX, "wrong size");
+        for (size_t i = 0; i < WORDS_MAX; ++i) {
+            MU_ASSERT(hamt_get(t, words[i]) == words[i], "wrong value");
+        }
+        /* all leaves sit below the root levels */
+        struct hamt_stats stats;
+        hamt_stats(t, &stats);
+        MU_ASSERT(stats.leaves == WORDS_MAX && stats.depth[levels - 1] == 0,
+                  "unexpected structure");
+        size_t n_items = 0;
+        hamt_foreach(t, count_items, &n_items);
+        MU_ASSERT(n_items == WORDS_MAX, "wrong foreach count");
+        n_items = 0;
+        struct hamt_iterator *it = hamt_it_create(t);
+        for (; hamt_it_valid(it); hamt_it_next(it))
+            n_items++;
+        hamt_it_delete(it);
+        MU_ASSERT(n_items == WORDS_MAX, "wrong iteration count");
+        /* the bulk loader builds the same trie */
+        struct hamt *b = hamt_create_from_array(cfg, (void **)words,
+                                                (void **)words, WORDS_MAX);
+        MU_ASSERT(b && hamt_equal(t, b), "bulk loaded trie differs");
+        hamt_delete(b);
+        /* persistent modification */
+        const struct hamt *p = hamt_premove(t, words[0]);
+        const struct hamt *q = hamt_pset(p, words[1], words[0]);
+        MU_ASSERT(hamt_get(t, words[0]) && !hamt_get(p, words[0]) &&
+                      hamt_get(p, words[1]) == words[1] &&
+                      hamt_get(q, words[1]) == words[0],
+                  "persistent modification changed its source");
+        struct diff_counts dc = {0};
+        hamt_diff(t, q, count_diff, &dc);
+        MU_ASSERT(dc.only_a == 1 && dc.only_b == 0 && dc.changed == 1,
+                  "wrong difference");
+        MU_ASSERT(!hamt_equal(t, q), "versions should differ");
+        hamt_release(q);
+        hamt_release(p);
+        MU_ASSERT(hamt_serialize(t, stdout, NULL) == -1,
+                  "serialized a wide root");
+        for (size_t i = 0; i < WORDS_MAX; ++i) {
+            MU_ASSERT(hamt_remove(t, words[i]) == words[i], "remove failed");
+        }
+        MU_ASSERT(hamt_size(t) == 0, "trie should be empty");
+        hamt_stats(t, &stats);
+        MU_ASSERT(stats.tables == 0, "empty trie holds tables");
+        hamt_delete(t);
+    }
+    words_free(words, WORDS_MAX);
+    delete_config(cfg);
+    return 0;
+}
+
+/* allocator that keeps track of the bytes in use */
+static void *counting_malloc(const ptrdiff_t size, void *ctx)
+{
+    *(ptrdiff_t *)ctx += size;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, const ptrdiff_t old_size,
+                              const ptrdiff_t new_size, void *ctx)
+{
+    *(ptrdiff_t *)ctx += new_size - old_size;
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void *ptr, const ptrdiff_t size, void *ctx)
+{
+    *(ptrdiff_t *)ctx -= size;
+    free(ptr);
+}
+
+MU_TEST_CASE(test_arena)
+{
+    printf(". testing arena tries\n");
+    char **words = NULL;
+    words_load(&words, WORDS_MAX);
+    ptrdiff_t in_use = 0;
+    struct hamt_allocator ator = {counting_malloc, counting_realloc,
+                                  counting_free, &in_use};
+    struct hamt_config cfg = {.ator = &ator,
+                              .key_cmp_fn = my_keycmp_string,
+                              .key_hash_fn = my_keyhash_string,
+                              .arena = true};
+    struct hamt *t = hamt_create(&cfg);
+    MU_ASSERT(t && t->arena, "no arena");
+    for (size_t i = 0; i < WORDS_MAX; ++i) {
+        hamt_set(t, words[i], words[i]);
+    }
+    /* tables freed on the way are reused from the arena */
+    for (size_t i = 0; i < WORDS_MAX; i += 2) {
+        MU_ASSERT(hamt_remove(t, words[i]) == words[i], "remove failed");
+    }
+    struct hamt_table_cache_stats stats;
+    hamt_table_cache_stats(t->arena->tables, &stats);
+    MU_ASSERT(stats.live_bytes > 0 && stats.chunk_bytes >= stats.live_bytes,
+              "tables do not come from the arena");
+    /* versions share the arena, which goes with the last of them */
+    const struct hamt *v = hamt_pset(t, words[0], words[1]);
+    MU_ASSERT(v->arena == t->arena, "version does not share the arena");
+    hamt_delete(t);
+    for (size_t i = 0; i < WORDS_MAX; ++i) {
+        const void *expected = i == 0 ? words[1] : i % 2 ? words[i] : NULL;
+        MU_ASSERT(hamt_get(v, words[i]) == expected, "version corrupted");
+    }
+    hamt_release(v);
+    MU_ASSERT(in_use == 0, "arena leaked memory");
+    words_free(words, WORDS_MAX);
+    return 0;
+}
+
+MU_TEST_CASE(test_atom_reclaim)
+{
+    printf(". testing atom reclamation without stores\n");
+    ptrdiff_t in_use = 0;
+    struct hamt_allocator ator = {counting_malloc, counting_realloc,
+                                  counting_free, &in_use};
+    struct hamt_config *cfg =
+        create_config(&ator, my_keyhash_string, my_keycmp_string);
+    static char key[] = "key";
+    struct hamt_atom *atom = hamt_atom_create(hamt_create(cfg));
+    hamt_atom_store(atom, hamt_pset(hamt_atom_load(atom), key, key));
+    /* a single store does not advance the epoch */
+    ptrdiff_t retired = in_use;
+    MU_ASSERT(hamt_atom_reclaim(atom) && in_use < retired,
+              "replaced version not freed");
+    /* read sections that may see a replaced version hold it back */
+    const struct hamt *t = hamt_atom_read_begin(atom);
+    hamt_atom_store(atom, hamt_premove(hamt_atom_load(atom), key));
+    retired = in_use;
+    MU_ASSERT(!hamt_atom_reclaim(atom) && in_use == retired &&
+                  hamt_get(t, key) == key,
+              "version freed during a read section");
+    hamt_atom_read_end(atom);
+    MU_ASSERT(hamt_atom_reclaim(atom) && in_use < retired,
+              "replaced version not freed after the read section");
+    hamt_atom_delete(atom);
+    delete_config(cfg);
+    return 0;
+}
+
+#if defined(WITH_TABLE_SLACK)
+MU_TEST_CASE(test_table_slack)
+{
+    printf(". testing slack-capacity tables\n");
+    MU_ASSERT(table_capacity(1) == 1 && table_capacity(2) == 2 &&
+                  table_capacity(3) == 4 && table_capacity(5) == 8 &&
+                  table_capacity(17) == 32 && table_capacity(32) == 32,
+              "unexpected capacity classes");
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    char keys[] = "abcdefgh";
+    /* rows are added at the front such that every row moves */
+    struct hamt_node *table = NULL;
+    for (size_t n_rows = 0; n_rows < 8; ++n_rows) {
+        table_extend(t, t->root, n_rows, 31 - n_rows, 0);
+        TABLE(t->root)[0].as.kv.key = &keys[n_rows];
+        TABLE(t->root)[0].as.kv.value = tagged(&keys[n_rows]);
+        bool in_place = table_capacity(n_rows + 1) == table_capacity(n_rows);
+        MU_ASSERT(in_place == (TABLE(t->root) == table),
+                  "table should be extended in place iff it has a spare row");
+        table = TABLE(t->root);
+        for (size_t i = 0; i <= n_rows; ++i) {
+            MU_ASSERT(table[i].as.kv.key == &keys[n_rows - i], "rows out of order");
+        }
+    }
+    /* remove from the front */
+    for (size_t n_rows = 8; n_rows > 1; --n_rows) {
+        table_shrink(t, t->root, n_rows, 32 - n_rows, 0);
+        bool in_place = table_capacity(n_rows - 1) == table_capacity(n_rows);
+        MU_ASSERT(in_place == (TABLE(t->root) == table),
+                  "table should be shrunk in place iff the capacity fits");
+        table = TABLE(t->root);
+        for (size_t i = 0; i < n_rows - 1; ++i) {
+            MU_ASSERT(table[i].as.kv.key == &keys[n_rows - 2 - i],
+                      "rows out of order");
+        }
+    }
+    hamt_delete(t);
+    delete_config(cfg);
+    return 0;
+}
+#endif
+
+#if defined(WITH_CHAMP_LAYOUT)
+/* Check the CHAMP layout of the subtrie at `anchor`: leaves first, the node
+ * map marks exactly the subtable rows; returns the number of violations */
+static size_t check_champ_layout(const struct hamt_node *anchor)
+{
+    uint32_t index = INDEX(anchor), nodemap = NODEMAP(anchor);
+    size_t errors = (nodemap & ~index) != 0;
+    for (uint32_t bits = index; bits; bits &= bits - 1) {
+        uint32_t ix = __builtin_ctz(bits);
+        const struct hamt_node *row = &TABLE(anchor)[row_pos(anchor, ix)];
+        bool leaf = is_value(VALUE(row));
+        errors += leaf != (row - TABLE(anchor) < row_leaves(anchor));
+        errors += leaf == ((nodemap >> ix) & 1);
+        if (!leaf)
+            errors += check_champ_layout(row);
+    }
+    return errors;
+}
+
+struct key_list {
+    const void **keys;
+    size_t n;
+};
+
+static int collect_key(const void *key, const void *value, void *ctx)
+{
+    (void)value;
+    struct key_list *l = ctx;
+    l->keys[l->n++] = key;
+    return 0;
+}
+
+MU_TEST_CASE(test_champ_layout)
+{
+    printf(". testing the CHAMP node layout\n");
+    size_t n = 5000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    /* a: ascending inserts; b: descending inserts with churn */
+    struct hamt *a = hamt_create(cfg), *b = hamt_create(cfg);
+    for (size_t i = 0; i < n; ++i) {
+        hamt_set(a, words[i], words[i]);
+        hamt_set(b, words[n - 1 - i], words[n - 1 - i]);
+    }
+    for (size_t i = 0; i < n; i += 3) {
+        hamt_remove(a, words[i]);
+    }
+    const struct hamt *p = hamt_persistent(b);
+    for (size_t i = 0; i < n; i += 3) {
+        const struct hamt *q = hamt_premove(p, words[i]);
+        hamt_release(p);
+        p = q;
+    }
+    MU_ASSERT(check_champ_layout(a->root) == 0, "broken layout");
+    MU_ASSERT(check_champ_layout(p->root) == 0, "broken persistent layout");
+    /* the canonical form does not depend on the history */
+    MU_ASSERT(hamt_equal(a, p) && hamt_equal(p, a), "tries should be equal");
+    struct key_list ka = {calloc(n, sizeof(void *)), 0};
+    struct key_list kb = {calloc(n, sizeof(void *)), 0};
+    hamt_foreach(a, collect_key, &ka);
+    hamt_foreach(p, collect_key, &kb);
+    MU_ASSERT(ka.n == hamt_size(a) && kb.n == ka.n &&
+                  memcmp(ka.keys, kb.keys, ka.n * sizeof(void *)) == 0,
+              "iteration order should be canonical");
+    hamt_remove(a, words[1]);
+    MU_ASSERT(!hamt_equal(a, p), "tries should differ");
+    free(kb.keys);
+    free(ka.keys);
+    hamt_release(p);
+    hamt_delete(a);
+    delete_config(cfg);
+    /* buckets keep the overflow row in the node map */
+    cfg = create_config(&hamt_allocator_default, my_keyhash_constant,
+                        my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    for (size_t i = 0; i < 200; ++i) {
+        hamt_set(t, words[i], words[i]);
+    }
+    MU_ASSERT(check_champ_layout(t->root) == 0, "broken bucket layout");
+    for (size_t i = 0; i < 200; i += 2) {
+        hamt_remove(t, words[i]);
+    }
+    MU_ASSERT(check_champ_layout(t->root) == 0, "broken bucket layout");
+    for (size_t i = 1; i < 200; i += 2) {
+        MU_ASSERT(hamt_get(t, words[i]) == words[i], "lost a leaf");
+    }
+    hamt_delete(t);
+    delete_config(cfg);
+    words_free(words, n);
+    return 0;
+}
+#endif
+
+MU_TEST_CASE(test_table_extend)
+{
+    printf(". testing table_extend\n");
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
     struct hamt *t = hamt_create(cfg);
     MU_ASSERT(get_popcount(INDEX(t->root)) == 0,
               "root should have zero descendants");
@@ -1141,12 +3359,12 @@ MU_TEST_CASE(test_persistent_setget_one)
     /* create a standard HAMT with string keys */
     struct hamt_config *cfg = create_config(
         &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
-    const struct hamt *t;
-    t = hamt_create(cfg);
+    const struct hamt *empty = hamt_create(cfg);
     /* add a single key */
     char key[] __attribute__((aligned(8))) = "the_key";
     char value[] __attribute__((aligned(8))) = "the_value";
-    t = hamt_pset(t, key, value);
+    const struct hamt *t = hamt_pset(empty, key, value);
+    hamt_release(empty);
     MU_ASSERT(hamt_size(t) == 1, "wrong size after set");
     /* make sure we can find it */
     char *val = (char *)hamt_get(t, key);
@@ -1160,10 +3378,16 @@ MU_TEST_CASE(test_persistent_setget_one)
               "key should still be present original trie");
     MU_ASSERT(hamt_get(s, key) == NULL,
               "key should have been removed from copy");
-    /*
-     * There is no way to cleanly free the structurally shared
-     * tries without garbage collection. Leak them.
-     */
+    /* removing a missing key shares all tables */
+    char other[] __attribute__((aligned(8))) = "other_key";
+    const struct hamt *u = hamt_premove(t, other);
+    MU_ASSERT(hamt_size(u) == 1, "removing a missing key changed the size");
+    MU_ASSERT(u->root[0].as.table.ptr == t->root[0].as.table.ptr,
+              "removing a missing key copied the root table");
+    hamt_release(u);
+    hamt_release(s);
+    hamt_release(t);
+    delete_config(cfg);
     return 0;
 }
 
@@ -1180,7 +3404,9 @@ MU_TEST_CASE(test_persistent_remove_aspell_dict_en)
     t = hamt_create(cfg);
     for (size_t i = 0; i < WORDS_MAX; i++) {
         /* structural sharing */
-        t = hamt_pset(t, words[i], words[i]);
+        const struct hamt *s = hamt_pset(t, words[i], words[i]);
+        hamt_release(t);
+        t = s;
     }
 
     /*
@@ -1205,15 +3431,108 @@ MU_TEST_CASE(test_persistent_remove_aspell_dict_en)
 
         MU_ASSERT(hamt_get(s, words[i]) == NULL,
                   "key should have been removed from copy");
-        /* leak the previous version */
+        /* drop the previous version */
+        hamt_release(t);
         t = s;
     }
 
+    MU_ASSERT(hamt_size(t) == 0, "trie should be empty");
+    hamt_release(t);
     words_free(words, WORDS_MAX);
-    /*
-     * There is no way to cleanly free the structurally shared
-     * tries without garbage collection. Leak them.
-     */
+    delete_config(cfg);
+    return 0;
+}
+
+/* Check the invariants that relate the individual counts */
+static int check_stats(const struct hamt *t, const struct hamt_stats *s)
+{
+    size_t n_leaves = 0, n_tables = 0, n_rows = 0;
+    size_t bytes = sizeof(struct hamt) + sizeof(struct hamt_node);
+    for (size_t d = 0; d < HAMT_STATS_MAX_DEPTH; ++d)
+        n_leaves += s->depth[d];
+    for (size_t r = 0; r <= 32; ++r) {
+        n_tables += s->rows[r];
+        n_rows += r * s->rows[r];
+        bytes +=
+            (table_capacity(r) + 1) * s->rows[r] * sizeof(struct hamt_node);
+    }
+    return s->leaves == hamt_size(t) && n_leaves == s->leaves &&
+           n_tables == s->tables && bytes == s->bytes &&
+           /* every row is a leaf or refers to one of the non-root tables */
+           (s->tables == 0 || n_rows == s->leaves + s->tables - 1);
+}
+
+MU_TEST_CASE(test_stats)
+{
+    printf(". testing trie and table cache statistics\n");
+    size_t n = 10000;
+    char **words = NULL;
+    words_load_numbers(&words, 0, n);
+    struct hamt_config *cfg = create_config(
+        &hamt_allocator_default, my_keyhash_string, my_keycmp_string);
+    struct hamt *t = hamt_create(cfg);
+    struct hamt_stats stats;
+    hamt_stats(t, &stats);
+    MU_ASSERT(stats.tables == 0 && stats.leaves == 0, "empty trie has stats");
+    for (size_t i = 0; i < n; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    hamt_stats(t, &stats);
+    MU_ASSERT(check_stats(t, &stats), "inconsistent stats");
+    MU_ASSERT(stats.buckets == 0, "unexpected collision buckets");
+    MU_ASSERT(stats.max_depth >= 2 && stats.max_depth < 6, "unexpected depth");
+#if defined(WITH_TABLE_CACHE)
+    /* the cache is exclusive to `t` */
+    struct hamt_table_cache_stats cs;
+    hamt_table_cache_stats(cfg->cache, &cs);
+    size_t live = 0;
+    for (size_t i = 0; i < cs.pool_count; ++i) {
+        MU_ASSERT(cs.pools[i].table_size == i + 2, "wrong table size");
+        MU_ASSERT(cs.pools[i].live + cs.pools[i].free == cs.pools[i].peak,
+                  "pool counts do not add up");
+        live += cs.pools[i].live;
+    }
+    MU_ASSERT(live == stats.tables, "live tables != trie tables");
+    MU_ASSERT(cs.live_bytes == stats.bytes - sizeof(struct hamt) -
+                                   sizeof(struct hamt_node),
+              "live bytes != table bytes");
+    MU_ASSERT(cs.chunk_bytes >= cs.live_bytes, "chunks smaller than tables");
+#endif
+    /* a persistent version shares all but the modified path */
+    const struct hamt *v = hamt_pset(t, words[0], words[1]);
+    struct hamt_stats vstats;
+    hamt_stats(v, &vstats);
+    MU_ASSERT(check_stats(v, &vstats) && vstats.bytes == stats.bytes,
+              "version stats differ");
+    hamt_release(v);
+    for (size_t i = 0; i < n; i++) {
+        hamt_remove(t, words[i]);
+    }
+    hamt_stats(t, &stats);
+    MU_ASSERT(check_stats(t, &stats) && stats.leaves == 0, "stats not empty");
+#if defined(WITH_TABLE_CACHE)
+    hamt_table_cache_stats(cfg->cache, &cs);
+    for (size_t i = 0; i < cs.pool_count; ++i) {
+        MU_ASSERT(cs.pools[i].live == 0, "leaked tables");
+    }
+#endif
+    hamt_delete(t);
+    delete_config(cfg);
+
+    /* colliding keys end up in buckets */
+    cfg = create_config(&hamt_allocator_default, my_keyhash_constant,
+                        my_keycmp_string);
+    t = hamt_create(cfg);
+    for (size_t i = 0; i < 100; i++) {
+        hamt_set(t, words[i], words[i]);
+    }
+    hamt_stats(t, &stats);
+    MU_ASSERT(check_stats(t, &stats), "inconsistent bucket stats");
+    MU_ASSERT(stats.buckets == 4 && stats.depth[HAMT_BUCKET_DEPTH] == 31,
+              "unexpected bucket stats");
+    hamt_delete(t);
+    delete_config(cfg);
+    words_free(words, n);
     return 0;
 }
 
@@ -1256,7 +3575,7 @@ MU_TEST_CASE(test_tree_depth)
                                      .depth = 0,
                                      .shift = 0};
             struct search_result sr =
-                search_recursive(t, t->root, hash, t->key_cmp, words[i], NULL);
+                search(t, t->root, hash, t->key_cmp, words[i], false);
             if (sr.status != SEARCH_SUCCESS) {
                 printf("tree search failed for: %s\n", words[i]);
                 continue;
@@ -1278,6 +3597,13 @@ MU_TEST_CASE(test_tree_depth)
         printf("    Avg depth for %lu items: %0.3f, expected %0.3f, max: %lu\n",
                n_items, avg_depth, log2(n_items) / 5.0,
                max_depth); /* log_32(n_items) */
+        struct hamt_stats stats;
+        hamt_stats(t, &stats);
+        double stats_depth = 0.0;
+        for (size_t d = 0; d < HAMT_STATS_MAX_DEPTH; ++d)
+            stats_depth += d * stats.depth[d] / (double)stats.leaves;
+        MU_ASSERT(stats.max_depth == max_depth, "max depth mismatch");
+        MU_ASSERT(fabs(stats_depth - avg_depth) < 1e-6, "avg depth mismatch");
         hamt_delete(t);
         delete_config(cfg);
     }
@@ -1291,12 +3617,15 @@ MU_TEST_SUITE(test_suite)
 {
     /* hashing tests */
     MU_RUN_TEST(test_murmur3_x86_32);
+    MU_RUN_TEST(test_page_allocator);
 
     /* table cache tests */
 #if defined(WITH_TABLE_CACHE)
     MU_RUN_TEST(cache_test_create_delete);
     MU_RUN_TEST(cache_test_allocator_stride);
     MU_RUN_TEST(cache_test_freelist_addressing);
+    MU_RUN_TEST(cache_test_concurrent);
+    MU_RUN_TEST(cache_test_adaptive_trim);
 #endif
 
     /* HAMT data structure tests */
@@ -1310,6 +3639,14 @@ MU_TEST_SUITE(test_suite)
     MU_RUN_TEST(test_set_stringkeys);
     MU_RUN_TEST(test_setget_zero);
     MU_RUN_TEST(test_setget_large_scale);
+    MU_RUN_TEST(test_create_from_array);
+    MU_RUN_TEST(test_wide_root);
+    MU_RUN_TEST(test_arena);
+    MU_RUN_TEST(test_get_many);
+    MU_RUN_TEST(test_set_deep_collisions);
+#if defined(WITH_LEAF_HASHES)
+    MU_RUN_TEST(test_leaf_hashes);
+#endif
     MU_RUN_TEST(test_shrink_table);
     MU_RUN_TEST(test_gather_table);
     MU_RUN_TEST(test_remove);
@@ -1317,13 +3654,41 @@ MU_TEST_SUITE(test_suite)
     MU_RUN_TEST(test_size);
     MU_RUN_TEST(test_iterators);
     MU_RUN_TEST(test_iterators_1m);
+    MU_RUN_TEST(test_iterators_deep);
+    MU_RUN_TEST(test_par_foreach);
+    MU_RUN_TEST(test_set_operations);
+    MU_RUN_TEST(test_changes);
+    MU_RUN_TEST(test_serialize_mapped);
+    MU_RUN_TEST(test_snapshot_writer);
+    MU_RUN_TEST(test_hash64);
+    MU_RUN_TEST(test_collision_buckets);
+    MU_RUN_TEST(test_flood_small_stack);
+#if UINTPTR_MAX >= UINT64_MAX
+    MU_RUN_TEST(test_int_keys);
+#endif
+    MU_RUN_TEST(test_define);
+    MU_RUN_TEST(test_upsert);
     // persistent data structure tests
     MU_RUN_TEST(test_persistent_set);
     MU_RUN_TEST(test_persistent_aspell_dict_en);
     MU_RUN_TEST(test_persistent_remove_aspell_dict_en);
     MU_RUN_TEST(test_table_extend);
+#if defined(WITH_TABLE_SLACK)
+    MU_RUN_TEST(test_table_slack);
+#endif
+#if defined(WITH_CHAMP_LAYOUT)
+    MU_RUN_TEST(test_champ_layout);
+#endif
     MU_RUN_TEST(test_persistent_setget_one);
+    MU_RUN_TEST(test_persistent_release);
+    MU_RUN_TEST(test_pset_many);
+    MU_RUN_TEST(test_transient);
+    MU_RUN_TEST(test_cmap);
+    MU_RUN_TEST(test_key_set);
+    MU_RUN_TEST(test_atom);
+    MU_RUN_TEST(test_atom_reclaim);
     // tree statistics
+    MU_RUN_TEST(test_stats);
     MU_RUN_TEST(test_tree_depth);
     return 0;
 }